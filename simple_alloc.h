@@ -0,0 +1,247 @@
+/*
+ * Allocator hooks shared by simple_array.h and simple_map.h, and a simple
+ * bump arena that can back both containers.
+ *
+ * Global configuration (define before including any simple_ds header):
+ *   - SIMPLE_DS_MALLOC(size):        Allocation function used when a container has no allocator.
+ *   - SIMPLE_DS_CALLOC(count, size): Zeroed allocation (defaults to calloc, or to
+ *                                    SIMPLE_DS_MALLOC + memset if only that is overridden).
+ *   - SIMPLE_DS_REALLOC(ptr, size):  Reallocation function.
+ *   - SIMPLE_DS_FREE(ptr):           Deallocation function.
+ *   - SIMPLE_DS_NO_MAGIC:            Leave the magic number out of every hidden header.
+ *
+ * Per-container allocators:
+ *   A container can instead be bound to a simple_allocator (see array_set_allocator,
+ *   map_set_allocator and dict_set_allocator). The allocator pointer is stored in the
+ *   container's hidden header and is used for every later allocation, including dup and
+ *   free. The allocator must outlive every container that uses it.
+ *
+ * Arena:
+ *   - simple_arena_init(arena, chunk_size):  Initializes an empty arena.
+ *   - simple_arena_allocator(arena):         Returns the arena's simple_allocator.
+ *   - simple_arena_reset(arena):             Drops every allocation but keeps the first chunk.
+ *   - simple_arena_free(arena):              Releases all of the arena's memory.
+ *
+ *   Allocations are bumped out of chunks of at least chunk_size bytes. Freeing or
+ *   growing the most recent allocation is done in place; any other free is a no-op,
+ *   and the memory is reclaimed when the arena is reset or freed.
+ *
+ * Example:
+ *     simple_arena arena;
+ *     simple_arena_init(&arena, 64 * 1024);
+ *     int *values = NULL;
+ *     array_set_allocator(values, simple_arena_allocator(&arena));
+ *     array_push(values, 42);
+ *     ...
+ *     simple_arena_free(&arena);  // frees values (without array_free)
+ */
+
+#ifndef SIMPLE_ALLOC_H
+#define SIMPLE_ALLOC_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <assert.h>
+
+#ifndef SIMPLE_DS_CALLOC
+#ifdef SIMPLE_DS_MALLOC
+#define SIMPLE_DS_CALLOC(count, size) _simple_ds_calloc_fallback((count) * (size))
+#else
+#define SIMPLE_DS_CALLOC(count, size) calloc((count), (size))
+#endif
+#endif
+
+#ifndef SIMPLE_DS_MALLOC
+#define SIMPLE_DS_MALLOC(size) malloc(size)
+#endif
+
+#ifndef SIMPLE_DS_REALLOC
+#define SIMPLE_DS_REALLOC(ptr, size) realloc((ptr), (size))
+#endif
+
+#ifndef SIMPLE_DS_FREE
+#define SIMPLE_DS_FREE(ptr) free(ptr)
+#endif
+
+/* Every hidden header ends with a magic number that is asserted on each access to the
+ * header. SIMPLE_DS_NO_MAGIC leaves the field out, which shrinks the headers and drops
+ * the store and the check even in builds without NDEBUG.
+ */
+#ifdef SIMPLE_DS_NO_MAGIC
+#define SIMPLE_DS_SET_MAGIC(hdr, magic)   ((void)0)
+#define SIMPLE_DS_CHECK_MAGIC(hdr, magic) ((void)0)
+#define SIMPLE_DS_HAS_MAGIC(hdr, magic)   1
+#else
+#define SIMPLE_DS_SET_MAGIC(hdr, magic)   ((hdr)->magic_number = (magic))
+#define SIMPLE_DS_CHECK_MAGIC(hdr, magic) assert((hdr)->magic_number == (magic))
+#define SIMPLE_DS_HAS_MAGIC(hdr, magic)   ((hdr)->magic_number == (magic))
+#endif
+
+/* An allocator that containers can be bound to. The sizes passed to realloc and
+ * free are the sizes the block was allocated (or last reallocated) with.
+ */
+typedef struct simple_allocator {
+    void *(*malloc)(void *ctx, size_t size);
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void (*free)(void *ctx, void *ptr, size_t size);
+    void *ctx;
+} simple_allocator;
+
+/* SIMPLE_DS_MALLOC followed by memset, for when only SIMPLE_DS_MALLOC is overridden */
+static inline void *_simple_ds_calloc_fallback(size_t size) {
+    void *ptr = SIMPLE_DS_MALLOC(size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+/* Allocates size bytes with allocator, or with SIMPLE_DS_MALLOC if allocator is NULL */
+static inline void *simple_ds_malloc(const simple_allocator *allocator, size_t size) {
+    return allocator ? allocator->malloc(allocator->ctx, size) : SIMPLE_DS_MALLOC(size);
+}
+
+/* Allocates size zeroed bytes with allocator, or with SIMPLE_DS_CALLOC if allocator is NULL */
+static inline void *simple_ds_calloc(const simple_allocator *allocator, size_t size) {
+    if (!allocator)
+        return SIMPLE_DS_CALLOC(1, size);
+    void *ptr = allocator->malloc(allocator->ctx, size);
+    if (ptr)
+        memset(ptr, 0, size);
+    return ptr;
+}
+
+/* Resizes a block of old_size bytes (ptr may be NULL) to new_size bytes */
+static inline void *simple_ds_realloc(const simple_allocator *allocator, void *ptr, size_t old_size,
+                                      size_t new_size) {
+    return allocator ? allocator->realloc(allocator->ctx, ptr, old_size, new_size)
+                     : SIMPLE_DS_REALLOC(ptr, new_size);
+}
+
+/* Frees a block of size bytes (ptr may be NULL) */
+static inline void simple_ds_free(const simple_allocator *allocator, void *ptr, size_t size) {
+    if (!ptr)
+        return;
+    if (allocator)
+        allocator->free(allocator->ctx, ptr, size);
+    else
+        SIMPLE_DS_FREE(ptr);
+}
+
+/* ------------------------------------------------------------------
+   Arena
+------------------------------------------------------------------ */
+
+typedef struct simple_arena_chunk {
+    struct simple_arena_chunk *next;
+    size_t size; /* usable bytes in data */
+    size_t used; /* bytes handed out from data */
+    max_align_t data[];
+} simple_arena_chunk;
+
+typedef struct {
+    simple_allocator allocator; /* allocator whose ctx is this arena */
+    simple_arena_chunk *head;   /* chunk currently being bumped (newest first) */
+    size_t chunk_size;          /* minimum usable size of each chunk */
+    void *last;                 /* most recent allocation in head, or NULL */
+} simple_arena;
+
+#define SIMPLE_ARENA_ALIGN (__alignof__(max_align_t))
+
+static inline size_t _simple_arena_round(size_t size) {
+    return (size + SIMPLE_ARENA_ALIGN - 1) & ~(SIMPLE_ARENA_ALIGN - 1);
+}
+
+static inline void *_simple_arena_malloc(void *ctx, size_t size) {
+    simple_arena *arena = (simple_arena *)ctx;
+    size = _simple_arena_round(size ? size : 1);
+    simple_arena_chunk *chunk = arena->head;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > arena->chunk_size ? size : arena->chunk_size;
+        chunk = (simple_arena_chunk *)SIMPLE_DS_MALLOC(sizeof(simple_arena_chunk) + chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->next = arena->head;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        arena->head = chunk;
+    }
+    void *ptr = (char *)chunk->data + chunk->used;
+    chunk->used += size;
+    arena->last = ptr;
+    return ptr;
+}
+
+static inline void _simple_arena_free(void *ctx, void *ptr, size_t size) {
+    simple_arena *arena = (simple_arena *)ctx;
+    /* Only the most recent allocation can be given back */
+    (void)size;
+    if (ptr && ptr == arena->last) {
+        arena->head->used = (size_t)((char *)ptr - (char *)arena->head->data);
+        arena->last = NULL;
+    }
+}
+
+static inline void *_simple_arena_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size) {
+    simple_arena *arena = (simple_arena *)ctx;
+    if (!ptr)
+        return _simple_arena_malloc(ctx, new_size);
+    if (ptr == arena->last) {
+        /* Grow or shrink the most recent allocation in place when it fits */
+        simple_arena_chunk *chunk = arena->head;
+        size_t start = (size_t)((char *)ptr - (char *)chunk->data);
+        size_t rounded = _simple_arena_round(new_size ? new_size : 1);
+        if (chunk->size - start >= rounded) {
+            chunk->used = start + rounded;
+            return ptr;
+        }
+    }
+    void *new_ptr = _simple_arena_malloc(ctx, new_size);
+    if (new_ptr)
+        memcpy(new_ptr, ptr, old_size < new_size ? old_size : new_size);
+    return new_ptr;
+}
+
+/* Initializes an empty arena whose chunks hold at least chunk_size bytes */
+static inline void simple_arena_init(simple_arena *arena, size_t chunk_size) {
+    arena->allocator.malloc = _simple_arena_malloc;
+    arena->allocator.realloc = _simple_arena_realloc;
+    arena->allocator.free = _simple_arena_free;
+    arena->allocator.ctx = arena;
+    arena->head = NULL;
+    arena->chunk_size = chunk_size;
+    arena->last = NULL;
+}
+
+/* Returns the allocator that allocates from arena */
+static inline const simple_allocator *simple_arena_allocator(simple_arena *arena) {
+    return &arena->allocator;
+}
+
+/* Drops every allocation made from arena, keeping its oldest chunk for reuse */
+static inline void simple_arena_reset(simple_arena *arena) {
+    simple_arena_chunk *chunk = arena->head;
+    while (chunk && chunk->next) {
+        simple_arena_chunk *next = chunk->next;
+        SIMPLE_DS_FREE(chunk);
+        chunk = next;
+    }
+    if (chunk)
+        chunk->used = 0;
+    arena->head = chunk;
+    arena->last = NULL;
+}
+
+/* Releases all memory owned by arena. The arena can be reused afterwards. */
+static inline void simple_arena_free(simple_arena *arena) {
+    simple_arena_chunk *chunk = arena->head;
+    while (chunk) {
+        simple_arena_chunk *next = chunk->next;
+        SIMPLE_DS_FREE(chunk);
+        chunk = next;
+    }
+    arena->head = NULL;
+    arena->last = NULL;
+}
+
+#endif  /* SIMPLE_ALLOC_H */
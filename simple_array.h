@@ -5,28 +5,53 @@
  *   - count:          Number of elements in the array.
  *   - capacity:       Total number of elements allocated.
  *   - growth_factor:  Multiplier used to increase capacity when resizing.
+ *   - shrink_factor:  Fraction of capacity below which removals shrink the array (0 = never).
+ *   - allocator:      Allocator used for the array's memory (NULL for SIMPLE_DS_MALLOC and friends).
+ *   - inline_storage: Non-zero while the elements live in an ARRAY_INLINE buffer.
  *
  * Default configuration:
  *   - ARRAY_INIT_CAPACITY:          Initial number of elements.
  *   - ARRAY_GROWTH_FACTOR_DEFAULT:  Default multiplier for array expansion.
+ *   - ARRAY_SHRINK_FACTOR_DEFAULT:  Default shrink factor (0.0, so arrays never shrink on their own).
+ *
+ * Optional behavior (define before including this header):
+ *   - ARRAY_ZERO_ON_GROW:           Zero newly allocated capacity. By default, slots past
+ *                                   count are left uninitialized, since they are never read.
  *
  * Usage notes:
  *   - The array’s element type can be any type.
  *   - The array pointer returned points to the first element and can be indexed directly (e.g., array[i]).
+ *   - An array can start out in an ARRAY_INLINE(T, N) buffer on the stack or inside a struct,
+ *     which holds its first N elements without allocating (see array_init_inline).
  *
  * Public API macros:
  *   - array_count(arr):                      Returns the number of elements in the array.
  *   - array_capacity(arr):                   Returns the total capacity of the array.
  *   - array_growth_factor(arr):              Returns the current growth factor.
+ *   - array_shrink_factor(arr):              Returns the current shrink factor.
+ *   - array_is_inline(arr):                  Returns whether the array is still in its ARRAY_INLINE buffer.
+ *   - array_init_inline(arr, storage):       Makes arr an empty array stored in an ARRAY_INLINE buffer.
  *   - array_push(arr, item):                 Appends an item to the array.
+ *   - array_push_n(arr, items, n):           Appends n items copied from items.
+ *   - array_extend(arr, other):              Appends every element of the array other.
  *   - array_pop(arr):                        Removes the last item from the array and returns it.
  *   - array_delete(arr, index):              Deletes the element at the specified index.
+ *   - array_swap_remove(arr, index):         Deletes the element at index by moving the last one into it.
+ *   - array_delete_range(arr, start, n):     Deletes n elements starting at start.
+ *   - array_retain(arr, pred):               Keeps only the elements for which pred returns non-zero.
+ *   - array_remove_if(arr, pred):            Deletes the elements for which pred returns non-zero.
  *   - array_set_min_capacity(arr, min_cap):  Ensures the array has at least min_cap capacity.
  *   - array_set_growth_factor(arr, factor):  Sets the array's growth factor.
+ *   - array_set_shrink_factor(arr, factor):  Makes removals shrink the array below factor * capacity.
+ *   - array_shrink_to_fit(arr):              Reduces the capacity to the count.
+ *   - array_set_allocator(arr, allocator):   Binds the array to a simple_allocator (see simple_alloc.h).
  *   - array_dup(arr):                        Duplicates the array (shallow copy).
  *   - array_free(arr):                       Frees the array.
  *   - array_free_free(arr):                  Frees the array, calling free_func for each item.
  *   - array_clear(arr):                      Resets the array's count to zero.
+ *
+ * With a non-zero shrink factor, array_pop, array_delete and array_clear may move the
+ * array, so pointers to its elements are invalidated as they are by array_push.
  */
 
 #ifndef SIMPLE_ARRAY_H
@@ -35,8 +60,11 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 
+#include "simple_alloc.h"
+
 #ifndef ARRAY_INIT_CAPACITY
 #define ARRAY_INIT_CAPACITY 16
 #endif
@@ -45,13 +73,25 @@
 #define ARRAY_GROWTH_FACTOR_DEFAULT 2.0
 #endif
 
+/* Shrink factors are capped at 1 / (2 * growth_factor): an array that shrinks is left
+   1 / growth_factor full, so it has to lose half its elements again before shrinking again */
+#ifndef ARRAY_SHRINK_FACTOR_DEFAULT
+#define ARRAY_SHRINK_FACTOR_DEFAULT 0.0
+#endif
+
 #define ARRAY_MAGIC_NUMBER 0xd1a1e159
 
+/* The count and capacity read by every push come first */
 typedef struct {
-    double growth_factor;
     size_t count;
     size_t capacity;
+    const simple_allocator *allocator;
+    double growth_factor;
+    double shrink_factor;
+    uint32_t inline_storage; // Non-zero while the elements live in an ARRAY_INLINE buffer
+#ifndef SIMPLE_DS_NO_MAGIC
     uint32_t magic_number; // Used to assert that the header is valid
+#endif
 } array_header;
 
 /* Compute the header size rounded up to the alignment of the element type */
@@ -61,7 +101,7 @@ typedef struct {
 /* Given a pointer to the user array, get a pointer to the hidden header */
 #define ARRAY_HEADER(arr) ({                                                           \
     array_header *hdr = ((array_header *)((char *)(arr) - ARRAY_HEADER_SIZE(arr)));    \
-    assert(hdr->magic_number == ARRAY_MAGIC_NUMBER);                                   \
+    SIMPLE_DS_CHECK_MAGIC(hdr, ARRAY_MAGIC_NUMBER);                                    \
     hdr;                                                                               \
 })
 
@@ -69,33 +109,171 @@ typedef struct {
 #define array_count(arr)         ((arr) ? ARRAY_HEADER(arr)->count : 0)
 #define array_capacity(arr)      ((arr) ? ARRAY_HEADER(arr)->capacity : 0)
 #define array_growth_factor(arr) ((arr) ? ARRAY_HEADER(arr)->growth_factor : ARRAY_GROWTH_FACTOR_DEFAULT)
+#define array_shrink_factor(arr) ((arr) ? ARRAY_HEADER(arr)->shrink_factor : ARRAY_SHRINK_FACTOR_DEFAULT)
+#define array_is_inline(arr)     ((arr) ? ARRAY_HEADER(arr)->inline_storage != 0 : 0)
+
+/* Zeroes the slots [from, to) of a freshly allocated or grown array when
+ * ARRAY_ZERO_ON_GROW is defined. Otherwise new capacity is left uninitialized.
+ */
+static inline void _array_zero_grown(void *arr, size_t from, size_t to, size_t elem_size) {
+#ifdef ARRAY_ZERO_ON_GROW
+    if (to > from)
+        memset((char *)arr + from * elem_size, 0, (to - from) * elem_size);
+#else
+    (void)arr; (void)from; (void)to; (void)elem_size;
+#endif
+}
+
+/* Moves an array out of its ARRAY_INLINE buffer into a block of new_cap elements from
+ * its allocator. The header and the count elements are copied, and the buffer is left
+ * untouched. Returns the moved array, or NULL (leaving the array inline) if the block
+ * cannot be allocated.
+ */
+static inline void *_array_spill_inline(array_header *hdr, size_t header_size, size_t elem_size, size_t new_cap) {
+    array_header *new_hdr = (array_header *)simple_ds_malloc(hdr->allocator, header_size + new_cap * elem_size);
+    if (!new_hdr)
+        return NULL;
+    memcpy(new_hdr, hdr, header_size + hdr->count * elem_size);
+    new_hdr->inline_storage = 0;
+    return (char *)new_hdr + header_size;
+}
 
 /* Internal macro to resize the array to a new capacity.
  * new_cap must be a size_t.
+ * Uses realloc, so the block can grow in place (or be remapped for large
+ * blocks) instead of always being copied.
+ * An array in an ARRAY_INLINE buffer moves to the heap once new_cap exceeds the
+ * buffer, and keeps the buffer otherwise.
+ * If the new block cannot be allocated, arr is left unchanged.
  */
 #define ARRAY_RESIZE(arr, new_cap)                                                                               \
     do {                                                                                                         \
         _Static_assert(__builtin_types_compatible_p(__typeof__(new_cap), size_t), "new_cap must be size_t");     \
         __typeof__(arr) _ar = (arr);                                                                             \
+        size_t _ar_new_cap = (new_cap);                                                                          \
         size_t _elem_size = sizeof(*(_ar));                                                                      \
         size_t _header_size = ARRAY_HEADER_SIZE(_ar);                                                            \
         array_header *_old_hdr = _ar ? ARRAY_HEADER(_ar) : NULL;                                                 \
-        size_t _old_count = _old_hdr ? _old_hdr->count : 0;                                                      \
-        array_header *_new_hdr = (array_header *)malloc(_header_size + (new_cap) * _elem_size);                  \
-        _new_hdr->capacity = (new_cap);                                                                          \
-        _new_hdr->count = _old_count;                                                                            \
-        _new_hdr->growth_factor = _old_hdr ? _old_hdr->growth_factor : ARRAY_GROWTH_FACTOR_DEFAULT;              \
-        _new_hdr->magic_number = ARRAY_MAGIC_NUMBER;                                                             \
-        void *_new_arr = (char *)_new_hdr + _header_size;                                                        \
-        if (_old_hdr) {                                                                                          \
-            memcpy(_new_arr, _ar, _old_count * _elem_size);                                                      \
-            free((char *)_old_hdr);                                                                              \
+        size_t _old_cap = _old_hdr ? _old_hdr->capacity : 0;                                                     \
+        if (_old_hdr && _old_hdr->inline_storage) {                                                              \
+            __typeof__(arr) _ar_moved = NULL;                                                                    \
+            if (_ar_new_cap > _old_cap)                                                                          \
+                _ar_moved = _array_spill_inline(_old_hdr, _header_size, _elem_size, _ar_new_cap);                \
+            if (_ar_moved) {                                                                                     \
+                _ar = _ar_moved;                                                                                 \
+                ARRAY_HEADER(_ar)->capacity = _ar_new_cap;                                                       \
+                _array_zero_grown(_ar, _old_hdr->count, _ar_new_cap, _elem_size);                                \
+            }                                                                                                    \
+        } else {                                                                                                 \
+            const simple_allocator *_allocator = _old_hdr ? _old_hdr->allocator : NULL;                          \
+            array_header *_new_hdr = (array_header *)simple_ds_realloc(_allocator, _old_hdr,                     \
+                                                                       _header_size + _old_cap * _elem_size,     \
+                                                                       _header_size + _ar_new_cap * _elem_size); \
+            if (_new_hdr && !_old_hdr) {                                                                         \
+                _new_hdr->allocator = NULL;                                                                      \
+                _new_hdr->inline_storage = 0;                                                                    \
+                _new_hdr->count = 0;                                                                             \
+                _new_hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                           \
+                _new_hdr->shrink_factor = ARRAY_SHRINK_FACTOR_DEFAULT;                                           \
+                SIMPLE_DS_SET_MAGIC(_new_hdr, ARRAY_MAGIC_NUMBER);                                               \
+            }                                                                                                    \
+            if (_new_hdr) {                                                                                      \
+                _new_hdr->capacity = _ar_new_cap;                                                                \
+                _ar = (void *)((char *)_new_hdr + _header_size);                                                 \
+                _array_zero_grown(_ar, _old_cap, _ar_new_cap, _elem_size);                                       \
+            }                                                                                                    \
         }                                                                                                        \
-        (arr) = _new_arr;                                                                                        \
+        (arr) = _ar;                                                                                             \
+    } while (0)
+
+/* Caps the shrink factor of hdr at 1 / (2 * growth_factor) (see
+ * ARRAY_SHRINK_FACTOR_DEFAULT), after either of them has changed.
+ */
+static inline void _array_clamp_shrink_factor(array_header *hdr) {
+    double max_shrink = 1.0 / (2 * hdr->growth_factor);
+    if (hdr->shrink_factor > max_shrink)
+        hdr->shrink_factor = max_shrink;
+}
+
+/* Returns the capacity to shrink an array to after elements were removed from it, or 0
+ * to keep its capacity. An array below shrink_factor * capacity is cut down to
+ * count * growth_factor elements (at least ARRAY_INIT_CAPACITY), so that it can grow
+ * by one growth step before it has to be resized again.
+ */
+static inline size_t _array_shrink_capacity(const array_header *hdr) {
+    if (!(hdr->count < hdr->capacity * hdr->shrink_factor))
+        return 0;
+    size_t new_cap = (size_t)(hdr->count * hdr->growth_factor);
+    if (new_cap < ARRAY_INIT_CAPACITY)
+        new_cap = ARRAY_INIT_CAPACITY;
+    return new_cap < hdr->capacity ? new_cap : 0;
+}
+
+/* Internal macro that applies the shrink factor of arr (which must not be NULL)
+ * after elements were removed.
+ */
+#define ARRAY_MAYBE_SHRINK(arr)                                                      \
+    do {                                                                             \
+        size_t _ms_cap = _array_shrink_capacity(ARRAY_HEADER(arr));                  \
+        if (_ms_cap) {                                                               \
+            ARRAY_RESIZE(arr, _ms_cap);                                              \
+        }                                                                            \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   ARRAY_INLINE(T, N)
+   array_init_inline(arr, storage)
+   ARRAY_INLINE(T, N) is the type of a buffer holding an array header and
+   N elements of type T, which can be declared on the stack or embedded in
+   a struct. array_init_inline points arr at an empty array stored in the
+   buffer, so that its first N elements need no allocation. Once the array
+   outgrows the buffer, it moves to the heap (with its allocator, see
+   array_set_allocator) like any other array, and the buffer is no longer
+   used. array_free frees nothing while the array is still inline.
+   - The buffer must not be copied or moved while the array uses it (in
+     particular, a struct embedding it must not be copied).
+   - Shrinking (array_shrink_to_fit or a shrink factor) never leaves or
+     reduces the buffer.
+   - The buffer can be reused by calling array_init_inline again once the
+     array has been freed.
+   Example:
+       ARRAY_INLINE(int, 8) ids_buf;
+       int *ids;
+       array_init_inline(ids, ids_buf);
+       array_push(ids, 42);  // no allocation
+       ...
+       array_free(ids);
+------------------------------------------------------------------ */
+#define ARRAY_INLINE(T, N)                                                                       \
+    struct {                                                                                     \
+        array_header _header;                                                                    \
+        T _items[N];                                                                             \
+    }
+
+#define array_init_inline(arr, storage)                                                              \
+    do {                                                                                             \
+        _Static_assert(__builtin_types_compatible_p(__typeof__((storage)._items[0]),                 \
+                                                    __typeof__(*((__typeof__(arr))0))),              \
+                       "storage must be an ARRAY_INLINE buffer of the element type of arr");         \
+        _Static_assert(offsetof(__typeof__(storage), _items) == ARRAY_HEADER_SIZE((storage)._items), \
+                       "ARRAY_INLINE layout does not match the array header");                       \
+        array_header *_ii_hdr = &(storage)._header;                                                  \
+        size_t _ii_cap = sizeof((storage)._items) / sizeof((storage)._items[0]);                     \
+        _ii_hdr->count = 0;                                                                          \
+        _ii_hdr->capacity = _ii_cap;                                                                 \
+        _ii_hdr->allocator = NULL;                                                                   \
+        _ii_hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                        \
+        _ii_hdr->shrink_factor = ARRAY_SHRINK_FACTOR_DEFAULT;                                        \
+        _ii_hdr->inline_storage = 1;                                                                 \
+        SIMPLE_DS_SET_MAGIC(_ii_hdr, ARRAY_MAGIC_NUMBER);                                            \
+        _array_zero_grown((storage)._items, 0, _ii_cap, sizeof((storage)._items[0]));                \
+        (arr) = (storage)._items;                                                                    \
     } while (0)
 
 /* Append an item to the end of the array.
  * The type of 'item' must match the element type (i.e. *arr).
+ * If a full array cannot grow, the item is not stored; if the first block cannot be
+ * allocated, arr stays NULL.
  */
 #define array_push(arr, item)                                                                                                          \
     do {                                                                                                                               \
@@ -109,26 +287,77 @@ typedef struct {
             size_t _cap = ARRAY_INIT_CAPACITY;                                                                                         \
             size_t _elem_size = sizeof(*(_a));                                                                                         \
             size_t _header_size = (((sizeof(array_header) + __alignof__(*(_a)) - 1) / __alignof__(*(_a))) * __alignof__(*(_a)));       \
-            array_header *_hdr = (array_header *)malloc(_header_size + _cap * _elem_size);                                             \
-            _hdr->capacity = _cap;                                                                                                     \
-            _hdr->count = 0;                                                                                                           \
-            _hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                                                         \
-            _hdr->magic_number = ARRAY_MAGIC_NUMBER;                                                                                   \
-            _a = (void *)((char *)_hdr + _header_size);                                                                                \
-            memset(_a, 0, _cap * _elem_size);                                                                                          \
+            array_header *_hdr = (array_header *)simple_ds_malloc(NULL, _header_size + _cap * _elem_size);                             \
+            if (_hdr) {                                                                                                                \
+                _hdr->allocator = NULL;                                                                                                \
+                _hdr->inline_storage = 0;                                                                                              \
+                _hdr->capacity = _cap;                                                                                                 \
+                _hdr->count = 0;                                                                                                       \
+                _hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                                                     \
+                _hdr->shrink_factor = ARRAY_SHRINK_FACTOR_DEFAULT;                                                                     \
+                SIMPLE_DS_SET_MAGIC(_hdr, ARRAY_MAGIC_NUMBER);                                                                         \
+                _a = (void *)((char *)_hdr + _header_size);                                                                            \
+                _array_zero_grown(_a, 0, _cap, _elem_size);                                                                            \
+            }                                                                                                                          \
         }                                                                                                                              \
-        array_header *_hdr = ARRAY_HEADER(_a);                                                                                         \
-        if (_hdr->count >= _hdr->capacity) {                                                                                           \
-            size_t _new_cap = (size_t)(_hdr->capacity * _hdr->growth_factor);                                                          \
-            if (_new_cap <= _hdr->capacity) _new_cap = _hdr->capacity + 1;                                                             \
-            ARRAY_RESIZE(_a, _new_cap);                                                                                                \
-            _hdr = ARRAY_HEADER(_a);                                                                                                   \
+        if (_a) { /* Not when the first block could not be allocated */                                                                \
+            array_header *_hdr = ARRAY_HEADER(_a);                                                                                     \
+            if (_hdr->count >= _hdr->capacity) {                                                                                       \
+                size_t _new_cap = (size_t)(_hdr->capacity * _hdr->growth_factor);                                                      \
+                if (_new_cap <= _hdr->capacity) _new_cap = _hdr->capacity + 1;                                                         \
+                ARRAY_RESIZE(_a, _new_cap);                                                                                            \
+                _hdr = ARRAY_HEADER(_a);                                                                                               \
+            }                                                                                                                          \
+            if (_hdr->count < _hdr->capacity) { /* Not when the array could not grow */                                                \
+                _a[_hdr->count++] = (item);                                                                                            \
+            }                                                                                                                          \
         }                                                                                                                              \
-        _a[_hdr->count++] = (item);                                                                                                    \
         (arr) = _a;                                                                                                                    \
     } while (0)
 
-/* Remove the last item from the array and return it. */
+/* Append n items copied from the buffer items (a pointer to the element type).
+ * Capacity is reserved once (growing by at least the growth factor), and the
+ * items are then copied with a single memcpy. items may point into arr itself.
+ * If the capacity cannot be reserved, nothing is appended.
+ */
+#define array_push_n(arr, items, n)                                                                              \
+    do {                                                                                                         \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(*(items)), __typeof__(*((__typeof__(arr))0))),    \
+                       "items must point to elements of the same type as *arr");                                 \
+        __typeof__(arr) _pn_a = (arr);                                                                           \
+        const __typeof__(*((__typeof__(arr))0)) *_pn_items = (items);                                            \
+        size_t _pn_n = (n);                                                                                      \
+        if (_pn_n) {                                                                                             \
+            size_t _pn_count = array_count(_pn_a);                                                               \
+            size_t _pn_cap = array_capacity(_pn_a);                                                              \
+            if (_pn_count + _pn_n > _pn_cap) {                                                                   \
+                /* items may be a slice of the array, which is about to move */                                  \
+                int _pn_self = _pn_a && (uintptr_t)_pn_items >= (uintptr_t)_pn_a &&                              \
+                               (uintptr_t)_pn_items < (uintptr_t)(_pn_a + _pn_count);                            \
+                size_t _pn_offset = _pn_self ? (size_t)(_pn_items - _pn_a) : 0;                                  \
+                size_t _pn_new_cap = (size_t)(_pn_cap * array_growth_factor(_pn_a));                             \
+                if (_pn_new_cap < _pn_count + _pn_n) _pn_new_cap = _pn_count + _pn_n;                            \
+                array_set_min_capacity(_pn_a, _pn_new_cap);                                                      \
+                if (_pn_self) _pn_items = _pn_a + _pn_offset;                                                    \
+            }                                                                                                    \
+            if (array_capacity(_pn_a) >= _pn_count + _pn_n) { /* Not when the array could not grow */            \
+                memcpy(_pn_a + _pn_count, _pn_items, _pn_n * sizeof(*(_pn_a)));                                  \
+                ARRAY_HEADER(_pn_a)->count = _pn_count + _pn_n;                                                  \
+            }                                                                                                    \
+        }                                                                                                        \
+        (arr) = _pn_a;                                                                                           \
+    } while (0)
+
+/* Append every element of the array other (which may be NULL, or arr itself). */
+#define array_extend(arr, other)                                                                                 \
+    do {                                                                                                         \
+        __typeof__(arr) _ex_other = (other);                                                                     \
+        array_push_n(arr, _ex_other, array_count(_ex_other));                                                    \
+    } while (0)
+
+/* Remove the last item from the array and return it.
+ * The array may shrink afterwards (see array_set_shrink_factor).
+ */
 #define array_pop(arr)                                                                 \
     ({                                                                                 \
         __typeof__(*(arr)) _pop_val; /* Remove the invalid int initializer */          \
@@ -138,12 +367,19 @@ typedef struct {
             array_header *_hdr = ARRAY_HEADER(_a);                                     \
             if (_hdr->count > 0) {                                                     \
                 _pop_val = _a[--_hdr->count];                                          \
+                ARRAY_MAYBE_SHRINK(_a);                                                \
+                (arr) = _a;                                                            \
             }                                                                          \
         }                                                                              \
         _pop_val;                                                                      \
     })
 
-/* Delete the element at the specified index, shifting subsequent elements. */
+/* Delete the element at the specified index, shifting subsequent elements.
+ * This moves the whole tail, so it is O(n): use array_swap_remove when the order of
+ * the elements does not matter, and array_delete_range or array_remove_if to delete
+ * several elements at once.
+ * The array may shrink afterwards (see array_set_shrink_factor).
+ */
 #define array_delete(arr, index)                                                                    \
     do {                                                                                            \
         __typeof__(arr) _a = (arr);                                                                 \
@@ -153,12 +389,110 @@ typedef struct {
             if (_idx < _hdr->count) {                                                               \
                 memmove(&_a[_idx], &_a[_idx + 1], (_hdr->count - _idx - 1) * sizeof(*(_a)));        \
                 _hdr->count--;                                                                      \
+                ARRAY_MAYBE_SHRINK(_a);                                                             \
+                (arr) = _a;                                                                         \
+            }                                                                                       \
+        }                                                                                           \
+    } while (0)
+
+/* Delete the element at the specified index in O(1) by moving the last element into
+ * its place. The order of the remaining elements is not preserved.
+ * The array may shrink afterwards (see array_set_shrink_factor).
+ */
+#define array_swap_remove(arr, index)                                                               \
+    do {                                                                                            \
+        __typeof__(arr) _a = (arr);                                                                 \
+        if (_a) {                                                                                   \
+            array_header *_hdr = ARRAY_HEADER(_a);                                                  \
+            size_t _idx = (index);                                                                  \
+            if (_idx < _hdr->count) {                                                               \
+                _a[_idx] = _a[--_hdr->count];                                                       \
+                ARRAY_MAYBE_SHRINK(_a);                                                             \
+                (arr) = _a;                                                                         \
+            }                                                                                       \
+        }                                                                                           \
+    } while (0)
+
+/* Delete the n elements starting at index start with a single memmove of the tail.
+ * Elements past the end are ignored, so n may be larger than what is left.
+ * The array may shrink afterwards (see array_set_shrink_factor).
+ */
+#define array_delete_range(arr, start, n)                                                           \
+    do {                                                                                            \
+        __typeof__(arr) _a = (arr);                                                                 \
+        if (_a) {                                                                                   \
+            array_header *_hdr = ARRAY_HEADER(_a);                                                  \
+            size_t _dr_start = (start);                                                             \
+            size_t _dr_n = (n);                                                                     \
+            if (_dr_start < _hdr->count && _dr_n > 0) {                                             \
+                if (_dr_n > _hdr->count - _dr_start) _dr_n = _hdr->count - _dr_start;               \
+                memmove(&_a[_dr_start], &_a[_dr_start + _dr_n],                                     \
+                        (_hdr->count - _dr_start - _dr_n) * sizeof(*(_a)));                         \
+                _hdr->count -= _dr_n;                                                               \
+                ARRAY_MAYBE_SHRINK(_a);                                                             \
+                (arr) = _a;                                                                         \
             }                                                                                       \
         }                                                                                           \
     } while (0)
 
+/* Internal macro: ARRAY_RETAIN_IMPL
+ * Shared implementation of array_retain and array_remove_if. Compacts the array in a
+ * single pass, keeping the elements for which (pred(element) != 0) == keep, in order.
+ */
+#define ARRAY_RETAIN_IMPL(arr, pred, keep)                                                          \
+    do {                                                                                            \
+        __typeof__(arr) _a = (arr);                                                                 \
+        int (^_rt_pred)(__typeof__(_a[0])) =                                                        \
+            _Generic((pred),                                                                        \
+                int (^)(__typeof__(_a[0])): (pred),                                                 \
+                int (*)(__typeof__(_a[0])): (pred)                                                  \
+            );                                                                                      \
+        if (_a) {                                                                                   \
+            array_header *_hdr = ARRAY_HEADER(_a);                                                  \
+            size_t _rt_kept = 0;                                                                    \
+            for (size_t _rt_i = 0; _rt_i < _hdr->count; _rt_i++) {                                  \
+                if ((_rt_pred(_a[_rt_i]) != 0) == (keep)) {                                         \
+                    if (_rt_kept != _rt_i) _a[_rt_kept] = _a[_rt_i];                                \
+                    _rt_kept++;                                                                     \
+                }                                                                                   \
+            }                                                                                       \
+            if (_rt_kept < _hdr->count) {                                                           \
+                _hdr->count = _rt_kept;                                                             \
+                ARRAY_MAYBE_SHRINK(_a);                                                             \
+                (arr) = _a;                                                                         \
+            }                                                                                       \
+        }                                                                                           \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   array_retain(arr, pred)
+   Keeps only the elements for which pred returns non-zero, preserving their
+   order, in a single O(n) pass. pred is called once per element, in order.
+   - If (arr) is NULL, no action is taken.
+   - The pred parameter may be provided as either a traditional function
+     pointer or as a block, as long as it accepts a parameter of the element
+     type and returns int.
+   - The array may shrink afterwards (see array_set_shrink_factor).
+
+   Examples:
+       // Using a function pointer:
+       array_retain(values, is_valid);
+       // Using a block:
+       array_retain(values, ^(int v) { return v >= 0; });
+------------------------------------------------------------------ */
+#define array_retain(arr, pred) ARRAY_RETAIN_IMPL(arr, pred, 1)
+
+/* ------------------------------------------------------------------
+   array_remove_if(arr, pred)
+   Deletes the elements for which pred returns non-zero, preserving the order
+   of the rest, in a single O(n) pass. Takes pred as array_retain does.
+   Example:
+       array_remove_if(items, ^(Item it) { return it.expired; });
+------------------------------------------------------------------ */
+#define array_remove_if(arr, pred) ARRAY_RETAIN_IMPL(arr, pred, 0)
+
 /* Ensure the array has at least min_cap capacity.
- * min_cap must be a size_t.
+ * min_cap must be a size_t. A NULL arr stays NULL if its first block cannot be allocated.
  */
 #define array_set_min_capacity(arr, min_cap)                                                                                            \
     do {                                                                                                                                \
@@ -168,13 +502,18 @@ typedef struct {
         if (!_a) {                                                                                                                      \
             size_t _elem_size = sizeof(*(_a));                                                                                          \
             size_t _header_size = (((sizeof(array_header) + __alignof__(*(_a)) - 1) / __alignof__(*(_a))) * __alignof__(*(_a)));        \
-            array_header *_hdr = (array_header *)malloc(_header_size + _m_min_cap * _elem_size);                                        \
-            _hdr->capacity = _m_min_cap;                                                                                                \
-            _hdr->count = 0;                                                                                                            \
-            _hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                                                          \
-            _hdr->magic_number = ARRAY_MAGIC_NUMBER;                                                                                    \
-            _a = (void *)((char *)_hdr + _header_size);                                                                                 \
-            memset(_a, 0, _m_min_cap * _elem_size);                                                                                     \
+            array_header *_hdr = (array_header *)simple_ds_malloc(NULL, _header_size + _m_min_cap * _elem_size);                        \
+            if (_hdr) {                                                                                                                 \
+                _hdr->allocator = NULL;                                                                                                 \
+                _hdr->inline_storage = 0;                                                                                               \
+                _hdr->capacity = _m_min_cap;                                                                                            \
+                _hdr->count = 0;                                                                                                        \
+                _hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                                                      \
+                _hdr->shrink_factor = ARRAY_SHRINK_FACTOR_DEFAULT;                                                                      \
+                SIMPLE_DS_SET_MAGIC(_hdr, ARRAY_MAGIC_NUMBER);                                                                          \
+                _a = (void *)((char *)_hdr + _header_size);                                                                             \
+                _array_zero_grown(_a, 0, _m_min_cap, _elem_size);                                                                       \
+            }                                                                                                                           \
         } else {                                                                                                                        \
             array_header *_hdr = ARRAY_HEADER(_a);                                                                                      \
             if (_hdr->capacity < _m_min_cap) {                                                                                          \
@@ -193,7 +532,80 @@ typedef struct {
         __typeof__(arr) _a = (arr);                                                                              \
         if (_a) {                                                                                                \
             ARRAY_HEADER(_a)->growth_factor = (factor);                                                          \
+            _array_clamp_shrink_factor(ARRAY_HEADER(_a));                                                        \
+        }                                                                                                        \
+    } while (0)
+
+/* Set the shrink factor for the array: once array_pop, array_delete or array_clear
+ * leaves fewer than factor * capacity elements, the capacity is reduced to
+ * count * growth_factor (at least ARRAY_INIT_CAPACITY). 0.0 turns shrinking off.
+ * factor must be a double. It is capped at 1 / (2 * growth_factor), also when the
+ * growth factor changes later, so that a shrunk array has to lose half its elements
+ * before it shrinks again and draining it costs O(n) overall.
+ * Example:
+ *     array_set_shrink_factor(arr, 0.25);
+ */
+#define array_set_shrink_factor(arr, factor)                                                                     \
+    do {                                                                                                         \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(factor), double), "factor must be double");       \
+        __typeof__(arr) _a = (arr);                                                                              \
+        if (_a) {                                                                                                \
+            ARRAY_HEADER(_a)->shrink_factor = (factor);                                                          \
+            _array_clamp_shrink_factor(ARRAY_HEADER(_a));                                                        \
+        }                                                                                                        \
+    } while (0)
+
+/* Reduce the capacity of the array to its count, giving the rest of its memory back to
+ * its allocator. The array may move. If (arr) is NULL, no action is taken.
+ */
+#define array_shrink_to_fit(arr)                                                                                 \
+    do {                                                                                                         \
+        __typeof__(arr) _a = (arr);                                                                              \
+        if (_a && ARRAY_HEADER(_a)->count < ARRAY_HEADER(_a)->capacity) {                                        \
+            ARRAY_RESIZE(_a, ARRAY_HEADER(_a)->count);                                                           \
         }                                                                                                        \
+        (arr) = _a;                                                                                              \
+    } while (0)
+
+/* Bind the array to allocator (a const simple_allocator *, or NULL for SIMPLE_DS_MALLOC
+ * and friends), which is then used for every later allocation of the array.
+ * If (arr) is NULL, an empty array with ARRAY_INIT_CAPACITY is allocated from it.
+ * An array in an ARRAY_INLINE buffer stays there, and moves into memory from allocator
+ * once it outgrows the buffer. Otherwise, the array's block is moved to memory from allocator.
+ * If that memory cannot be allocated, arr and its allocator are left unchanged.
+ * Example:
+ *     array_set_allocator(arr, simple_arena_allocator(&arena));
+ */
+#define array_set_allocator(arr, alloc)                                                                             \
+    do {                                                                                                            \
+        const simple_allocator *_sa_allocator = (alloc);                                                            \
+        __typeof__(arr) _a = (arr);                                                                                 \
+        size_t _elem_size = sizeof(*(_a));                                                                          \
+        size_t _header_size = ARRAY_HEADER_SIZE(_a);                                                                \
+        array_header *_old_hdr = _a ? ARRAY_HEADER(_a) : NULL;                                                      \
+        if (_old_hdr && _old_hdr->inline_storage) {                                                                 \
+            _old_hdr->allocator = _sa_allocator;                                                                    \
+        } else {                                                                                                    \
+            size_t _cap = _old_hdr ? _old_hdr->capacity : ARRAY_INIT_CAPACITY;                                      \
+            array_header *_hdr = (array_header *)simple_ds_malloc(_sa_allocator, _header_size + _cap * _elem_size); \
+            if (_hdr && _old_hdr) {                                                                                 \
+                memcpy(_hdr, _old_hdr, _header_size + _old_hdr->count * _elem_size);                                \
+                simple_ds_free(_old_hdr->allocator, _old_hdr, _header_size + _cap * _elem_size);                    \
+            } else if (_hdr) {                                                                                      \
+                _hdr->count = 0;                                                                                    \
+                _hdr->inline_storage = 0;                                                                           \
+                _hdr->growth_factor = ARRAY_GROWTH_FACTOR_DEFAULT;                                                  \
+                _hdr->shrink_factor = ARRAY_SHRINK_FACTOR_DEFAULT;                                                  \
+                SIMPLE_DS_SET_MAGIC(_hdr, ARRAY_MAGIC_NUMBER);                                                      \
+            }                                                                                                       \
+            if (_hdr) {                                                                                             \
+                _hdr->capacity = _cap;                                                                              \
+                _hdr->allocator = _sa_allocator;                                                                    \
+                _a = (void *)((char *)_hdr + _header_size);                                                         \
+                _array_zero_grown(_a, _hdr->count, _cap, _elem_size);                                               \
+            }                                                                                                       \
+        }                                                                                                           \
+        (arr) = _a;                                                                                                 \
     } while (0)
 
 /* Duplicate the array (shallow copy). */
@@ -206,12 +618,16 @@ typedef struct {
             size_t _cap = _orig_hdr->capacity;                                                \
             size_t _elem_size = sizeof(*(_orig));                                             \
             size_t _header_size = ARRAY_HEADER_SIZE(_orig);                                   \
-            array_header *_new_hdr = malloc(_header_size + _cap * _elem_size);                \
+            array_header *_new_hdr = simple_ds_malloc(_orig_hdr->allocator,                   \
+                                                      _header_size + _cap * _elem_size);      \
             if (_new_hdr) {                                                                   \
+                _new_hdr->allocator = _orig_hdr->allocator;                                   \
+                _new_hdr->inline_storage = 0;                                                 \
                 _new_hdr->count = _orig_hdr->count;                                           \
                 _new_hdr->capacity = _cap;                                                    \
                 _new_hdr->growth_factor = _orig_hdr->growth_factor;                           \
-                _new_hdr->magic_number = ARRAY_MAGIC_NUMBER;                                  \
+                _new_hdr->shrink_factor = _orig_hdr->shrink_factor;                           \
+                SIMPLE_DS_SET_MAGIC(_new_hdr, ARRAY_MAGIC_NUMBER);                            \
                 void *_new_arr = (char *)_new_hdr + _header_size;                             \
                 memcpy(_new_arr, _orig, _orig_hdr->count * _elem_size);                       \
                 _dup = _new_arr;                                                              \
@@ -232,12 +648,15 @@ typedef struct {
             size_t _cap = _orig_hdr->capacity;                                                                 \
             size_t _elem_size = sizeof(*(_orig));                                                              \
             size_t _header_size = ARRAY_HEADER_SIZE(_orig);                                                    \
-            array_header *_new_hdr = malloc(_header_size + _cap * _elem_size);                                 \
+            array_header *_new_hdr = simple_ds_malloc(_orig_hdr->allocator, _header_size + _cap * _elem_size); \
             if (_new_hdr) {                                                                                    \
+                _new_hdr->allocator = _orig_hdr->allocator;                                                    \
+                _new_hdr->inline_storage = 0;                                                                  \
                 _new_hdr->count = _orig_hdr->count;                                                            \
                 _new_hdr->capacity = _cap;                                                                     \
                 _new_hdr->growth_factor = _orig_hdr->growth_factor;                                            \
-                _new_hdr->magic_number = ARRAY_MAGIC_NUMBER;                                                   \
+                _new_hdr->shrink_factor = _orig_hdr->shrink_factor;                                            \
+                SIMPLE_DS_SET_MAGIC(_new_hdr, ARRAY_MAGIC_NUMBER);                                             \
                 void *_new_arr = (char *)_new_hdr + _header_size;                                              \
                 memcpy(_new_arr, _orig, _orig_hdr->count * _elem_size);                                        \
                 _dup = _new_arr;                                                                               \
@@ -254,6 +673,8 @@ typedef struct {
    - The free_func parameter may be provided as either a traditional function
      pointer or as a block, as long as it accepts a parameter of the element type
      and returns void.
+   - An array still in its ARRAY_INLINE buffer frees nothing, since the buffer
+     belongs to the enclosing object.
    
    Examples:
        // Using a function pointer:
@@ -263,35 +684,41 @@ typedef struct {
        // Without a cleanup callback:
        array_free_free(my_array, NULL);
 ------------------------------------------------------------------ */
-#define array_free_free(arr, free_func)                                                 \
-    do {                                                                                \
-        if (arr) {                                                                      \
-            __typeof__(arr) _aff_arr = (arr);                                           \
-            void (^_aff_free_func)(__typeof__(_aff_arr[0])) =                           \
-                _Generic((free_func),                                                   \
-                    void (*)(__typeof__(_aff_arr[0])): (free_func),                     \
-                    void (^)(__typeof__(_aff_arr[0])): (free_func),                     \
-                    default: ((void (^)(__typeof__(_aff_arr[0])))0)                     \
-                );                                                                      \
-            array_header *_aff_hdr = ARRAY_HEADER(_aff_arr);                            \
-            for (size_t _aff_i = 0; _aff_i < _aff_hdr->count; _aff_i++) {               \
-                if (_aff_free_func) {                                                   \
-                    _aff_free_func(_aff_arr[_aff_i]);                                   \
-                }                                                                       \
-            }                                                                           \
-            free((char *)(_aff_arr) - ARRAY_HEADER_SIZE(_aff_arr));                     \
-            (arr) = NULL;                                                               \
-        }                                                                               \
+#define array_free_free(arr, free_func)                                                                 \
+    do {                                                                                                \
+        if (arr) {                                                                                      \
+            __typeof__(arr) _aff_arr = (arr);                                                           \
+            void (^_aff_free_func)(__typeof__(_aff_arr[0])) =                                           \
+                _Generic((free_func),                                                                   \
+                    void (*)(__typeof__(_aff_arr[0])): (free_func),                                     \
+                    void (^)(__typeof__(_aff_arr[0])): (free_func),                                     \
+                    default: ((void (^)(__typeof__(_aff_arr[0])))0)                                     \
+                );                                                                                      \
+            array_header *_aff_hdr = ARRAY_HEADER(_aff_arr);                                            \
+            for (size_t _aff_i = 0; _aff_i < _aff_hdr->count; _aff_i++) {                               \
+                if (_aff_free_func) {                                                                   \
+                    _aff_free_func(_aff_arr[_aff_i]);                                                   \
+                }                                                                                       \
+            }                                                                                           \
+            if (!_aff_hdr->inline_storage) {                                                            \
+                simple_ds_free(_aff_hdr->allocator, (char *)(_aff_arr) - ARRAY_HEADER_SIZE(_aff_arr),   \
+                               ARRAY_HEADER_SIZE(_aff_arr) + _aff_hdr->capacity * sizeof(*(_aff_arr))); \
+            }                                                                                           \
+            (arr) = NULL;                                                                               \
+        }                                                                                               \
     } while (0)
 
 /* Free the array and its hidden header. */
 #define array_free(arr) array_free_free(arr, NULL)
 
-/* Clear the array (set count to zero). */
+/* Clear the array (set count to zero).
+ * With a non-zero shrink factor, the capacity drops to ARRAY_INIT_CAPACITY.
+ */
 #define array_clear(arr)                                                                \
     do {                                                                                \
         if (arr) {                                                                      \
             ARRAY_HEADER(arr)->count = 0;                                               \
+            ARRAY_MAYBE_SHRINK(arr);                                                    \
         }                                                                               \
     } while (0)
 
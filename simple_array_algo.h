@@ -0,0 +1,564 @@
+/*
+ * Sorting, searching and bulk loops over simple_array arrays.
+ *
+ * Every macro takes the array itself and reads its length from the hidden header, so
+ * callers never pass counts around. A NULL array is treated as empty.
+ *
+ * Element kinds:
+ *   - Primitive:  Integer types (including char and _Bool), float and double. array_sort
+ *                 uses an LSD radix sort on them, and array_find, array_sum and
+ *                 array_bsearch compare values directly.
+ *   - Any type:   array_sort_by and array_bsearch_by take a comparator.
+ *
+ * Default configuration:
+ *   - ARRAY_ALGO_INSERTION_SORT_MAX:  Ranges at most this long are insertion sorted (default 16).
+ *   - ARRAY_ALGO_RADIX_MIN:           Primitive arrays shorter than this are sorted by comparison,
+ *                                     since the radix sort's counting passes dominate (default 256).
+ *   - ARRAY_ALGO_MAX_THREADS:         Upper bound on the threads of array_parallel_for (default 64).
+ *
+ * Usage notes:
+ *   - array_parallel_for requires POSIX threads (compile and link with -pthread).
+ *   - Floating-point values are sorted by their IEEE order with -0.0 before 0.0; NaNs are
+ *     placed at the ends according to their sign bit.
+ *   - The radix sort needs a scratch buffer as large as the array, taken from the array's
+ *     allocator. If it cannot be allocated, the array is sorted by comparison instead.
+ *   - array_sort_by is not stable.
+ *
+ * Public API macros:
+ *   - array_sort(arr):                          Sorts a primitive array in ascending order.
+ *   - array_sort_by(arr, cmp):                  Sorts any array with a qsort-style comparator.
+ *   - array_bsearch(arr, value):                Returns a pointer to an element equal to value in a sorted
+ *                                               primitive array, or NULL.
+ *   - array_bsearch_by(arr, key, cmp):          Like array_bsearch for an array sorted by cmp.
+ *   - array_lower_bound(arr, value):            Returns the index of the first element not less than value.
+ *   - array_find(arr, value):                   Returns a pointer to the first element equal to value, or NULL.
+ *   - array_sum(arr):                           Returns the sum of a primitive array.
+ *   - array_parallel_for(arr, nthreads, fn, ctx): Calls fn on contiguous chunks of the array from nthreads threads.
+ */
+
+#ifndef SIMPLE_ARRAY_ALGO_H
+#define SIMPLE_ARRAY_ALGO_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "simple_array.h"
+
+#ifndef ARRAY_ALGO_INSERTION_SORT_MAX
+#define ARRAY_ALGO_INSERTION_SORT_MAX 16
+#endif
+
+#ifndef ARRAY_ALGO_RADIX_MIN
+#define ARRAY_ALGO_RADIX_MIN 256
+#endif
+
+#ifndef ARRAY_ALGO_MAX_THREADS
+#define ARRAY_ALGO_MAX_THREADS 64
+#endif
+
+/* Kinds of element, as chosen by ARRAY_ELEM_KIND */
+enum {
+    ARRAY_ELEM_OTHER = 0,
+    ARRAY_ELEM_SIGNED = 1,
+    ARRAY_ELEM_UNSIGNED = 2,
+    ARRAY_ELEM_FLOAT = 3
+};
+
+/* The kind of the element type of arr (arr is not evaluated) */
+#define ARRAY_ELEM_KIND(arr)                                                  \
+    _Generic((arr)[0],                                                        \
+        char: ((char)-1 < 0 ? ARRAY_ELEM_SIGNED : ARRAY_ELEM_UNSIGNED),       \
+        signed char: ARRAY_ELEM_SIGNED,                                       \
+        short: ARRAY_ELEM_SIGNED,                                             \
+        int: ARRAY_ELEM_SIGNED,                                               \
+        long: ARRAY_ELEM_SIGNED,                                              \
+        long long: ARRAY_ELEM_SIGNED,                                         \
+        _Bool: ARRAY_ELEM_UNSIGNED,                                           \
+        unsigned char: ARRAY_ELEM_UNSIGNED,                                   \
+        unsigned short: ARRAY_ELEM_UNSIGNED,                                  \
+        unsigned int: ARRAY_ELEM_UNSIGNED,                                    \
+        unsigned long: ARRAY_ELEM_UNSIGNED,                                   \
+        unsigned long long: ARRAY_ELEM_UNSIGNED,                              \
+        float: ARRAY_ELEM_FLOAT,                                              \
+        double: ARRAY_ELEM_FLOAT,                                             \
+        default: ARRAY_ELEM_OTHER)
+
+/* Statically checks that the element type of arr is primitive */
+#define ARRAY_CHECK_PRIMITIVE(arr, name)                                                              \
+    _Static_assert(ARRAY_ELEM_KIND(arr) != ARRAY_ELEM_OTHER,                                          \
+                   name " requires an integer or floating-point element type"                         \
+                   " (array_sort_by and array_bsearch_by take a comparator)")
+
+/* Comparator used by the sorting and searching functions: ctx is passed through unchanged */
+typedef int (*array_cmp_fn)(const void *a, const void *b, void *ctx);
+
+/* Describes a primitive element type to _array_prim_key */
+typedef struct {
+    size_t size;
+    int kind;
+} array_prim_type;
+
+/* Returns an unsigned key for the primitive element at p whose order matches the order of
+   the values: the sign bit of signed integers is flipped, and negative floats are inverted */
+static inline uint64_t _array_prim_key(const void *p, array_prim_type type) {
+    uint64_t key;
+    switch (type.size) {
+    case 1: { uint8_t v; memcpy(&v, p, 1); key = v; break; }
+    case 2: { uint16_t v; memcpy(&v, p, 2); key = v; break; }
+    case 4: { uint32_t v; memcpy(&v, p, 4); key = v; break; }
+    default: memcpy(&key, p, 8); break;
+    }
+    uint64_t sign = (uint64_t)1 << (type.size * 8 - 1);
+    if (type.kind == ARRAY_ELEM_SIGNED)
+        return key ^ sign;
+    if (type.kind == ARRAY_ELEM_FLOAT) {
+        uint64_t mask = sign | (sign - 1);
+        return (key & sign) ? ~key & mask : key | sign;
+    }
+    return key;
+}
+
+/* Comparator over primitive elements; ctx points to their array_prim_type */
+static inline int _array_prim_cmp(const void *a, const void *b, void *ctx) {
+    array_prim_type type = *(const array_prim_type *)ctx;
+    uint64_t ka = _array_prim_key(a, type), kb = _array_prim_key(b, type);
+    return (ka > kb) - (ka < kb);
+}
+
+/* Comparator that calls the qsort-style comparator ctx points to */
+static inline int _array_user_cmp(const void *a, const void *b, void *ctx) {
+    return (*(int (**)(const void *, const void *))ctx)(a, b);
+}
+
+/* Swaps the size-byte elements at a and b */
+static inline void _array_swap(char *a, char *b, size_t size) {
+    char tmp[64];
+    while (size) {
+        size_t chunk = size < sizeof(tmp) ? size : sizeof(tmp);
+        memcpy(tmp, a, chunk);
+        memcpy(a, b, chunk);
+        memcpy(b, tmp, chunk);
+        a += chunk;
+        b += chunk;
+        size -= chunk;
+    }
+}
+
+/* Sorts the n elements at base by insertion */
+static inline void _array_insertion_sort(char *base, size_t n, size_t size, array_cmp_fn cmp, void *ctx) {
+    for (size_t i = 1; i < n; i++) {
+        for (size_t j = i; j > 0 && cmp(base + (j - 1) * size, base + j * size, ctx) > 0; j--)
+            _array_swap(base + (j - 1) * size, base + j * size, size);
+    }
+}
+
+/* Restores the max-heap property below node i of the n-element heap at base */
+static inline void _array_sift_down(char *base, size_t i, size_t n, size_t size, array_cmp_fn cmp, void *ctx) {
+    for (;;) {
+        size_t child = 2 * i + 1;
+        if (child >= n)
+            return;
+        if (child + 1 < n && cmp(base + child * size, base + (child + 1) * size, ctx) < 0)
+            child++;
+        if (cmp(base + i * size, base + child * size, ctx) >= 0)
+            return;
+        _array_swap(base + i * size, base + child * size, size);
+        i = child;
+    }
+}
+
+/* Sorts the n elements at base with heapsort */
+static inline void _array_heap_sort(char *base, size_t n, size_t size, array_cmp_fn cmp, void *ctx) {
+    for (size_t i = n / 2; i-- > 0;)
+        _array_sift_down(base, i, n, size, cmp, ctx);
+    for (size_t end = n; end-- > 1;) {
+        _array_swap(base, base + end * size, size);
+        _array_sift_down(base, 0, end, size, cmp, ctx);
+    }
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _array_introsort
+   Sorts the n elements at base with quicksort (median-of-three pivot,
+   recursing into the smaller side), switching to heapsort for a range
+   once depth reaches zero and to insertion sort for short ranges, so the
+   worst case stays O(n log n).
+------------------------------------------------------------------ */
+static inline void _array_introsort(char *base, size_t n, size_t size, array_cmp_fn cmp, void *ctx,
+                                    unsigned depth) {
+    while (n > ARRAY_ALGO_INSERTION_SORT_MAX) {
+        if (!depth--) {
+            _array_heap_sort(base, n, size, cmp, ctx);
+            return;
+        }
+        /* Order first, middle and last, and use the middle one as the pivot at base */
+        char *lo = base, *mid = base + (n / 2) * size, *hi = base + (n - 1) * size;
+        if (cmp(mid, lo, ctx) < 0) _array_swap(mid, lo, size);
+        if (cmp(hi, mid, ctx) < 0) {
+            _array_swap(hi, mid, size);
+            if (cmp(mid, lo, ctx) < 0) _array_swap(mid, lo, size);
+        }
+        _array_swap(base, mid, size);
+        /* Hoare partition around the pivot at base */
+        size_t i = 0, j = n;
+        for (;;) {
+            do i++; while (i < n && cmp(base + i * size, base, ctx) < 0);
+            do j--; while (cmp(base + j * size, base, ctx) > 0);
+            if (i >= j)
+                break;
+            _array_swap(base + i * size, base + j * size, size);
+        }
+        _array_swap(base, base + j * size, size);
+        /* The pivot is now at j */
+        size_t left = j, right = n - j - 1;
+        if (left < right) {
+            _array_introsort(base, left, size, cmp, ctx, depth);
+            base += (j + 1) * size;
+            n = right;
+        } else {
+            _array_introsort(base + (j + 1) * size, right, size, cmp, ctx, depth);
+            n = left;
+        }
+    }
+    _array_insertion_sort(base, n, size, cmp, ctx);
+}
+
+/* Returns the depth limit for introsort on n elements (2 * log2(n)) */
+static inline unsigned _array_introsort_depth(size_t n) {
+    unsigned depth = 0;
+    while (n >>= 1)
+        depth += 2;
+    return depth;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _array_radix_sort
+   Sorts the n primitive elements at base with an LSD radix sort on the
+   bytes of _array_prim_key, using scratch (room for n elements). All the
+   byte histograms are built in one pass, and passes in which every key has
+   the same byte are skipped, so narrow value ranges cost fewer passes.
+------------------------------------------------------------------ */
+static inline void _array_radix_sort(char *base, size_t n, array_prim_type type, char *scratch) {
+    size_t size = type.size;
+    size_t counts[8][256];
+    memset(counts, 0, sizeof(counts[0]) * size);
+    for (size_t i = 0; i < n; i++) {
+        uint64_t key = _array_prim_key(base + i * size, type);
+        for (size_t b = 0; b < size; b++)
+            counts[b][(key >> (b * 8)) & 0xff]++;
+    }
+    char *src = base, *dst = scratch;
+    for (size_t b = 0; b < size; b++) {
+        size_t first = (_array_prim_key(base, type) >> (b * 8)) & 0xff;
+        if (counts[b][first] == n)
+            continue;
+        size_t pos = 0;
+        for (size_t d = 0; d < 256; d++) {
+            size_t c = counts[b][d];
+            counts[b][d] = pos;
+            pos += c;
+        }
+        for (size_t i = 0; i < n; i++) {
+            size_t d = (_array_prim_key(src + i * size, type) >> (b * 8)) & 0xff;
+            memcpy(dst + counts[b][d]++ * size, src + i * size, size);
+        }
+        char *tmp = src;
+        src = dst;
+        dst = tmp;
+    }
+    if (src != base)
+        memcpy(base, src, n * size);
+}
+
+/* Sorts the n primitive elements of arr (which is bound to allocator) */
+static inline void _array_sort_prim(void *arr, size_t n, array_prim_type type, const simple_allocator *allocator) {
+    if (n < 2)
+        return;
+    char *scratch = n >= ARRAY_ALGO_RADIX_MIN ? (char *)simple_ds_malloc(allocator, n * type.size) : NULL;
+    if (scratch) {
+        _array_radix_sort((char *)arr, n, type, scratch);
+        simple_ds_free(allocator, scratch, n * type.size);
+    } else {
+        _array_introsort((char *)arr, n, type.size, _array_prim_cmp, &type, _array_introsort_depth(n));
+    }
+}
+
+/* ------------------------------------------------------------------
+   array_sort(arr)
+   Sorts an array of integers or floating-point values in ascending order.
+   Arrays of at least ARRAY_ALGO_RADIX_MIN elements are radix sorted in
+   O(n) passes over the array; shorter ones are sorted by comparison.
+   - If (arr) is NULL, no action is taken.
+   Example:
+       array_sort(values);
+------------------------------------------------------------------ */
+#define array_sort(arr)                                                                                  \
+    do {                                                                                                 \
+        ARRAY_CHECK_PRIMITIVE(arr, "array_sort");                                                        \
+        __typeof__(arr) _so_a = (arr);                                                                   \
+        if (_so_a) {                                                                                     \
+            array_header *_so_hdr = ARRAY_HEADER(_so_a);                                                 \
+            _array_sort_prim(_so_a, _so_hdr->count,                                                      \
+                             (array_prim_type){ sizeof(*(_so_a)), ARRAY_ELEM_KIND(_so_a) },              \
+                             _so_hdr->allocator);                                                        \
+        }                                                                                                \
+    } while (0)
+
+/* Internal macro: statically checks that cmp is a qsort-style comparator. It is called
+   through this type, so comparators taking const T * (which would have to be called
+   through a cast) are rejected. */
+#define ARRAY_CHECK_CMP(cmp)                                                                                 \
+    _Static_assert(__builtin_types_compatible_p(__typeof__(&*(cmp)), int (*)(const void *, const void *)),   \
+                   "cmp must be an int (*)(const void *, const void *)")
+
+/* ------------------------------------------------------------------
+   array_sort_by(arr, cmp)
+   Sorts the array with introsort, ordering elements by cmp, which returns
+   a negative, zero or positive value as qsort comparators do. cmp is an
+   int (*)(const void *, const void *), called with pointers to elements.
+   - If (arr) is NULL, no action is taken.
+   - The sort is not stable.
+   Example:
+       static int by_age(const void *a, const void *b) {
+           const Person *pa = a, *pb = b;
+           return (pa->age > pb->age) - (pa->age < pb->age);
+       }
+       array_sort_by(people, by_age);
+------------------------------------------------------------------ */
+#define array_sort_by(arr, cmp)                                                                          \
+    do {                                                                                                 \
+        ARRAY_CHECK_CMP(cmp);                                                                            \
+        __typeof__(arr) _sb_a = (arr);                                                                   \
+        int (*_sb_cmp)(const void *, const void *) = (cmp);                                              \
+        size_t _sb_n = array_count(_sb_a);                                                               \
+        if (_sb_n > 1)                                                                                   \
+            _array_introsort((char *)_sb_a, _sb_n, sizeof(*(_sb_a)), _array_user_cmp, &_sb_cmp,          \
+                             _array_introsort_depth(_sb_n));                                             \
+    } while (0)
+
+/* Returns the index of the first of the n elements at base that does not compare less than key */
+static inline size_t _array_lower_bound_impl(const char *base, size_t n, size_t size, const void *key,
+                                             array_cmp_fn cmp, void *ctx) {
+    size_t lo = 0;
+    while (n) {
+        size_t half = n / 2;
+        if (cmp(base + (lo + half) * size, key, ctx) < 0) {
+            lo += half + 1;
+            n -= half + 1;
+        } else {
+            n = half;
+        }
+    }
+    return lo;
+}
+
+/* ------------------------------------------------------------------
+   array_lower_bound(arr, value)
+   Returns the index of the first element of a sorted primitive array that
+   is not less than value (array_count(arr) if there is none), with a
+   binary search in the element type's own comparisons.
+   Example:
+       size_t i = array_lower_bound(sorted, 42);
+------------------------------------------------------------------ */
+#define array_lower_bound(arr, value)                                                                    \
+    ({                                                                                                   \
+        ARRAY_CHECK_PRIMITIVE(arr, "array_lower_bound");                                                 \
+        __typeof__(arr) _lb_a = (arr);                                                                   \
+        __typeof__(_lb_a[0]) _lb_v = (value);                                                            \
+        size_t _lb_lo = 0, _lb_n = array_count(_lb_a);                                                   \
+        while (_lb_n) {                                                                                  \
+            size_t _lb_half = _lb_n / 2;                                                                 \
+            if (_lb_a[_lb_lo + _lb_half] < _lb_v) {                                                      \
+                _lb_lo += _lb_half + 1;                                                                  \
+                _lb_n -= _lb_half + 1;                                                                   \
+            } else {                                                                                     \
+                _lb_n = _lb_half;                                                                        \
+            }                                                                                            \
+        }                                                                                                \
+        _lb_lo;                                                                                          \
+    })
+
+/* ------------------------------------------------------------------
+   array_bsearch(arr, value)
+   Returns a pointer to the first element equal to value in a primitive
+   array sorted in ascending order (see array_sort), or NULL if there is
+   none.
+   Example:
+       int *hit = array_bsearch(sorted, 42);
+------------------------------------------------------------------ */
+#define array_bsearch(arr, value)                                                                        \
+    ({                                                                                                   \
+        ARRAY_CHECK_PRIMITIVE(arr, "array_bsearch");                                                     \
+        __typeof__(arr) _bs_a = (arr);                                                                   \
+        __typeof__(_bs_a[0]) _bs_v = (value);                                                            \
+        size_t _bs_i = array_lower_bound(_bs_a, _bs_v);                                                  \
+        _bs_i < array_count(_bs_a) && _bs_a[_bs_i] == _bs_v ? &_bs_a[_bs_i] : (__typeof__(arr))NULL;     \
+    })
+
+/* ------------------------------------------------------------------
+   array_bsearch_by(arr, key, cmp)
+   Returns a pointer to the first element that compares equal to key in an
+   array sorted by cmp (see array_sort_by), or NULL if there is none. key
+   is an element (typically with only the compared fields set), and cmp
+   is called as cmp(element, &key).
+   Example:
+       Person *p = array_bsearch_by(people, ((Person){ .age = 30 }), by_age);
+------------------------------------------------------------------ */
+#define array_bsearch_by(arr, key, cmp)                                                                  \
+    ({                                                                                                   \
+        ARRAY_CHECK_CMP(cmp);                                                                            \
+        __typeof__(arr) _bb_a = (arr);                                                                   \
+        __typeof__(_bb_a[0]) _bb_key = (key);                                                            \
+        int (*_bb_cmp)(const void *, const void *) = (cmp);                                              \
+        size_t _bb_n = array_count(_bb_a);                                                               \
+        size_t _bb_i = _array_lower_bound_impl((const char *)_bb_a, _bb_n, sizeof(*(_bb_a)), &_bb_key,   \
+                                               _array_user_cmp, &_bb_cmp);                               \
+        _bb_i < _bb_n && _bb_cmp(&_bb_a[_bb_i], &_bb_key) == 0 ? &_bb_a[_bb_i] : (__typeof__(arr))NULL;  \
+    })
+
+/* ------------------------------------------------------------------
+   array_find(arr, value)
+   Returns a pointer to the first element of a primitive array equal to
+   value, or NULL if there is none. Elements are compared in blocks of 64
+   bytes without early exits inside a block, so that the compiler can
+   turn each block into a few vector compares.
+   Example:
+       int *first_zero = array_find(values, 0);
+------------------------------------------------------------------ */
+#define array_find(arr, value)                                                                           \
+    ({                                                                                                   \
+        ARRAY_CHECK_PRIMITIVE(arr, "array_find");                                                        \
+        __typeof__(arr) _fd_a = (arr);                                                                   \
+        __typeof__(_fd_a[0]) _fd_v = (value);                                                            \
+        size_t _fd_n = array_count(_fd_a), _fd_i = 0;                                                    \
+        enum { _fd_block = 64 / sizeof(_fd_v) ? 64 / sizeof(_fd_v) : 1 };                                \
+        for (; _fd_i + _fd_block <= _fd_n; _fd_i += _fd_block) {                                         \
+            int _fd_any = 0;                                                                             \
+            for (size_t _fd_j = 0; _fd_j < _fd_block; _fd_j++)                                           \
+                _fd_any |= _fd_a[_fd_i + _fd_j] == _fd_v;                                                \
+            if (_fd_any)                                                                                 \
+                break;                                                                                   \
+        }                                                                                                \
+        while (_fd_i < _fd_n && !(_fd_a[_fd_i] == _fd_v))                                                \
+            _fd_i++;                                                                                     \
+        _fd_i < _fd_n ? &_fd_a[_fd_i] : (__typeof__(arr))NULL;                                           \
+    })
+
+/* The type array_sum accumulates in: long long, unsigned long long or double */
+#define ARRAY_SUM_TYPE(arr)                                                                              \
+    __typeof__(__builtin_choose_expr(ARRAY_ELEM_KIND(arr) == ARRAY_ELEM_FLOAT, (double)0,                \
+                __builtin_choose_expr(ARRAY_ELEM_KIND(arr) == ARRAY_ELEM_UNSIGNED,                       \
+                                      (unsigned long long)0, (long long)0)))
+
+/* ------------------------------------------------------------------
+   array_sum(arr)
+   Returns the sum of a primitive array: a long long for signed integers,
+   an unsigned long long for unsigned ones, and a double for floating-point
+   values (0 for an empty or NULL array). Eight independent accumulators
+   are used, so the additions can be vectorized and do not wait on each
+   other; floating-point sums may therefore differ in the last bits from
+   a left-to-right sum.
+   Example:
+       long long total = array_sum(values);
+------------------------------------------------------------------ */
+#define array_sum(arr)                                                                                   \
+    ({                                                                                                   \
+        ARRAY_CHECK_PRIMITIVE(arr, "array_sum");                                                         \
+        __typeof__(arr) _sm_a = (arr);                                                                   \
+        size_t _sm_n = array_count(_sm_a), _sm_i = 0;                                                    \
+        ARRAY_SUM_TYPE(_sm_a) _sm_acc[8] = { 0 };                                                        \
+        for (; _sm_i + 8 <= _sm_n; _sm_i += 8) {                                                         \
+            for (size_t _sm_j = 0; _sm_j < 8; _sm_j++)                                                   \
+                _sm_acc[_sm_j] += (ARRAY_SUM_TYPE(_sm_a))_sm_a[_sm_i + _sm_j];                           \
+        }                                                                                                \
+        for (; _sm_i < _sm_n; _sm_i++)                                                                   \
+            _sm_acc[0] += (ARRAY_SUM_TYPE(_sm_a))_sm_a[_sm_i];                                           \
+        ((_sm_acc[0] + _sm_acc[1]) + (_sm_acc[2] + _sm_acc[3])) +                                        \
+            ((_sm_acc[4] + _sm_acc[5]) + (_sm_acc[6] + _sm_acc[7]));                                     \
+    })
+
+/* One chunk of an array_parallel_for call */
+typedef struct {
+    void (*fn)(void *elems, size_t n, size_t task, void *ctx);
+    char *elems;
+    size_t n;
+    size_t task;
+    void *ctx;
+} array_par_task;
+
+static inline void *_array_par_thread(void *arg) {
+    array_par_task *task = (array_par_task *)arg;
+    task->fn(task->elems, task->n, task->task, task->ctx);
+    return NULL;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _array_parallel_for_impl
+   Splits the n elements at base into up to nthreads contiguous chunks (0
+   for one per online CPU, and never more than n) and calls fn on each,
+   the first from the calling thread and the rest from new threads (or
+   from the calling thread, if a thread cannot be started). Returns the
+   number of chunks.
+------------------------------------------------------------------ */
+static inline size_t _array_parallel_for_impl(void *base, size_t n, size_t elem_size, size_t nthreads,
+                                              void (*fn)(void *, size_t, size_t, void *), void *ctx) {
+    if (!nthreads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    if (nthreads > ARRAY_ALGO_MAX_THREADS)
+        nthreads = ARRAY_ALGO_MAX_THREADS;
+    if (nthreads > n)
+        nthreads = n;
+    pthread_t threads[ARRAY_ALGO_MAX_THREADS];
+    array_par_task tasks[ARRAY_ALGO_MAX_THREADS];
+    int started[ARRAY_ALGO_MAX_THREADS] = { 0 };
+    for (size_t t = 0; t < nthreads; t++) {
+        size_t lo = n * t / nthreads, hi = n * (t + 1) / nthreads;
+        tasks[t] = (array_par_task){ fn, (char *)base + lo * elem_size, hi - lo, t, ctx };
+        if (t)
+            started[t] = pthread_create(&threads[t], NULL, _array_par_thread, &tasks[t]) == 0;
+    }
+    if (nthreads)
+        _array_par_thread(&tasks[0]);
+    for (size_t t = 1; t < nthreads; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            _array_par_thread(&tasks[t]);
+    }
+    return nthreads;
+}
+
+/* ------------------------------------------------------------------
+   array_parallel_for(arr, nthreads, fn, ctx)
+   Splits the array into up to nthreads contiguous chunks (0 for one per
+   online CPU) and calls fn(elems, n, task, ctx) once per chunk, each from
+   its own thread, where elems points to the n elements of the chunk and
+   task numbers the chunks from 0. Evaluates to the number of chunks, so
+   that per-task partial results can be combined afterwards.
+   - fn is a void (*)(void *elems, size_t n, size_t task, void *ctx); elems
+     points to elements of the array's type.
+   - Threads are started for the call and joined before it returns.
+   - fn must not resize the array.
+   Example:
+       static void add_one(void *elems, size_t n, size_t task, void *ctx) {
+           int *v = elems;
+           for (size_t i = 0; i < n; i++) v[i]++;
+       }
+       array_parallel_for(values, 8, add_one, NULL);
+------------------------------------------------------------------ */
+#define array_parallel_for(arr, nthreads, fn, ctx)                                                             \
+    ({                                                                                                         \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(&*(fn)),                                        \
+                                                    void (*)(void *, size_t, size_t, void *)),                 \
+                       "fn must be a void (*)(void *elems, size_t n, size_t task, void *ctx)");                \
+        __typeof__(arr) _pf_a = (arr);                                                                         \
+        _array_parallel_for_impl(_pf_a, array_count(_pf_a), sizeof(*(_pf_a)), (nthreads), (fn), (ctx));        \
+    })
+
+#endif  /* SIMPLE_ARRAY_ALGO_H */
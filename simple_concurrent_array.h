@@ -0,0 +1,348 @@
+/*
+ * A lock-free append-only array for many producers and one consumer.
+ *
+ * Producers reserve a slot with a single atomic fetch-add on the shared count, write
+ * their element into it and then mark it ready. The elements live in segments whose
+ * sizes double (CARRAY_FIRST_SEGMENT, then twice that, and so on), so the array grows
+ * without ever moving an element: a producer that reaches a segment nobody has
+ * allocated yet allocates it and installs it with a compare-and-swap, and the loser of
+ * a race frees its own copy. No producer ever takes a lock or waits for another one.
+ *
+ * A single consumer drains the array in order, in batches of consecutive ready
+ * elements. A segment is freed as soon as every one of its elements has been drained,
+ * so a long-running producer/consumer pipeline only keeps the undrained tail in memory.
+ *
+ * The handle is a pointer to the segment table (T **), preceded by a hidden header:
+ *   - count:       Number of slots reserved so far (on its own cache line).
+ *   - consumed:    Number of elements drained so far (on its own cache line).
+ *   - first_bits:  log2(CARRAY_FIRST_SEGMENT).
+ *   - nsegments:   Length of the segment table.
+ *
+ * Default configuration:
+ *   - CARRAY_FIRST_SEGMENT:  Number of elements in the first segment (a power of two).
+ *
+ * Usage notes:
+ *   - carray_push may be called from any number of threads at once. carray_drain,
+ *     carray_at and carray_pending must only be called from one consumer thread.
+ *   - carray_count counts reserved slots, some of which may not be ready yet.
+ *   - A pointer returned by carray_at stays valid until the element is drained.
+ *   - Each segment keeps a ready byte per element after the elements.
+ *   - If a new segment cannot be allocated, carray_push aborts the program, since the
+ *     slot it has reserved could otherwise never be drained.
+ *   - carray_init and carray_free must not race with other operations on the array.
+ *
+ * Public API macros:
+ *   - carray_init(a):                  Allocates an empty array.
+ *   - carray_push(a, item):            Appends item; returns its index.
+ *   - carray_count(a):                 Gets the number of reserved slots.
+ *   - carray_pending(a):               Gets the number of elements that can be drained right now.
+ *   - carray_at(a, index):             Gets a pointer to a ready, undrained element (or NULL).
+ *   - carray_drain(a, out, max):       Moves up to max ready elements, in order, to out; returns how many.
+ *   - carray_free(a):                  Frees the array.
+ *   - carray_free_free(a, free_func):  Frees the array, calling free_func for each undrained element.
+ */
+
+#ifndef SIMPLE_CONCURRENT_ARRAY_H
+#define SIMPLE_CONCURRENT_ARRAY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "simple_alloc.h"
+
+#ifndef CARRAY_FIRST_SEGMENT
+#define CARRAY_FIRST_SEGMENT 64
+#endif
+
+#if (CARRAY_FIRST_SEGMENT) & ((CARRAY_FIRST_SEGMENT) - 1)
+#error "CARRAY_FIRST_SEGMENT must be a power of two"
+#endif
+
+#define CARRAY_MAGIC_NUMBER 0xca77a9e5
+
+/* Hidden header stored immediately before the segment table.
+ * Fields:
+ *   - raw:          The allocation that the header was aligned within.
+ *   - first_bits:   log2 of the size of segment 0; segment s holds 1 << (first_bits + s) elements.
+ *   - nsegments:    Number of entries in the segment table.
+ *   - count:        Slots reserved by producers, advanced with an atomic fetch-add.
+ *   - consumed:     Elements drained by the consumer. Only written by the consumer.
+ * count and consumed are kept on separate cache lines so that producers and the
+ * consumer do not contend.
+ */
+typedef struct {
+    void *raw;
+    size_t first_bits;
+    size_t nsegments;
+#ifndef SIMPLE_DS_NO_MAGIC
+    uint32_t magic_number; // Used to assert that the header is valid
+#endif
+    size_t count __attribute__((aligned(64)));
+    size_t consumed __attribute__((aligned(64)));
+} __attribute__((aligned(64))) carray_header;
+
+/* The segment table starts right after the header, which is a multiple of a cache line */
+#define CARRAY_HEADER_SIZE sizeof(carray_header)
+
+/* Given an array handle, CARRAY_HEADER returns a pointer to its hidden header */
+#define CARRAY_HEADER(a) ({                                                       \
+    carray_header *hdr = ((carray_header *)((char *)(a) - CARRAY_HEADER_SIZE));   \
+    SIMPLE_DS_CHECK_MAGIC(hdr, CARRAY_MAGIC_NUMBER);                              \
+    hdr;                                                                          \
+})
+
+#define carray_count(a) ((a) ? __atomic_load_n(&CARRAY_HEADER(a)->count, __ATOMIC_RELAXED) : 0)
+
+/* ------------------------------------------------------------------
+   Internal function: _carray_alloc_impl
+   Allocates the header and an empty segment table (aligned to a cache
+   line). Returns the segment table, or NULL.
+------------------------------------------------------------------ */
+static inline void **_carray_alloc_impl(void) {
+    size_t first_bits = 0;
+    while (((size_t)1 << first_bits) < CARRAY_FIRST_SEGMENT)
+        first_bits++;
+    size_t nsegments = sizeof(size_t) * 8 - first_bits;
+    size_t align = __alignof__(carray_header);
+    void *raw = SIMPLE_DS_CALLOC(1, CARRAY_HEADER_SIZE + nsegments * sizeof(void *) + align - 1);
+    if (!raw)
+        return NULL;
+    carray_header *hdr = (carray_header *)(((uintptr_t)raw + align - 1) & ~(uintptr_t)(align - 1));
+    hdr->raw = raw;
+    hdr->first_bits = first_bits;
+    hdr->nsegments = nsegments;
+    SIMPLE_DS_SET_MAGIC(hdr, CARRAY_MAGIC_NUMBER);
+    return (void **)((char *)hdr + CARRAY_HEADER_SIZE);
+}
+
+/* ------------------------------------------------------------------
+   carray_init(a)
+   Allocates an empty array if (a) is NULL. a is declared as a pointer to
+   pointers to the element type, and must be initialized before it is
+   shared between threads.
+   Example:
+       Record **log = NULL;
+       carray_init(log);
+------------------------------------------------------------------ */
+#define carray_init(a)                                                            \
+    do {                                                                          \
+        if (!(a)) {                                                               \
+            (a) = (__typeof__(a))_carray_alloc_impl();                            \
+        }                                                                         \
+    } while (0)
+
+/* Returns the segment that holds element index, and sets *offset to its position there.
+ * With B = 1 << first_bits, index + B has its top bit at first_bits + segment. */
+static inline size_t _carray_locate(carray_header *hdr, size_t index, size_t *offset) {
+    size_t biased = index + ((size_t)1 << hdr->first_bits);
+    unsigned top = (unsigned)(sizeof(unsigned long long) * 8 - 1) - (unsigned)__builtin_clzll(biased);
+    *offset = biased - ((size_t)1 << top);
+    return top - hdr->first_bits;
+}
+
+/* Returns the number of elements in segment seg */
+static inline size_t _carray_segment_size(carray_header *hdr, size_t seg) {
+    return (size_t)1 << (hdr->first_bits + seg);
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _carray_segment
+   Returns segment seg of a, allocating it if no producer has done so yet.
+   A new segment's ready bytes are zeroed before it is published with a
+   compare-and-swap; if another producer published one first, the new
+   segment is freed and the other one is returned.
+------------------------------------------------------------------ */
+static inline char *_carray_segment(void **a, carray_header *hdr, size_t seg, size_t elem_size) {
+    char *segment = (char *)__atomic_load_n(&a[seg], __ATOMIC_ACQUIRE);
+    if (segment)
+        return segment;
+    size_t n = _carray_segment_size(hdr, seg);
+    char *fresh = (char *)SIMPLE_DS_MALLOC(n * elem_size + n);
+    if (!fresh)
+        abort();
+    memset(fresh + n * elem_size, 0, n);
+    void *expected = NULL;
+    if (__atomic_compare_exchange_n(&a[seg], &expected, fresh, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        return fresh;
+    SIMPLE_DS_FREE(fresh);
+    return (char *)expected;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _carray_reserve
+   Reserves the next slot with one atomic fetch-add on count. Stores its
+   index in *index and a pointer to its ready byte in *ready, and returns
+   a pointer to the slot.
+------------------------------------------------------------------ */
+static inline void *_carray_reserve(void **a, size_t elem_size, size_t *index, uint8_t **ready) {
+    carray_header *hdr = CARRAY_HEADER(a);
+    size_t idx = __atomic_fetch_add(&hdr->count, 1, __ATOMIC_RELAXED);
+    size_t offset;
+    size_t seg = _carray_locate(hdr, idx, &offset);
+    char *segment = _carray_segment(a, hdr, seg, elem_size);
+    *index = idx;
+    *ready = (uint8_t *)segment + _carray_segment_size(hdr, seg) * elem_size + offset;
+    return segment + offset * elem_size;
+}
+
+/* ------------------------------------------------------------------
+   carray_push(a, item)
+   Appends item from any thread, without locking, and returns its index
+   (a size_t). The element becomes visible to the consumer once it has
+   been fully written. (a) must have been initialized with carray_init.
+   Example:
+       Record rec = { now(), "started" };
+       carray_push(log, rec);
+------------------------------------------------------------------ */
+#define carray_push(a, item)                                                                        \
+    ({                                                                                              \
+        __typeof__(item) _cp_item = (item);                                                         \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(_cp_item), __typeof__(**(a))),       \
+                       "item must be of the same type as **a");                                     \
+        size_t _cp_index;                                                                           \
+        uint8_t *_cp_ready;                                                                         \
+        __typeof__(*(a)) _cp_slot = (__typeof__(*(a)))_carray_reserve((void **)(a), sizeof(**(a)),  \
+                                                                      &_cp_index, &_cp_ready);      \
+        *_cp_slot = _cp_item;                                                                       \
+        __atomic_store_n(_cp_ready, 1, __ATOMIC_RELEASE);                                           \
+        _cp_index;                                                                                  \
+    })
+
+/* ------------------------------------------------------------------
+   Internal function: _carray_at_impl
+   Returns a pointer to element index if it has been written and not yet
+   drained, or NULL. Called from the consumer thread.
+------------------------------------------------------------------ */
+static inline void *_carray_at_impl(void **a, size_t index, size_t elem_size) {
+    if (!a)
+        return NULL;
+    carray_header *hdr = CARRAY_HEADER(a);
+    if (index < hdr->consumed || index >= __atomic_load_n(&hdr->count, __ATOMIC_RELAXED))
+        return NULL;
+    size_t offset;
+    size_t seg = _carray_locate(hdr, index, &offset);
+    char *segment = (char *)__atomic_load_n(&a[seg], __ATOMIC_ACQUIRE);
+    if (!segment)
+        return NULL;
+    size_t n = _carray_segment_size(hdr, seg);
+    if (!__atomic_load_n((uint8_t *)segment + n * elem_size + offset, __ATOMIC_ACQUIRE))
+        return NULL;
+    return segment + offset * elem_size;
+}
+
+#define carray_at(a, index) ((__typeof__(*(a)))_carray_at_impl((void **)(a), (size_t)(index), sizeof(**(a))))
+
+/* ------------------------------------------------------------------
+   Internal function: _carray_drain_impl
+   Copies up to max consecutive ready elements, starting at the first
+   undrained one, to out (which may be NULL to discard them), stopping at
+   the first slot that is reserved but not ready yet. Every segment that
+   has been drained completely is freed. Returns the number of elements
+   drained. Only the consumer may call this.
+------------------------------------------------------------------ */
+static inline size_t _carray_drain_impl(void **a, void *out, size_t max, size_t elem_size) {
+    if (!a)
+        return 0;
+    carray_header *hdr = CARRAY_HEADER(a);
+    size_t start = hdr->consumed;
+    size_t end = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+    if (end - start > max)
+        end = start + max;
+    size_t done = 0;
+    while (start + done < end) {
+        size_t offset;
+        size_t seg = _carray_locate(hdr, start + done, &offset);
+        char *segment = (char *)__atomic_load_n(&a[seg], __ATOMIC_ACQUIRE);
+        if (!segment)
+            break;
+        size_t n = _carray_segment_size(hdr, seg);
+        uint8_t *ready = (uint8_t *)segment + n * elem_size;
+        size_t run = 0;
+        size_t limit = n - offset < end - start - done ? n - offset : end - start - done;
+        while (run < limit && __atomic_load_n(&ready[offset + run], __ATOMIC_ACQUIRE))
+            run++;
+        if (out && run)
+            memcpy((char *)out + done * elem_size, segment + offset * elem_size, run * elem_size);
+        done += run;
+        if (offset + run < n)
+            break;
+        /* Every element of this segment has been written and drained */
+        __atomic_store_n(&a[seg], NULL, __ATOMIC_RELAXED);
+        SIMPLE_DS_FREE(segment);
+    }
+    hdr->consumed = start + done;
+    return done;
+}
+
+/* ------------------------------------------------------------------
+   carray_drain(a, out, max)
+   Moves up to max elements, in push order, into the buffer out (a pointer
+   to the element type, or NULL to discard them) and returns how many were
+   moved. Draining stops early at the first element whose producer has not
+   finished writing it. Only the consumer thread may drain.
+   Example:
+       Record batch[256];
+       size_t n;
+       while ((n = carray_drain(log, batch, 256)) > 0)
+           write_records(batch, n);
+------------------------------------------------------------------ */
+#define carray_drain(a, out, max)                                                                   \
+    ({                                                                                              \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(*(out)), __typeof__(**(a))) ||       \
+                           __builtin_types_compatible_p(__typeof__(out), void *),                   \
+                       "out must point to the element type");                                       \
+        _carray_drain_impl((void **)(a), (out), (size_t)(max), sizeof(**(a)));                      \
+    })
+
+/* Returns the number of ready elements that carray_drain would move right now */
+static inline size_t _carray_pending_impl(void **a, size_t elem_size) {
+    if (!a)
+        return 0;
+    carray_header *hdr = CARRAY_HEADER(a);
+    size_t end = __atomic_load_n(&hdr->count, __ATOMIC_ACQUIRE);
+    size_t pending = 0;
+    while (hdr->consumed + pending < end && _carray_at_impl(a, hdr->consumed + pending, elem_size))
+        pending++;
+    return pending;
+}
+
+#define carray_pending(a) _carray_pending_impl((void **)(a), sizeof(**(a)))
+
+/* ------------------------------------------------------------------
+   carray_free_free(a, free_func)
+   carray_free(a)
+   Calls free_func (a function pointer or block taking the element type,
+   or NULL) on every element that has not been drained, frees every
+   segment and the header, and sets a to NULL. The array must not be in
+   use by other threads.
+------------------------------------------------------------------ */
+#define carray_free_free(a, free_func)                                                \
+    do {                                                                              \
+        __typeof__(a) _cf_a = (a);                                                    \
+        if (_cf_a) {                                                                  \
+            void (^_cf_free_func)(__typeof__(**_cf_a)) =                              \
+                _Generic((free_func),                                                 \
+                    void (*)(__typeof__(**_cf_a)): (free_func),                       \
+                    void (^)(__typeof__(**_cf_a)): (free_func),                       \
+                    default: ((void (^)(__typeof__(**_cf_a)))0)                       \
+                );                                                                    \
+            carray_header *_cf_hdr = CARRAY_HEADER(_cf_a);                            \
+            for (size_t _cf_i = _cf_hdr->consumed;                                    \
+                 _cf_free_func && _cf_i < _cf_hdr->count; _cf_i++) {                  \
+                __typeof__(*_cf_a) _cf_elem = carray_at(_cf_a, _cf_i);                \
+                if (_cf_elem) {                                                       \
+                    _cf_free_func(*_cf_elem);                                         \
+                }                                                                     \
+            }                                                                         \
+            for (size_t _cf_s = 0; _cf_s < _cf_hdr->nsegments; _cf_s++) {             \
+                SIMPLE_DS_FREE(_cf_a[_cf_s]);                                         \
+            }                                                                         \
+            SIMPLE_DS_FREE(_cf_hdr->raw);                                             \
+            (a) = NULL;                                                               \
+        }                                                                             \
+    } while (0)
+#define carray_free(a) carray_free_free(a, NULL)
+
+#endif  /* SIMPLE_CONCURRENT_ARRAY_H */
@@ -0,0 +1,297 @@
+/*
+ * A thread-safe hash map that stripes the key space across independent simple_map shards.
+ *
+ * Each shard is an ordinary simple_map guarded by its own reader-writer lock, and a key's
+ * shard is picked from the high bits of its hash (the shard's buckets are indexed from the
+ * low bits). Lookups only take their shard's lock in shared mode, so readers never block
+ * each other, and a writer only blocks the threads that use the same shard. Each shard
+ * grows on its own, so a resize never stops the world.
+ *
+ * The handle is a pointer to the array of shard maps (T **), preceded by a hidden header:
+ *   - nshards:     Number of shards (a power of two).
+ *   - shard_bits:  log2(nshards).
+ *   - locks:       One cache-line sized reader-writer lock per shard.
+ *
+ * Default configuration:
+ *   - CMAP_SHARDS_DEFAULT:  Number of shards used when cmap_init is given 0.
+ *   - Everything else (key types, hash function, storage modes) is configured as for
+ *     simple_map.h.
+ *
+ * Usage notes:
+ *   - Requires POSIX threads (compile and link with -pthread).
+ *   - Lookups copy the element out under the shard lock (cmap_get), since a pointer into
+ *     a shard could be invalidated by a concurrent write as soon as the lock is released.
+ *   - free_func callbacks run while the shard is locked and must not use the same map.
+ *   - cmap_init and cmap_free must not race with other operations on the map.
+ *
+ * Public API macros:
+ *   - cmap_init(m, nshards):                  Allocates a map with nshards shards (rounded up to a power of two).
+ *   - cmap_shard_count(m):                    Gets the number of shards.
+ *   - cmap_count(m):                          Gets the number of elements (summed over the shards).
+ *   - cmap_put(m, item):                      Inserts or updates an element.
+ *   - cmap_put_free(m, item, free_func):      Inserts or updates an element, calling free_func on a replaced one.
+ *   - cmap_get(m, key, out):                  Copies the element with the given key to *out; returns non-zero if found.
+ *   - cmap_contains(m, key):                  Returns non-zero if an element with the given key exists.
+ *   - cmap_delete(m, key):                    Removes the element with the given key.
+ *   - cmap_delete_free(m, key, free_func):    Removes an element, calling free_func on it first.
+ *   - cmap_free(m):                           Frees the map.
+ *   - cmap_free_free(m, free_func):           Frees the map, calling free_func for each element.
+ */
+
+#ifndef SIMPLE_CONCURRENT_MAP_H
+#define SIMPLE_CONCURRENT_MAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <assert.h>
+#include <pthread.h>
+
+#include "simple_map.h"
+
+#ifndef CMAP_SHARDS_DEFAULT
+#define CMAP_SHARDS_DEFAULT 64
+#endif
+
+#define CMAP_MAGIC_NUMBER 0xc0c0a1e5
+
+/* A shard lock, padded to a cache line so that shards do not contend on it */
+typedef struct {
+    pthread_rwlock_t lock;
+} __attribute__((aligned(64))) cmap_lock;
+
+/* Hidden header stored immediately before the array of shard maps.
+ * Fields:
+ *   - locks:      nshards locks, allocated separately so that each gets its own cache line.
+ *   - locks_raw:  The allocation that locks was aligned within.
+ *   - nshards:    Number of shards (a power of two).
+ *   - shard_bits: log2(nshards); a key's shard is the top shard_bits bits of its hash.
+ */
+typedef struct {
+    cmap_lock *locks;
+    void *locks_raw;
+    size_t nshards;
+    unsigned shard_bits;
+#ifndef SIMPLE_DS_NO_MAGIC
+    uint32_t magic_number; // Used to assert that the header is valid
+#endif
+} cmap_header;
+
+/* Compute the header size, rounded up so that the shard pointers stay aligned */
+#define CMAP_HEADER_SIZE \
+    (((sizeof(cmap_header) + __alignof__(void *) - 1) / __alignof__(void *)) * __alignof__(void *))
+
+/* Given a map handle, CMAP_HEADER returns a pointer to its hidden header */
+#define CMAP_HEADER(m) ({                                                         \
+    cmap_header *hdr = ((cmap_header *)((char *)(m) - CMAP_HEADER_SIZE));         \
+    SIMPLE_DS_CHECK_MAGIC(hdr, CMAP_MAGIC_NUMBER);                                \
+    hdr;                                                                          \
+})
+
+#define cmap_shard_count(m) ((m) ? CMAP_HEADER(m)->nshards : 0)
+
+/* ------------------------------------------------------------------
+   Internal function: _cmap_alloc_impl
+   Allocates the header, nshards (rounded up to a power of two) empty
+   shard pointers and their locks. Returns the shard array, or NULL.
+------------------------------------------------------------------ */
+static inline void **_cmap_alloc_impl(size_t nshards) {
+    if (!nshards)
+        nshards = CMAP_SHARDS_DEFAULT;
+    unsigned bits = 0;
+    while (((size_t)1 << bits) < nshards)
+        bits++;
+    nshards = (size_t)1 << bits;
+    cmap_header *hdr = (cmap_header *)SIMPLE_DS_CALLOC(1, CMAP_HEADER_SIZE + nshards * sizeof(void *));
+    if (!hdr)
+        return NULL;
+    hdr->locks_raw = SIMPLE_DS_MALLOC(nshards * sizeof(cmap_lock) + __alignof__(cmap_lock) - 1);
+    if (!hdr->locks_raw) {
+        SIMPLE_DS_FREE(hdr);
+        return NULL;
+    }
+    uintptr_t aligned = ((uintptr_t)hdr->locks_raw + __alignof__(cmap_lock) - 1) &
+                        ~(uintptr_t)(__alignof__(cmap_lock) - 1);
+    hdr->locks = (cmap_lock *)aligned;
+    for (size_t i = 0; i < nshards; i++)
+        pthread_rwlock_init(&hdr->locks[i].lock, NULL);
+    hdr->nshards = nshards;
+    hdr->shard_bits = bits;
+    SIMPLE_DS_SET_MAGIC(hdr, CMAP_MAGIC_NUMBER);
+    return (void **)((char *)hdr + CMAP_HEADER_SIZE);
+}
+
+/* Returns the shard of a key with the given hash: its top shard_bits bits, whatever the
+   width of size_t */
+static inline size_t _cmap_shard(cmap_header *hdr, size_t hash) {
+    return hdr->shard_bits ? hash >> (sizeof(size_t) * CHAR_BIT - hdr->shard_bits) : 0;
+}
+
+/* ------------------------------------------------------------------
+   cmap_init(m, nshards)
+   Allocates an empty map with nshards shards (rounded up to a power of
+   two; 0 selects CMAP_SHARDS_DEFAULT) if (m) is NULL. m is declared as a
+   pointer to pointers to the element type.
+   Example:
+       Foo **table = NULL;
+       cmap_init(table, 64);
+------------------------------------------------------------------ */
+#define cmap_init(m, nshards)                                                     \
+    do {                                                                          \
+        if (!(m)) {                                                               \
+            (m) = (__typeof__(m))_cmap_alloc_impl((size_t)(nshards));             \
+        }                                                                         \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   cmap_put_free(m, item, free_func)
+   cmap_put(m, item)
+   Inserts (or updates) item in its shard while holding the shard's lock
+   exclusively. See map_put_free for the meaning of free_func. (m) must
+   have been initialized with cmap_init.
+   Example:
+       Foo item = { "apple", 10 };
+       cmap_put(table, item);
+------------------------------------------------------------------ */
+#define cmap_put_free(m, item, free_func)                                                                \
+    do {                                                                                                 \
+        __typeof__(m) _cp_m = (m);                                                                       \
+        __typeof__(item) _cp_item = (item);                                                              \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(_cp_item), __typeof__(**(m))),            \
+                       "item must be of the same type as **m");                                          \
+        MAP_CHECK_KEY_TYPE(*(m));                                                                        \
+        map_key_policy _cp_kp = MAP_KEY_POLICY(*(m));                                                    \
+        if (_map_field_is_zero(&_cp_item.key, _cp_kp.size)) {                                            \
+            break;                                                                                       \
+        }                                                                                                \
+        cmap_header *_cp_hdr = CMAP_HEADER(_cp_m);                                                       \
+        size_t _cp_hash = _map_hash_key(_map_field_key(&_cp_item.key, _cp_kp),                           \
+                                        _map_field_key_len(&_cp_item.key, _cp_kp), _cp_kp);              \
+        size_t _cp_shard = _cmap_shard(_cp_hdr, _cp_hash);                                               \
+        pthread_rwlock_wrlock(&_cp_hdr->locks[_cp_shard].lock);                                          \
+        map_put_free(_cp_m[_cp_shard], _cp_item, free_func);                                             \
+        pthread_rwlock_unlock(&_cp_hdr->locks[_cp_shard].lock);                                          \
+    } while (0)
+#define cmap_put(m, item) cmap_put_free(m, item, NULL)
+
+/* ------------------------------------------------------------------
+   Internal function: _cmap_get_impl
+   Looks up the key described by arg (of type MAP_KEY_ARG_TYPE) while
+   holding its shard's lock in shared mode, and copies the element to out
+   if out is non-NULL. The key is hashed once, for both the shard and the
+   shard's buckets. Returns non-zero if the key was found.
+------------------------------------------------------------------ */
+static inline int _cmap_get_impl(void **m, const void *arg, void *out, size_t elem_size, map_key_policy kp) {
+    const void *key = _map_arg_key(arg, kp);
+    if (!m || !key)
+        return 0;
+    cmap_header *hdr = CMAP_HEADER(m);
+    size_t len = _map_arg_key_len(arg, kp);
+    size_t hash = _map_hash_key(key, len, kp);
+    size_t shard = _cmap_shard(hdr, hash);
+    pthread_rwlock_rdlock(&hdr->locks[shard].lock);
+    void *elem = _map_lookup_impl(m[shard], key, len, hash, elem_size, kp);
+    if (elem && out)
+        memcpy(out, elem, elem_size);
+    pthread_rwlock_unlock(&hdr->locks[shard].lock);
+    return elem != NULL;
+}
+
+/* ------------------------------------------------------------------
+   cmap_get(m, key, out)
+   cmap_contains(m, key)
+   cmap_get copies the element with the given key to *out (out is a pointer
+   to the element type) and returns non-zero, or returns 0 if there is no
+   such element. cmap_contains only reports whether it exists. Keys are
+   passed as for map_get. Neither blocks other readers.
+   Example:
+       Foo item;
+       if (cmap_get(table, "apple", &item))
+           printf("%d\n", item.value);
+------------------------------------------------------------------ */
+#define cmap_get(m, key, out)                                                                       \
+    ({                                                                                              \
+        MAP_CHECK_KEY_TYPE(*(m));                                                                   \
+        MAP_CHECK_KEY_ARG(*(m), key, "key");                                                        \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(*(out)), __typeof__(**(m))),         \
+                       "out must point to the element type");                                       \
+        MAP_KEY_ARG_TYPE(*(m)) _cg_key = (key);                                                     \
+        _cmap_get_impl((void **)(m), &_cg_key, (out), sizeof(**(m)), MAP_KEY_POLICY(*(m)));         \
+    })
+
+#define cmap_contains(m, key)                                                                       \
+    ({                                                                                              \
+        MAP_CHECK_KEY_TYPE(*(m));                                                                   \
+        MAP_CHECK_KEY_ARG(*(m), key, "key");                                                        \
+        MAP_KEY_ARG_TYPE(*(m)) _cg_key = (key);                                                     \
+        _cmap_get_impl((void **)(m), &_cg_key, NULL, sizeof(**(m)), MAP_KEY_POLICY(*(m)));          \
+    })
+
+/* ------------------------------------------------------------------
+   cmap_delete_free(m, key, free_func)
+   cmap_delete(m, key)
+   Removes the element with the given key while holding its shard's lock
+   exclusively. See map_delete_free for the meaning of free_func.
+------------------------------------------------------------------ */
+#define cmap_delete_free(m, lookup_key, free_func)                                                  \
+    do {                                                                                            \
+        MAP_CHECK_KEY_TYPE(*(m));                                                                   \
+        MAP_CHECK_KEY_ARG(*(m), lookup_key, "lookup_key");                                          \
+        __typeof__(m) _cd_m = (m);                                                                  \
+        __typeof__((lookup_key) + 0) _cd_key = (lookup_key);                                        \
+        map_key_policy _cd_kp = MAP_KEY_POLICY(*(m));                                               \
+        MAP_KEY_ARG_TYPE(*(m)) _cd_arg = _cd_key;                                                   \
+        const void *_cd_bytes = _map_arg_key(&_cd_arg, _cd_kp);                                     \
+        if (_cd_m && _cd_bytes) {                                                                   \
+            cmap_header *_cd_hdr = CMAP_HEADER(_cd_m);                                              \
+            size_t _cd_shard = _cmap_shard(_cd_hdr, _map_hash_key(_cd_bytes,                        \
+                                           _map_arg_key_len(&_cd_arg, _cd_kp), _cd_kp));            \
+            pthread_rwlock_wrlock(&_cd_hdr->locks[_cd_shard].lock);                                 \
+            map_delete_free(_cd_m[_cd_shard], _cd_key, free_func);                                  \
+            pthread_rwlock_unlock(&_cd_hdr->locks[_cd_shard].lock);                                 \
+        }                                                                                           \
+    } while (0)
+#define cmap_delete(m, key) cmap_delete_free(m, key, NULL)
+
+/* Returns the number of elements, taking each shard's lock in shared mode in turn.
+   Concurrent writes to shards that were already counted are not reflected. */
+static inline size_t _cmap_count_impl(void **m) {
+    if (!m)
+        return 0;
+    cmap_header *hdr = CMAP_HEADER(m);
+    size_t count = 0;
+    for (size_t i = 0; i < hdr->nshards; i++) {
+        pthread_rwlock_rdlock(&hdr->locks[i].lock);
+        count += m[i] ? MAP_HEADER((char *)m[i])->count : 0;
+        pthread_rwlock_unlock(&hdr->locks[i].lock);
+    }
+    return count;
+}
+
+#define cmap_count(m) _cmap_count_impl((void **)(m))
+
+/* ------------------------------------------------------------------
+   cmap_free_free(m, free_func)
+   cmap_free(m)
+   Frees every shard (calling free_func on each element, see map_free_free),
+   destroys the locks and sets m to NULL. The map must not be in use by
+   other threads.
+------------------------------------------------------------------ */
+#define cmap_free_free(m, free_func)                                                  \
+    do {                                                                              \
+        __typeof__(m) _cf_m = (m);                                                    \
+        if (_cf_m) {                                                                  \
+            cmap_header *_cf_hdr = CMAP_HEADER(_cf_m);                                \
+            for (size_t _cf_i = 0; _cf_i < _cf_hdr->nshards; _cf_i++) {               \
+                map_free_free(_cf_m[_cf_i], free_func);                               \
+                pthread_rwlock_destroy(&_cf_hdr->locks[_cf_i].lock);                  \
+            }                                                                         \
+            SIMPLE_DS_FREE(_cf_hdr->locks_raw);                                       \
+            SIMPLE_DS_FREE(_cf_hdr);                                                  \
+            (m) = NULL;                                                               \
+        }                                                                             \
+    } while (0)
+#define cmap_free(m) cmap_free_free(m, NULL)
+
+#endif  /* SIMPLE_CONCURRENT_MAP_H */
@@ -0,0 +1,595 @@
+/*
+ * An insertion-ordered compact hash map (in the style of Python's dict) with a hidden header.
+ *
+ * The elements are stored densely, in insertion order, in an array that the user
+ * pointer points to. Lookups probe a separate index of small slots (a 32-bit entry
+ * position and 32 bits of the key's hash), so an empty index slot costs 8 bytes
+ * instead of a whole element, and iteration is a linear scan of the elements.
+ *
+ * The hidden dict header is stored immediately before the element array and includes:
+ *   - count:          Number of elements in the dict.
+ *   - end:            Number of entries in use, including holes left by deletes.
+ *   - capacity:       Total number of entries allocated.
+ *   - growth_factor:  Multiplier used to increase capacity when resizing.
+ *   - allocator:      Allocator used for the entries and the index (see dict_set_allocator).
+ *
+ * Default configuration:
+ *   - DICT_INIT_CAPACITY:          Initial number of entries.
+ *   - DICT_GROWTH_FACTOR_DEFAULT:  Default multiplier for entry array expansion.
+ *   - DICT_INDEX_LOAD_FACTOR:      Maximum ratio of elements to index slots before the
+ *                                  index is doubled.
+ *
+ * Usage notes:
+ *   - The element type must have a field named `key` as its first member. The same key
+ *     types as simple_map.h are supported (strings, 4- or 8-byte integers, byte arrays),
+ *     and keys are hashed with MAP_HASH_FUNCTION.
+ *   - Deleting an element leaves a hole (its key is reset to the sentinel). Holes are
+ *     skipped by dict_next and dict_foreach, and are squeezed out by dict_compact or when
+ *     the entry array would otherwise have to grow. Compaction keeps the insertion order
+ *     but moves elements, so pointers and positions are only stable until the next put.
+ *   - (d)[i] for i < dict_end(d) is the i-th entry in insertion order (or a hole).
+ *
+ * Public API macros:
+ *   - dict_count(d):                       Gets the number of elements in the dict.
+ *   - dict_end(d):                         Gets the number of entries, including holes.
+ *   - dict_capacity(d):                    Gets the number of entries allocated.
+ *   - dict_put(d, item):                   Inserts an element at the end, or updates it in place.
+ *   - dict_put_free(d, item, free_func):   Like dict_put, calling free_func on a replaced element.
+ *   - dict_get(d, key):                    Retrieves a pointer to an element with the given key.
+ *   - dict_delete(d, key):                 Removes the element with the given key.
+ *   - dict_delete_free(d, key, free_func): Removes an element, calling free_func on it first.
+ *   - dict_next(d, it):                    Gets the element after it in insertion order.
+ *   - dict_foreach(d, it):                 Loops over every element in insertion order.
+ *   - dict_compact(d):                     Squeezes out the holes left by deletes.
+ *   - dict_set_growth_factor(d, factor):   Sets the dict's growth factor.
+ *   - dict_set_allocator(d, allocator):    Binds the dict to a simple_allocator (see simple_alloc.h).
+ *   - dict_dup(d):                         Duplicates the dict.
+ *   - dict_free(d):                        Frees the dict.
+ *   - dict_free_free(d, free_func):        Frees the dict, calling free_func for each element.
+ */
+
+#ifndef SIMPLE_DICT_H
+#define SIMPLE_DICT_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "simple_alloc.h"
+#include "simple_map.h" /* key policies and hash functions */
+
+#ifndef DICT_INIT_CAPACITY
+#define DICT_INIT_CAPACITY 8
+#endif
+
+#ifndef DICT_GROWTH_FACTOR_DEFAULT
+#define DICT_GROWTH_FACTOR_DEFAULT 2.0
+#endif
+
+#ifndef DICT_INDEX_LOAD_FACTOR
+#define DICT_INDEX_LOAD_FACTOR 0.6667
+#endif
+
+#define DICT_MAGIC_NUMBER 0xd1c7ed1c
+
+/* An index slot. entry is the position of the element plus one, or 0 if the slot is empty. */
+typedef struct {
+    uint32_t entry;
+    uint32_t hash;
+} dict_slot;
+
+/* Hidden dict header stored immediately before the entry array.
+ * Fields:
+ *   - index:         index_cap slots (a power of two) probed linearly.
+ *   - count:         Number of live elements (also the number of full index slots).
+ *   - end:           Number of entries in use, including holes.
+ *   - capacity:      Number of entries allocated.
+ *   - growth_factor: Multiplier used for expanding capacity.
+ *   - allocator:     Allocator for the entries and the index (NULL for the SIMPLE_DS_* defaults).
+ */
+typedef struct {
+    dict_slot *index;
+    size_t index_cap;
+    size_t count;
+    size_t end;
+    size_t capacity;
+    double growth_factor;
+    const simple_allocator *allocator;
+#ifndef SIMPLE_DS_NO_MAGIC
+    uint32_t magic_number; // Used to assert that the header is valid
+#endif
+} dict_header;
+
+/* Compute the aligned header size for a dict, based on the alignment of the element type */
+#define DICT_HEADER_SIZE(d) \
+    (((sizeof(dict_header) + __alignof__(*(d)) - 1) / __alignof__(*(d))) * __alignof__(*(d)))
+
+/* Given a dict pointer, DICT_HEADER returns a pointer to its hidden header */
+#define DICT_HEADER(d) ({                                                         \
+    dict_header *hdr = ((dict_header *)((char *)(d) - DICT_HEADER_SIZE(d)));      \
+    SIMPLE_DS_CHECK_MAGIC(hdr, DICT_MAGIC_NUMBER);                                \
+    hdr;                                                                          \
+})
+
+/* Public macros to query dict properties */
+#define dict_count(d)    ((d) ? DICT_HEADER(d)->count : 0)
+#define dict_end(d)      ((d) ? DICT_HEADER(d)->end : 0)
+#define dict_capacity(d) ((d) ? DICT_HEADER(d)->capacity : 0)
+
+/* Reduces a key's hash to the 32 bits kept in its index slot */
+static inline uint32_t _dict_hash32(size_t hash) {
+    return (uint32_t)(((uint64_t)hash * 0x9e3779b97f4a7c15ull) >> 32);
+}
+
+/* Returns non-zero if the key field of an entry equals the len-byte key */
+static inline int _dict_key_equal(const void *field, const void *key, size_t len, map_key_policy kp) {
+    if (kp.kind == MAP_KEY_INT)
+        return _map_read_int_key(field, kp) == _map_read_int_key(key, kp);
+    if (kp.kind == MAP_KEY_BYTES)
+        return memcmp(field, key, kp.size) == 0;
+    const char *stored = *(const char *const *)field;
+    return strncmp(stored, (const char *)key, len) == 0 && stored[len] == '\0';
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_find_slot
+   Probes the index of d for the len-byte key with the given 32-bit hash.
+   Returns the slot holding it, or the empty slot where it would go.
+------------------------------------------------------------------ */
+static inline size_t _dict_find_slot(void *d, dict_header *hdr, const void *key, size_t len, uint32_t hash,
+                                     size_t elem_size, map_key_policy kp) {
+    size_t mask = hdr->index_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        dict_slot slot = hdr->index[i];
+        if (!slot.entry)
+            return i;
+        if (slot.hash == hash && _dict_key_equal((char *)d + (slot.entry - 1) * elem_size, key, len, kp))
+            return i;
+    }
+}
+
+/* Inserts a slot into an index with room for it (no key compare) */
+static inline void _dict_index_insert(dict_slot *index, size_t index_cap, dict_slot slot) {
+    size_t i = slot.hash & (index_cap - 1);
+    while (index[i].entry)
+        i = (i + 1) & (index_cap - 1);
+    index[i] = slot;
+}
+
+/* Replaces the index of hdr with one of new_cap slots. Returns 0 on allocation failure. */
+static inline int _dict_rebuild_index(dict_header *hdr, size_t new_cap) {
+    dict_slot *index = (dict_slot *)simple_ds_calloc(hdr->allocator, new_cap * sizeof(dict_slot));
+    if (!index)
+        return 0;
+    for (size_t i = 0; i < hdr->index_cap; i++) {
+        if (hdr->index[i].entry)
+            _dict_index_insert(index, new_cap, hdr->index[i]);
+    }
+    simple_ds_free(hdr->allocator, hdr->index, hdr->index_cap * sizeof(dict_slot));
+    hdr->index = index;
+    hdr->index_cap = new_cap;
+    return 1;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_compact_impl
+   Moves the live entries of d down over the holes, keeping their order,
+   and renumbers the index slots accordingly. Does nothing if there are no
+   holes (or if the temporary renumbering table cannot be allocated).
+------------------------------------------------------------------ */
+static inline void _dict_compact_impl(void *d, size_t elem_size, map_key_policy kp) {
+    if (!d)
+        return;
+    dict_header *hdr = DICT_HEADER((char *)d);
+    if (hdr->end == hdr->count)
+        return;
+    uint32_t *renumber = (uint32_t *)simple_ds_malloc(hdr->allocator, hdr->end * sizeof(uint32_t));
+    if (!renumber)
+        return;
+    size_t live = 0;
+    for (size_t i = 0; i < hdr->end; i++) {
+        char *entry = (char *)d + i * elem_size;
+        if (_map_field_is_zero(entry, kp.size))
+            continue;
+        if (live != i)
+            memcpy((char *)d + live * elem_size, entry, elem_size);
+        renumber[i] = (uint32_t)++live;
+    }
+    for (size_t i = 0; i < hdr->index_cap; i++) {
+        if (hdr->index[i].entry)
+            hdr->index[i].entry = renumber[hdr->index[i].entry - 1];
+    }
+    simple_ds_free(hdr->allocator, renumber, hdr->end * sizeof(uint32_t));
+    hdr->end = live;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_alloc_impl
+   Allocates an empty dict with room for cap entries from allocator.
+   Returns a pointer to the entry array, or NULL on failure.
+------------------------------------------------------------------ */
+static inline void *_dict_alloc_impl(size_t cap, size_t elem_size, size_t header_size,
+                                     const simple_allocator *allocator) {
+    size_t index_cap = 8;
+    while (index_cap * DICT_INDEX_LOAD_FACTOR < cap)
+        index_cap <<= 1;
+    dict_header *hdr = (dict_header *)simple_ds_malloc(allocator, header_size + cap * elem_size);
+    if (!hdr)
+        return NULL;
+    hdr->index = (dict_slot *)simple_ds_calloc(allocator, index_cap * sizeof(dict_slot));
+    if (!hdr->index) {
+        simple_ds_free(allocator, hdr, header_size + cap * elem_size);
+        return NULL;
+    }
+    hdr->index_cap = index_cap;
+    hdr->count = 0;
+    hdr->end = 0;
+    hdr->capacity = cap;
+    hdr->growth_factor = DICT_GROWTH_FACTOR_DEFAULT;
+    hdr->allocator = allocator;
+    SIMPLE_DS_SET_MAGIC(hdr, DICT_MAGIC_NUMBER);
+    return (char *)hdr + header_size;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_put_impl
+   Finds the entry for the len-byte key in d (allocating d if it is NULL).
+   If the key is new, a slot is added to the index and the entry at the
+   end of the array is reserved for it: the entry array is compacted if at
+   least half of it is holes, and grown otherwise. The index is doubled
+   when it would exceed DICT_INDEX_LOAD_FACTOR.
+   Stores the entry's position in *pos and whether the key already existed
+   in *found. Returns the (possibly moved) entry array, or NULL if memory
+   could not be allocated (d is then left unchanged).
+------------------------------------------------------------------ */
+static inline void *_dict_put_impl(void *d, const void *key, size_t len, size_t elem_size, size_t header_size,
+                                   map_key_policy kp, size_t *pos, int *found) {
+    if (!d && !(d = _dict_alloc_impl(DICT_INIT_CAPACITY, elem_size, header_size, NULL)))
+        return NULL;
+    dict_header *hdr = (dict_header *)((char *)d - header_size);
+    uint32_t hash = _dict_hash32(_map_hash_key(key, len, kp));
+    size_t i = _dict_find_slot(d, hdr, key, len, hash, elem_size, kp);
+    *found = hdr->index[i].entry != 0;
+    if (*found) {
+        *pos = hdr->index[i].entry - 1;
+        return d;
+    }
+    if (hdr->count + 1 > hdr->index_cap * DICT_INDEX_LOAD_FACTOR) {
+        if (!_dict_rebuild_index(hdr, hdr->index_cap * 2))
+            return NULL;
+        i = _dict_find_slot(d, hdr, key, len, hash, elem_size, kp);
+    }
+    size_t holes = hdr->end - hdr->count;
+    if (hdr->end == hdr->capacity && holes && holes * 2 >= hdr->end)
+        _dict_compact_impl(d, elem_size, kp);
+    if (hdr->end == hdr->capacity) {
+        size_t new_cap = (size_t)(hdr->capacity * hdr->growth_factor);
+        if (new_cap <= hdr->capacity)
+            new_cap = hdr->capacity + 1;
+        assert(new_cap <= UINT32_MAX);
+        dict_header *new_hdr = (dict_header *)simple_ds_realloc(hdr->allocator, hdr,
+                                                                header_size + hdr->capacity * elem_size,
+                                                                header_size + new_cap * elem_size);
+        if (!new_hdr)
+            return NULL;
+        hdr = new_hdr;
+        hdr->capacity = new_cap;
+        d = (char *)hdr + header_size;
+    }
+    hdr->index[i].entry = (uint32_t)(hdr->end + 1);
+    hdr->index[i].hash = hash;
+    *pos = hdr->end++;
+    hdr->count++;
+    return d;
+}
+
+/* ------------------------------------------------------------------
+   dict_put_free(d, item, free_func)
+   dict_put(d, item)
+   Inserts item after the last element, or replaces the element with the
+   same key in place (keeping its position in the insertion order).
+   - If (d) is NULL, a new dict is allocated with DICT_INIT_CAPACITY.
+   - The type of item must match the element type (i.e. *d).
+   - If an element with the same key exists and free_func is non-NULL, it
+     is called with the existing element before it is replaced. free_func
+     may be a function pointer or a block taking the element type.
+   - Items whose key is the empty sentinel (NULL, 0 or all zeros) are ignored.
+   Example:
+       Foo item = { "apple", 10 };
+       dict_put(fruits, item);
+------------------------------------------------------------------ */
+#define dict_put_free(d, item, free_func)                                                                   \
+    do {                                                                                                    \
+        __typeof__(d) _dp_d = (d);                                                                          \
+        __typeof__(item) _dp_item = (item);                                                                 \
+        void (^_dp_free_func)(__typeof__(_dp_d[0])) =                                                       \
+            _Generic((free_func),                                                                           \
+                void (*)(__typeof__(_dp_d[0])): (free_func),                                                \
+                void (^)(__typeof__(_dp_d[0])): (free_func),                                                \
+                default: ((void (^)(__typeof__(_dp_d[0])))0)                                                \
+            );                                                                                              \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(_dp_item), __typeof__(*((__typeof__(d))0))), \
+                       "item must be of the same type as *d");                                              \
+        MAP_CHECK_KEY_TYPE(d);                                                                              \
+        map_key_policy _dp_kp = MAP_KEY_POLICY(d);                                                          \
+        if (_map_field_is_zero(&_dp_item.key, _dp_kp.size)) {                                               \
+            break;                                                                                          \
+        }                                                                                                   \
+        size_t _dp_pos;                                                                                     \
+        int _dp_found;                                                                                      \
+        _dp_d = _dict_put_impl(_dp_d, _map_field_key(&_dp_item.key, _dp_kp),                                \
+                               _map_field_key_len(&_dp_item.key, _dp_kp), sizeof(*(_dp_d)),                 \
+                               DICT_HEADER_SIZE(_dp_d), _dp_kp, &_dp_pos, &_dp_found);                      \
+        if (_dp_d) {                                                                                        \
+            if (_dp_found && _dp_free_func) {                                                               \
+                _dp_free_func(_dp_d[_dp_pos]);                                                              \
+            }                                                                                               \
+            _dp_d[_dp_pos] = _dp_item;                                                                      \
+            (d) = _dp_d;                                                                                    \
+        }                                                                                                   \
+    } while (0)
+#define dict_put(d, item) dict_put_free(d, item, NULL)
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_get_impl
+   Returns the position of the element with the len-byte key in d, or
+   (size_t)-1 if there is none. If slot is non-NULL, the index slot that
+   refers to it is stored there.
+------------------------------------------------------------------ */
+static inline size_t _dict_get_impl(void *d, const void *key, size_t len, size_t elem_size, map_key_policy kp,
+                                    size_t *slot) {
+    if (!d || !key)
+        return (size_t)-1;
+    dict_header *hdr = DICT_HEADER((char *)d);
+    size_t i = _dict_find_slot(d, hdr, key, len, _dict_hash32(_map_hash_key(key, len, kp)), elem_size, kp);
+    if (!hdr->index[i].entry)
+        return (size_t)-1;
+    if (slot)
+        *slot = i;
+    return hdr->index[i].entry - 1;
+}
+
+/* Looks up an element by a key argument of type MAP_KEY_ARG_TYPE (see dict_get) */
+static inline void *_dict_get_arg(void *d, const void *arg, size_t elem_size, map_key_policy kp) {
+    const void *key = _map_arg_key(arg, kp);
+    if (!d || !key)
+        return NULL;
+    size_t pos = _dict_get_impl(d, key, _map_arg_key_len(arg, kp), elem_size, kp, NULL);
+    return pos == (size_t)-1 ? NULL : (char *)d + pos * elem_size;
+}
+
+/* ------------------------------------------------------------------
+   dict_get(d, key)
+   Retrieves a pointer to the element with the given key, or NULL if not
+   found. Keys are passed as for map_get.
+   Example:
+       Foo *item = dict_get(fruits, "apple");
+------------------------------------------------------------------ */
+#define dict_get(d, key)                                                                            \
+    ({                                                                                              \
+        MAP_CHECK_KEY_TYPE(d);                                                                      \
+        MAP_CHECK_KEY_ARG(d, key, "key");                                                           \
+        MAP_KEY_ARG_TYPE(d) _dg_key = (key);                                                        \
+        (__typeof__(d))_dict_get_arg((d), &_dg_key, sizeof(*(d)), MAP_KEY_POLICY(d));               \
+    })
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_delete_slot
+   Removes the element referred to by index slot i: its entry becomes a
+   hole, and the index slot is emptied by shifting the rest of its cluster
+   back (so the index never holds tombstones). Holes at the end of the
+   entry array are dropped.
+------------------------------------------------------------------ */
+static inline void _dict_delete_slot(void *d, size_t i, size_t elem_size, map_key_policy kp) {
+    dict_header *hdr = DICT_HEADER((char *)d);
+    size_t mask = hdr->index_cap - 1;
+    memset((char *)d + (hdr->index[i].entry - 1) * elem_size, 0, kp.size);
+    size_t hole = i;
+    for (size_t j = (i + 1) & mask; hdr->index[j].entry; j = (j + 1) & mask) {
+        if (_map_can_shift(hdr->index[j].hash & mask, hole, j)) {
+            hdr->index[hole] = hdr->index[j];
+            hole = j;
+        }
+    }
+    hdr->index[hole].entry = 0;
+    hdr->count--;
+    while (hdr->end && _map_field_is_zero((char *)d + (hdr->end - 1) * elem_size, kp.size))
+        hdr->end--;
+}
+
+/* ------------------------------------------------------------------
+   dict_delete_free(d, key, free_func)
+   dict_delete(d, key)
+   Removes the element with the given key, calling free_func (a function
+   pointer or block taking the element type, or NULL) on it first. The
+   other elements keep their positions.
+   Example:
+       dict_delete(fruits, "apple");
+------------------------------------------------------------------ */
+#define dict_delete_free(d, lookup_key, free_func)                                                        \
+    do {                                                                                                  \
+        MAP_CHECK_KEY_TYPE(d);                                                                            \
+        MAP_CHECK_KEY_ARG(d, lookup_key, "lookup_key");                                                   \
+        __typeof__(d) _dd_d = (d);                                                                        \
+        map_key_policy _dd_kp = MAP_KEY_POLICY(d);                                                        \
+        MAP_KEY_ARG_TYPE(d) _dd_arg = (lookup_key);                                                       \
+        const void *_dd_key = _map_arg_key(&_dd_arg, _dd_kp);                                             \
+        void (^_dd_free_func)(__typeof__(_dd_d[0])) =                                                     \
+            _Generic((free_func),                                                                         \
+                void (*)(__typeof__(_dd_d[0])): (free_func),                                              \
+                void (^)(__typeof__(_dd_d[0])): (free_func),                                              \
+                default: ((void (^)(__typeof__(_dd_d[0])))0)                                              \
+            );                                                                                            \
+        size_t _dd_slot;                                                                                  \
+        size_t _dd_pos = _dict_get_impl(_dd_d, _dd_key, _dd_key ? _map_arg_key_len(&_dd_arg, _dd_kp) : 0, \
+                                        sizeof(*(_dd_d)), _dd_kp, &_dd_slot);                             \
+        if (_dd_pos != (size_t)-1) {                                                                      \
+            if (_dd_free_func) {                                                                          \
+                _dd_free_func(_dd_d[_dd_pos]);                                                            \
+            }                                                                                             \
+            _dict_delete_slot(_dd_d, _dd_slot, sizeof(*(_dd_d)), _dd_kp);                                 \
+        }                                                                                                 \
+    } while (0)
+#define dict_delete(d, key) dict_delete_free(d, key, NULL)
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_next_impl
+   Returns the first element after it (or the first element of d if it
+   is NULL) in insertion order, skipping holes, or NULL if there is none.
+------------------------------------------------------------------ */
+static inline void *_dict_next_impl(void *d, const void *it, size_t elem_size, map_key_policy kp) {
+    if (!d)
+        return NULL;
+    size_t end = DICT_HEADER((char *)d)->end;
+    size_t i = it ? (size_t)((const char *)it - (char *)d) / elem_size + 1 : 0;
+    for (; i < end; i++) {
+        char *entry = (char *)d + i * elem_size;
+        if (!_map_field_is_zero(entry, kp.size))
+            return entry;
+    }
+    return NULL;
+}
+
+/* ------------------------------------------------------------------
+   dict_next(d, it)
+   dict_foreach(d, it)
+   dict_next returns the element after it in insertion order (the first
+   element if it is NULL), or NULL at the end. dict_foreach loops over every
+   element, declaring it as a pointer to the current one.
+   - Elements may be updated in place during iteration, and the current
+     element may be deleted; inserting may move the entries.
+   Example:
+       dict_foreach(fruits, it) {
+           printf("%s\n", it->key);
+       }
+------------------------------------------------------------------ */
+#define dict_next(d, it) ((__typeof__(d))_dict_next_impl((d), (it), sizeof(*(d)), MAP_KEY_POLICY(d)))
+#define dict_foreach(d, it) \
+    for (__typeof__(d) it = dict_next(d, NULL); it; it = dict_next(d, it))
+
+/* ------------------------------------------------------------------
+   dict_compact(d)
+   Squeezes out the holes left by deletes, keeping the insertion order.
+   Afterwards (d)[i] is the i-th element for every i < dict_count(d).
+------------------------------------------------------------------ */
+#define dict_compact(d) _dict_compact_impl((d), sizeof(*(d)), MAP_KEY_POLICY(d))
+
+/* Set the growth factor of the entry array. factor must be a double. */
+#define dict_set_growth_factor(d, factor)                                                                        \
+    do {                                                                                                         \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(factor), double), "factor must be double");       \
+        __typeof__(d) _dsg_d = (d);                                                                              \
+        if (_dsg_d) {                                                                                            \
+            DICT_HEADER(_dsg_d)->growth_factor = (factor);                                                       \
+        }                                                                                                        \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_set_allocator_impl
+   Moves the entries (up to end) and the index of d (which must not be
+   NULL) to new blocks from allocator. Returns the moved entry array, or d
+   if allocation fails.
+------------------------------------------------------------------ */
+static inline void *_dict_set_allocator_impl(void *d, size_t elem_size, size_t header_size,
+                                             const simple_allocator *allocator) {
+    dict_header *hdr = (dict_header *)((char *)d - header_size);
+    size_t size = header_size + hdr->capacity * elem_size;
+    dict_header *new_hdr = (dict_header *)simple_ds_malloc(allocator, size);
+    if (!new_hdr)
+        return d;
+    dict_slot *index = (dict_slot *)simple_ds_malloc(allocator, hdr->index_cap * sizeof(dict_slot));
+    if (!index) {
+        simple_ds_free(allocator, new_hdr, size);
+        return d;
+    }
+    memcpy(new_hdr, hdr, header_size + hdr->end * elem_size);
+    memcpy(index, hdr->index, hdr->index_cap * sizeof(dict_slot));
+    new_hdr->index = index;
+    new_hdr->allocator = allocator;
+    simple_ds_free(hdr->allocator, hdr->index, hdr->index_cap * sizeof(dict_slot));
+    simple_ds_free(hdr->allocator, hdr, size);
+    return (char *)new_hdr + header_size;
+}
+
+/* ------------------------------------------------------------------
+   dict_set_allocator(d, allocator)
+   Binds the dict to allocator (a const simple_allocator *, or NULL for
+   SIMPLE_DS_MALLOC and friends), which is then used for every later
+   allocation of the dict, including growth, dict_dup and dict_free.
+   - If (d) is NULL, an empty dict with DICT_INIT_CAPACITY is allocated from it.
+   - Otherwise, the entries and the index are moved to memory from allocator.
+   Example:
+       dict_set_allocator(fruits, simple_arena_allocator(&arena));
+------------------------------------------------------------------ */
+#define dict_set_allocator(d, alloc)                                                                     \
+    do {                                                                                                 \
+        const simple_allocator *_dsa_allocator = (alloc);                                                \
+        __typeof__(d) _dsa_d = (d);                                                                      \
+        if (!_dsa_d) {                                                                                   \
+            _dsa_d = _dict_alloc_impl(DICT_INIT_CAPACITY, sizeof(*(_dsa_d)), DICT_HEADER_SIZE(_dsa_d),   \
+                                      _dsa_allocator);                                                   \
+        } else {                                                                                         \
+            _dsa_d = _dict_set_allocator_impl(_dsa_d, sizeof(*(_dsa_d)), DICT_HEADER_SIZE(_dsa_d),       \
+                                              _dsa_allocator);                                           \
+        }                                                                                                \
+        (d) = _dsa_d;                                                                                    \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   Internal function: _dict_dup_impl
+   Copies the entries (up to end) and the index of d into new blocks from
+   the same allocator. Returns the new entry array, or NULL.
+------------------------------------------------------------------ */
+static inline void *_dict_dup_impl(void *d, size_t elem_size, size_t header_size) {
+    dict_header *hdr = (dict_header *)((char *)d - header_size);
+    dict_header *new_hdr = (dict_header *)simple_ds_malloc(hdr->allocator, header_size + hdr->capacity * elem_size);
+    if (!new_hdr)
+        return NULL;
+    *new_hdr = *hdr;
+    new_hdr->index = (dict_slot *)simple_ds_malloc(hdr->allocator, hdr->index_cap * sizeof(dict_slot));
+    if (!new_hdr->index) {
+        simple_ds_free(hdr->allocator, new_hdr, header_size + hdr->capacity * elem_size);
+        return NULL;
+    }
+    memcpy(new_hdr->index, hdr->index, hdr->index_cap * sizeof(dict_slot));
+    memcpy((char *)new_hdr + header_size, d, hdr->end * elem_size);
+    return (char *)new_hdr + header_size;
+}
+
+/* Duplicate the dict (shallow copy), or NULL if (d) is NULL or allocation fails */
+#define dict_dup(d) ((d) ? (__typeof__(d))_dict_dup_impl((d), sizeof(*(d)), DICT_HEADER_SIZE(d)) : NULL)
+
+/* ------------------------------------------------------------------
+   dict_free_free(d, free_func)
+   dict_free(d)
+   Frees the dict (entries and index) and sets d to NULL, calling free_func
+   (a function pointer or block taking the element type, or NULL) on every
+   element first, in insertion order.
+------------------------------------------------------------------ */
+#define dict_free_free(d, free_func)                                                           \
+    do {                                                                                       \
+        if (d) {                                                                               \
+            __typeof__(d) _dff_d = (d);                                                        \
+            void (^_dff_free_func)(__typeof__(_dff_d[0])) =                                    \
+                _Generic((free_func),                                                          \
+                    void (*)(__typeof__(_dff_d[0])): (free_func),                              \
+                    void (^)(__typeof__(_dff_d[0])): (free_func),                              \
+                    default: ((void (^)(__typeof__(_dff_d[0])))0)                              \
+                );                                                                             \
+            if (_dff_free_func) {                                                              \
+                dict_foreach(_dff_d, _dff_it) {                                                \
+                    _dff_free_func(*_dff_it);                                                  \
+                }                                                                              \
+            }                                                                                  \
+            dict_header *_dff_hdr = DICT_HEADER(_dff_d);                                       \
+            simple_ds_free(_dff_hdr->allocator, _dff_hdr->index,                               \
+                           _dff_hdr->index_cap * sizeof(dict_slot));                           \
+            simple_ds_free(_dff_hdr->allocator, _dff_hdr,                                      \
+                           DICT_HEADER_SIZE(_dff_d) + _dff_hdr->capacity * sizeof(*(_dff_d))); \
+            (d) = NULL;                                                                        \
+        }                                                                                      \
+    } while (0)
+#define dict_free(d) dict_free_free(d, NULL)
+
+#endif  /* SIMPLE_DICT_H */
@@ -4,33 +4,110 @@
  * The hidden map header is stored immediately before the user array and includes:
  *   - count:          Number of elements stored in the map.
  *   - capacity:       Total number of buckets.
+ *   - grow_threshold: Number of used buckets at which the map is resized (capacity * load_factor).
+ *   - shrink_factor:  Fraction of capacity below which deletes shrink the map (0 = never).
  *   - load_factor:    Maximum ratio of filled buckets to capacity before resizing.
  *   - growth_factor:  Multiplier used to increase capacity when resizing.
+ *   - allocator:      Allocator used for the map's memory (NULL for SIMPLE_DS_MALLOC and friends).
  *
  * Default configuration:
  *   - MAP_INIT_CAPACITY:          Initial number of buckets.
  *   - MAP_LOAD_FACTOR:            Default load factor threshold.
  *   - MAP_GROWTH_FACTOR_DEFAULT:  Default multiplier for map expansion.
+ *   - MAP_SHRINK_FACTOR_DEFAULT:  Default shrink factor (0.0, so maps never shrink on their own).
+ *   - MAP_HASH_FUNCTION:          Hash used for every key, called as (data, len, seed).
+ *                                 Defaults to a seeded word-at-a-time hash (_map_wyhash).
+ *   - MAP_HASH_SEED:              Seed passed to MAP_HASH_FUNCTION.
+ *   - MAP_BATCH_WIDTH:            Number of keys map_get_batch keeps in flight (default 16).
+ *
+ * Optional storage modes (define before including this header):
+ *   - MAP_CACHE_HASH:             Store each key's full hash in a parallel array after the
+ *                                 buckets. Probes compare hashes before calling strcmp, and
+ *                                 resizing and deletion reuse the stored hash instead of
+ *                                 rehashing the key.
+ *   - MAP_CONTROL_BYTES:          Keep a dense array of 1-byte control tags (7 bits of hash,
+ *                                 or an empty marker) after the buckets. Probes compare 16
+ *                                 tags at a time (SSE2/NEON when available) and only touch
+ *                                 buckets whose tag matches.
+ *   - MAP_POW2_CAPACITY:          Round every capacity up to a power of two and index buckets
+ *                                 with a mask instead of a modulo. Hashes are passed through
+ *                                 a finalizer first so the low bits are well distributed.
+ *   - MAP_STORE_KEY_LEN:          Store each key's length in a parallel array after the buckets.
+ *                                 Keys of a different length are rejected without touching
+ *                                 their bytes, equal-length keys are compared with memcmp, and
+ *                                 keys no longer need to be NUL-terminated (see map_put_n).
+ *   - MAP_TOMBSTONES:             Deletes mark the bucket as deleted in its control byte (this
+ *                                 enables MAP_CONTROL_BYTES) instead of shifting the cluster
+ *                                 back. Inserts reuse tombstones on their probe path, and the
+ *                                 next resize drops the rest; a map that is mostly tombstones
+ *                                 is rebuilt at the same capacity instead of growing.
+ *   - MAP_INCREMENTAL_RESIZE:     Resizing allocates the new bucket array but keeps the old one
+ *                                 alive; each later put, get or delete migrates the next
+ *                                 MAP_MIGRATE_BUCKETS old buckets, and lookups check the new array
+ *                                 and then the old one until the migration is complete.
+ *   - MAP_ROBIN_HOOD:             Robin Hood insertion. Each bucket's distance from its home is
+ *                                 stored after the buckets; an insert takes the place of the
+ *                                 first element closer to its home than the new one, lookups
+ *                                 stop as soon as the stored distances show the key is absent,
+ *                                 and deletes shift the rest of the run back without rehashing.
+ *   - MAP_OWN_KEYS:               The map copies each new string key into a key pool made of
+ *                                 MAP_KEY_POOL_CHUNK-byte chunks and stores a pointer to the copy,
+ *                                 so callers need not keep keys alive (or strdup them). The pool
+ *                                 is freed all at once with the map. A map_dup copy shares the
+ *                                 chunks holding the existing keys through reference counts, but
+ *                                 puts its new keys in chunks of its own. Elements passed to free_func
+ *                                 callbacks point into the pool: their keys must not be freed.
+ *                                 A deleted key's bytes stay in the pool until it is freed.
+ *   - MAP_INTERN_KEYS:            With MAP_OWN_KEYS, the pool also keeps an index of the strings
+ *                                 it holds, so a key that is inserted again after being deleted
+ *                                 (or into a map_dup copy, which starts with a copy of the index)
+ *                                 reuses its bytes.
+ *   - SIMPLE_MAP_STATS:           Keep counters of lookups, probed buckets, key comparisons,
+ *                                 resizes, bytes moved by resizes and the largest displacement
+ *                                 in the header (see map_stats). Without it they compile away.
  *
  * Usage notes:
- *   - The map’s element type must have a field named `key` (of type const char*)
- *     as its first member.
+ *   - The map’s element type must have a field named `key` as its first member.
+ *     The key may be a string (const char* or char*), a 4- or 8-byte integer or
+ *     pointer, or a fixed-width byte array such as uint8_t key[16]; the policy is
+ *     chosen at compile time from the field's type (see MAP_KEY_STRING).
  *
  * Public API macros:
  *   - map_count(tbl):                      Gets the number of elements in the map.
  *   - map_capacity(tbl):                   Gets the capacity of the map.
  *   - map_load_factor(tbl):                Gets the load factor of the map.
  *   - map_growth_factor(tbl):              Gets the growth factor of the map.
- *   - map_put(tbl, item):                  Inserts or updates an element.
+ *   - map_shrink_factor(tbl):              Gets the shrink factor of the map.
+ *   - map_put(tbl, item):                  Inserts or updates an element and returns a pointer to it.
  *   - map_put_free(tbl, item, free_func):  Inserts or updates an element, calling free_func if an item already exists.
+ *   - map_put_many(tbl, items, n):         Inserts or updates n elements, resizing at most once.
+ *   - map_put_n(tbl, item, len):           Inserts or updates an element whose key is len bytes long
+ *                                          (requires MAP_STORE_KEY_LEN).
  *   - map_get(tbl, key):                   Retrieves a pointer to an element with the given key.
+ *   - map_get_or_insert(tbl, key, inserted): Retrieves a pointer to an element, inserting a zeroed one
+ *                                          with that key if needed, with a single probe.
+ *   - map_get_n(tbl, key, len):            Retrieves an element by a len-byte key (need not be NUL-terminated).
+ *   - map_get_batch(tbl, keys, n, out):    Looks up n keys at once, prefetching their buckets.
  *   - map_delete(tbl, key):                Removes the element with the given key.
+ *   - map_delete_n(tbl, key, len):         Removes the element with the given len-byte key.
  *   - map_set_min_capacity(tbl, min_cap):  Ensures a minimum map capacity.
  *   - map_set_growth_factor(tbl, factor):  Sets the map's growth factor.
  *   - map_set_load_factor(tbl, factor):    Sets the map's load factor.
+ *   - map_set_shrink_factor(tbl, factor):  Makes deletes shrink the map below factor * capacity elements.
+ *   - map_shrink_to_fit(tbl):              Shrinks the map to the smallest capacity that holds its elements.
+ *   - map_max_probe_length(tbl):           Gets the largest distance of an element from its home bucket.
+ *   - map_stats(tbl):                      Gets a map_stats_report with the counters and cluster statistics.
+ *   - map_probe_histogram(tbl, hist, n):   Counts the elements at each distance from their home bucket.
+ *   - map_cluster_histogram(tbl, hist, n): Counts the runs of used buckets of each length.
+ *   - map_stats_reset(tbl):                Zeroes the SIMPLE_MAP_STATS counters.
+ *   - map_set_allocator(tbl, allocator):   Binds the map to a simple_allocator (see simple_alloc.h).
+ *   - map_next(tbl, it):                   Gets the element after it (or the first if it is NULL).
+ *   - map_foreach(tbl, it):                Loops over every element, with it pointing at each one.
  *   - map_dup(tbl):                        Duplicates the map.
  *   - map_free(tbl):                       Frees the map.
  *   - map_free_free(tbl):                  Frees the map, calling free_func for each item that exists.
+ *   - SIMPLE_MAP_DEFINE(name, T):          Defines name_get, name_put, name_delete and friends as
+ *                                          functions specialized for element type T.
  */
 
 #ifndef SIMPLE_MAP_H
@@ -39,8 +116,24 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stddef.h>
 #include <assert.h>
 
+#include "simple_alloc.h"
+
+/* Tombstones are recorded in the control bytes */
+#if defined(MAP_TOMBSTONES) && !defined(MAP_CONTROL_BYTES)
+#define MAP_CONTROL_BYTES
+#endif
+
+#if defined(MAP_INTERN_KEYS) && !defined(MAP_OWN_KEYS)
+#define MAP_OWN_KEYS
+#endif
+
+#if defined(MAP_TOMBSTONES) && defined(MAP_ROBIN_HOOD)
+#error "MAP_TOMBSTONES cannot be combined with MAP_ROBIN_HOOD"
+#endif
+
 /* Configuration: initial capacity, load factor, and growth factor */
 #ifndef MAP_INIT_CAPACITY
 #define MAP_INIT_CAPACITY 16
@@ -54,21 +147,100 @@
 #define MAP_GROWTH_FACTOR_DEFAULT 2.0
 #endif
 
+/* Shrink factors are capped at load_factor / (2 * growth_factor): a map that shrinks is
+   left load_factor / growth_factor full, so it has to lose half its elements again before
+   shrinking again */
+#ifndef MAP_SHRINK_FACTOR_DEFAULT
+#define MAP_SHRINK_FACTOR_DEFAULT 0.0
+#endif
+
+/* Number of old buckets migrated by each put, get or delete (MAP_INCREMENTAL_RESIZE) */
+#ifndef MAP_MIGRATE_BUCKETS
+#define MAP_MIGRATE_BUCKETS 64
+#endif
+
+/* Number of keys map_get_batch hashes and prefetches before resolving their probes */
+#ifndef MAP_BATCH_WIDTH
+#define MAP_BATCH_WIDTH 16
+#endif
+
+/* Size of each chunk of the key pool (MAP_OWN_KEYS); longer keys get a chunk of their own */
+#ifndef MAP_KEY_POOL_CHUNK
+#define MAP_KEY_POOL_CHUNK 4096
+#endif
+
 #define MAP_MAGIC_NUMBER 0xbd5e1df
 
+struct map_key_pool;
+
+/* Counters kept in the header of every map when SIMPLE_MAP_STATS is defined (see map_stats).
+ * Fields:
+ *   - lookups:          Probe sequences run by puts, gets and deletes.
+ *   - probes:           Buckets visited by them (with MAP_CONTROL_BYTES, groups of
+ *     MAP_GROUP_WIDTH control bytes).
+ *   - key_compares:     Stored keys compared with the probed key (for string keys, a
+ *     mismatching cached hash or length rejects most of them before strcmp or memcmp).
+ *   - resizes:          Bucket arrays allocated to grow, shrink or rebuild the map.
+ *   - resize_bytes:     Bytes of elements that those resizes moved to the new bucket array.
+ *   - max_displacement: Largest distance from its home bucket at which an element was stored.
+ */
+typedef struct {
+    size_t lookups;
+    size_t probes;
+    size_t key_compares;
+    size_t resizes;
+    size_t resize_bytes;
+    size_t max_displacement;
+} map_stats_counters;
+
 /* Hidden map header stored immediately before the user array.
+ * The fields read by every put come first.
  * Fields:
- *   - count:         Number of elements stored.
- *   - capacity:      Total number of buckets.
- *   - load_factor:   Load factor threshold for resizing.
- *   - growth_factor: Multiplier used for expanding capacity.
+ *   - count:          Number of elements stored.
+ *   - capacity:       Total number of buckets.
+ *   - grow_threshold: Number of used buckets at which a put resizes the map, i.e.
+ *     capacity * load_factor (recomputed whenever either of them changes).
+ *   - shrink_threshold: Element count below which a delete shrinks the map, i.e.
+ *     capacity * shrink_factor (0 when shrinking is off).
+ *   - allocator:      Allocator for every block of the map (NULL for the SIMPLE_DS_* defaults).
+ *   - deleted:        Number of tombstones (MAP_TOMBSTONES only).
+ *   - load_factor:    Load factor threshold for resizing.
+ *   - growth_factor:  Multiplier used for expanding capacity.
+ *   - shrink_factor:  Fraction of capacity below which deletes shrink the map.
+ *   - old, old_hdr, old_gone, migrate_pos: The bucket array being migrated into this
+ *     one, its header, a bitmap of its buckets that were migrated or deleted, and the
+ *     next bucket to migrate (MAP_INCREMENTAL_RESIZE only; old is NULL when idle).
+ *   - key_pool:      Storage for the map's string keys (MAP_OWN_KEYS only; NULL until the
+ *     first one is stored). Each map_dup copy gets its own, sharing the existing chunks.
+ *   - stats:         Operation counters (SIMPLE_MAP_STATS only).
  */
 typedef struct {
-    double load_factor;
-    double growth_factor;
     size_t count;
     size_t capacity;
+    size_t grow_threshold;
+    size_t shrink_threshold;
+    const simple_allocator *allocator;
+#ifdef MAP_TOMBSTONES
+    size_t deleted;
+#endif
+    double load_factor;
+    double growth_factor;
+    double shrink_factor;
+#ifdef MAP_INCREMENTAL_RESIZE
+    char *old;
+    void *old_hdr;
+    uint8_t *old_gone;
+    size_t migrate_pos;
+#endif
+#ifdef MAP_OWN_KEYS
+    struct map_key_pool *key_pool;
+#endif
+#ifdef SIMPLE_MAP_STATS
+    map_stats_counters stats;
+#endif
+#ifndef SIMPLE_DS_NO_MAGIC
     uint32_t magic_number; // Used to assert that the header is valid
+#endif
 } map_header;
 
 /* Compute the aligned header size for a map, based on the alignment of the element type */
@@ -80,108 +252,1480 @@ typedef struct {
  */
 #define MAP_HEADER(tbl) ({                                                        \
     map_header *hdr = ((map_header *)((char *)(tbl) - MAP_HEADER_SIZE(tbl)));     \
-    assert(hdr->magic_number == MAP_MAGIC_NUMBER);                                \
+    SIMPLE_DS_CHECK_MAGIC(hdr, MAP_MAGIC_NUMBER);                                 \
     hdr;                                                                          \
 })
 
-/* Public macros to query map properties */
-#define map_count(tbl)         ((tbl) ? MAP_HEADER(tbl)->count : 0)
-#define map_capacity(tbl)      ((tbl) ? MAP_HEADER(tbl)->capacity : 0)
-#define map_load_factor(tbl)   ((tbl) ? MAP_HEADER(tbl)->load_factor : MAP_LOAD_FACTOR)
-#define map_growth_factor(tbl) ((tbl) ? MAP_HEADER(tbl)->growth_factor : MAP_GROWTH_FACTOR_DEFAULT)
+/* Recomputes grow_threshold and shrink_threshold after the capacity, load factor,
+   growth factor or shrink factor of hdr has changed, capping the shrink factor at
+   load_factor / (2 * growth_factor) (see MAP_SHRINK_FACTOR_DEFAULT) */
+static inline void _map_update_threshold(map_header *hdr) {
+    double max_shrink = hdr->load_factor / (2 * hdr->growth_factor);
+    if (hdr->shrink_factor > max_shrink)
+        hdr->shrink_factor = max_shrink;
+    hdr->grow_threshold = (size_t)(hdr->capacity * hdr->load_factor);
+    hdr->shrink_threshold = (size_t)(hdr->capacity * hdr->shrink_factor);
+}
+
+/* Statistics hooks: MAP_STAT_ADD adds n to a counter of hdr, and MAP_STAT_MAX raises it
+   to v. Both compile to nothing (without evaluating their arguments) unless
+   SIMPLE_MAP_STATS is defined. The counters use relaxed atomic loads and stores rather
+   than read-modify-write instructions, so lock-free readers (simple_rcu_map.h) and the
+   threads of simple_parallel_map.h do not race on them, but may lose some updates. */
+#ifdef SIMPLE_MAP_STATS
+#define MAP_STAT_ADD(hdr, field, n)                                                                     \
+    __atomic_store_n(&(hdr)->stats.field, __atomic_load_n(&(hdr)->stats.field, __ATOMIC_RELAXED) + (n), \
+                     __ATOMIC_RELAXED)
+#define MAP_STAT_MAX(hdr, field, v)                                                                  \
+    do {                                                                                             \
+        size_t _st_v = (v);                                                                          \
+        if (_st_v > __atomic_load_n(&(hdr)->stats.field, __ATOMIC_RELAXED))                          \
+            __atomic_store_n(&(hdr)->stats.field, _st_v, __ATOMIC_RELAXED);                          \
+    } while (0)
+#else
+#define MAP_STAT_ADD(hdr, field, n) ((void)0)
+#define MAP_STAT_MAX(hdr, field, v) ((void)0)
+#endif
+
+/* Copies the header src to dst, reading the SIMPLE_MAP_STATS counters (which readers
+   may be updating) with relaxed atomic loads */
+static inline void _map_copy_header(map_header *dst, const map_header *src) {
+#ifdef SIMPLE_MAP_STATS
+    size_t stats = offsetof(map_header, stats), stats_end = stats + sizeof(map_stats_counters);
+    memcpy(dst, src, stats);
+    memcpy((char *)dst + stats_end, (const char *)src + stats_end, sizeof(map_header) - stats_end);
+    const size_t *from = (const size_t *)&src->stats;
+    size_t *to = (size_t *)&dst->stats;
+    for (size_t i = 0; i < sizeof(map_stats_counters) / sizeof(size_t); i++)
+        to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+#else
+    *dst = *src;
+#endif
+}
+
+/* Public macros to query map properties */
+#define map_count(tbl)         ((tbl) ? MAP_HEADER(tbl)->count : 0)
+#define map_capacity(tbl)      ((tbl) ? MAP_HEADER(tbl)->capacity : 0)
+#define map_load_factor(tbl)   ((tbl) ? MAP_HEADER(tbl)->load_factor : MAP_LOAD_FACTOR)
+#define map_growth_factor(tbl) ((tbl) ? MAP_HEADER(tbl)->growth_factor : MAP_GROWTH_FACTOR_DEFAULT)
+#define map_shrink_factor(tbl) ((tbl) ? MAP_HEADER(tbl)->shrink_factor : MAP_SHRINK_FACTOR_DEFAULT)
+
+/* Key policies, selected at compile time from the type of the element's key field:
+ *   - MAP_KEY_STRING: char * or const char *. Hashed with MAP_HASH_FUNCTION and compared
+ *                     as strings. The empty-bucket sentinel is NULL.
+ *   - MAP_KEY_INT:    4- or 8-byte integer (or pointer) compared by value with a single
+ *                     integer compare and hashed with a multiply. The sentinel is 0.
+ *   - MAP_KEY_BYTES:  Fixed-width byte array (e.g. uint8_t key[16] for a UUID), hashed with
+ *                     MAP_HASH_FUNCTION and compared with memcmp. The sentinel is all zeros.
+ * Keys equal to the sentinel cannot be stored.
+ */
+#define MAP_KEY_STRING 0
+#define MAP_KEY_INT    1
+#define MAP_KEY_BYTES  2
+
+typedef struct {
+    int kind;    /* MAP_KEY_STRING, MAP_KEY_INT or MAP_KEY_BYTES */
+    size_t size; /* sizeof the key field */
+} map_key_policy;
+
+/* The key field of the element type of tbl (only for use in unevaluated contexts) */
+#define MAP_KEY_FIELD(tbl) (((__typeof__(tbl))0)->key)
+
+/* __builtin_classify_type result for pointers (arrays decay to pointers) */
+#define _MAP_POINTER_TYPE_CLASS 5
+
+#define MAP_KEY_KIND(tbl)                                                                                \
+    ((__builtin_types_compatible_p(__typeof__(MAP_KEY_FIELD(tbl)), char *) ||                            \
+      __builtin_types_compatible_p(__typeof__(MAP_KEY_FIELD(tbl)), const char *)) ? MAP_KEY_STRING :     \
+     (__builtin_classify_type(MAP_KEY_FIELD(tbl)) == _MAP_POINTER_TYPE_CLASS &&                          \
+      !__builtin_types_compatible_p(__typeof__(MAP_KEY_FIELD(tbl)), __typeof__(MAP_KEY_FIELD(tbl) + 0))) \
+         ? MAP_KEY_BYTES : MAP_KEY_INT)
+
+#define MAP_KEY_POLICY(tbl) ((map_key_policy){ MAP_KEY_KIND(tbl), sizeof(MAP_KEY_FIELD(tbl)) })
+
+/* Statically checks that the key field of tbl's element type is supported */
+#define MAP_CHECK_KEY_TYPE(tbl)                                                                  \
+    _Static_assert(MAP_KEY_KIND(tbl) != MAP_KEY_INT ||                                           \
+                   sizeof(MAP_KEY_FIELD(tbl)) == 4 || sizeof(MAP_KEY_FIELD(tbl)) == 8,           \
+                   "key must be a char*, const char*, 4- or 8-byte integer, or byte array")
+
+/* Type of a lookup key argument: the key type itself for integer keys, or a pointer
+   to the key bytes for strings and byte arrays */
+#define MAP_KEY_ARG_TYPE(tbl) \
+    __typeof__(__builtin_choose_expr(MAP_KEY_KIND(tbl) == MAP_KEY_INT, MAP_KEY_FIELD(tbl) + 0, (const void *)0))
+
+#ifndef MAP_HASH_SEED
+#define MAP_HASH_SEED 0x5bd1e9955bd1e995ull
+#endif
+
+/* 64x64 -> 128-bit multiply; the low half is returned in *a and the high half in *b */
+static inline void _map_wymum(uint64_t *a, uint64_t *b) {
+#ifdef __SIZEOF_INT128__
+    __uint128_t r = (__uint128_t)*a * *b;
+    *a = (uint64_t)r;
+    *b = (uint64_t)(r >> 64);
+#else
+    uint64_t ha = *a >> 32, hb = *b >> 32, la = (uint32_t)*a, lb = (uint32_t)*b;
+    uint64_t rh = ha * hb, rm0 = ha * lb, rm1 = hb * la, rl = la * lb;
+    uint64_t t = rl + (rm0 << 32), c = t < rl;
+    uint64_t lo = t + (rm1 << 32);
+    c += lo < t;
+    *a = lo;
+    *b = rh + (rm0 >> 32) + (rm1 >> 32) + c;
+#endif
+}
+
+static inline uint64_t _map_wymix(uint64_t a, uint64_t b) {
+    _map_wymum(&a, &b);
+    return a ^ b;
+}
+
+static inline uint64_t _map_read8(const uint8_t *p) { uint64_t v; memcpy(&v, p, 8); return v; }
+static inline uint64_t _map_read4(const uint8_t *p) { uint32_t v; memcpy(&v, p, 4); return v; }
+
+/* ------------------------------------------------------------------
+   Internal function: _map_wyhash
+   Seeded word-at-a-time hash based on wyhash (Wang Yi, public domain).
+   Keys up to 16 bytes are read with at most four overlapping loads;
+   longer keys are consumed 16 bytes (or 48 bytes, on three independent
+   lanes) per iteration.
+------------------------------------------------------------------ */
+static inline size_t _map_wyhash(const void *data, size_t len, uint64_t seed) {
+    static const uint64_t secret[4] = { 0x2d358dccaa6c78a5ull, 0x8bb84b93962eacc9ull,
+                                        0x4b33a62ed433d4a3ull, 0x4d5a2da51de1aa47ull };
+    const uint8_t *p = (const uint8_t *)data;
+    uint64_t a, b;
+    seed ^= _map_wymix(seed ^ secret[0], secret[1]);
+    if (len <= 16) {
+        if (len >= 4) {
+            a = (_map_read4(p) << 32) | _map_read4(p + ((len >> 3) << 2));
+            b = (_map_read4(p + len - 4) << 32) | _map_read4(p + len - 4 - ((len >> 3) << 2));
+        } else if (len > 0) {
+            a = ((uint64_t)p[0] << 16) | ((uint64_t)p[len >> 1] << 8) | p[len - 1];
+            b = 0;
+        } else {
+            a = b = 0;
+        }
+    } else {
+        size_t i = len;
+        if (i >= 48) {
+            uint64_t see1 = seed, see2 = seed;
+            do {
+                seed = _map_wymix(_map_read8(p) ^ secret[1], _map_read8(p + 8) ^ seed);
+                see1 = _map_wymix(_map_read8(p + 16) ^ secret[2], _map_read8(p + 24) ^ see1);
+                see2 = _map_wymix(_map_read8(p + 32) ^ secret[3], _map_read8(p + 40) ^ see2);
+                p += 48;
+                i -= 48;
+            } while (i >= 48);
+            seed ^= see1 ^ see2;
+        }
+        while (i > 16) {
+            seed = _map_wymix(_map_read8(p) ^ secret[1], _map_read8(p + 8) ^ seed);
+            i -= 16;
+            p += 16;
+        }
+        a = _map_read8(p + i - 16);
+        b = _map_read8(p + i - 8);
+    }
+    a ^= secret[1];
+    b ^= seed;
+    _map_wymum(&a, &b);
+    return (size_t)_map_wymix(a ^ secret[0] ^ len, b ^ secret[1]);
+}
+
+/* Hash function used for every key. It is called as MAP_HASH_FUNCTION(data, len, seed)
+   with a pointer to the key bytes, their length and MAP_HASH_SEED, and must return a size_t. */
+#ifndef MAP_HASH_FUNCTION
+#define MAP_HASH_FUNCTION(data, len, seed) _map_wyhash((data), (len), (seed))
+#endif
+
+/* Multiply-based hash for integer keys */
+static inline size_t _map_hash_int(uint64_t key) {
+    return (size_t)_map_wymix(key ^ (uint64_t)MAP_HASH_SEED, 0x9e3779b97f4a7c15ull);
+}
+
+/* Reads an integer key of kp.size bytes */
+static inline uint64_t _map_read_int_key(const void *key, map_key_policy kp) {
+    if (kp.size == sizeof(uint32_t)) {
+        uint32_t v;
+        memcpy(&v, key, sizeof(v));
+        return v;
+    }
+    uint64_t v;
+    memcpy(&v, key, sizeof(v));
+    return v;
+}
+
+/* Hashes a len-byte key according to its key policy */
+static inline size_t _map_hash_key(const void *key, size_t len, map_key_policy kp) {
+    if (kp.kind == MAP_KEY_INT)
+        return _map_hash_int(_map_read_int_key(key, kp));
+    return (size_t)MAP_HASH_FUNCTION(key, len, (uint64_t)MAP_HASH_SEED);
+}
+
+#ifdef MAP_POW2_CAPACITY
+/* Finalizer (from MurmurHash3) that spreads entropy into the low bits used for indexing */
+static inline size_t _map_mix_hash(size_t hash) {
+    uint64_t h = (uint64_t)hash;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return (size_t)h;
+}
+#endif
+
+/* Rounds a requested capacity up to one the map can use */
+static inline size_t _map_round_capacity(size_t cap) {
+#ifdef MAP_POW2_CAPACITY
+    size_t pow2 = 1;
+    while (pow2 < cap)
+        pow2 <<= 1;
+    return pow2;
+#else
+    return cap ? cap : 1;
+#endif
+}
+
+/* Wraps a bucket index that may have run past the end of the bucket array */
+static inline size_t _map_wrap(size_t idx, size_t cap) {
+#ifdef MAP_POW2_CAPACITY
+    return idx & (cap - 1);
+#else
+    return idx >= cap ? idx % cap : idx;
+#endif
+}
+
+/* Returns the home bucket of a key with the given hash */
+static inline size_t _map_home(size_t hash, size_t cap) {
+#ifdef MAP_POW2_CAPACITY
+    return _map_mix_hash(hash) & (cap - 1);
+#else
+    return hash % cap;
+#endif
+}
+
+/* Returns the bucket after idx in probe order */
+static inline size_t _map_next(size_t idx, size_t cap) {
+#ifdef MAP_POW2_CAPACITY
+    return (idx + 1) & (cap - 1);
+#else
+    return idx + 1 == cap ? 0 : idx + 1;
+#endif
+}
+
+#ifdef MAP_CONTROL_BYTES
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+#include <arm_neon.h>
+#endif
+
+/* Number of control bytes examined per probe step */
+#define MAP_GROUP_WIDTH 16
+
+/* Control byte values. Full buckets store 7 bits of their key's hash (0x00-0x7f). */
+#define MAP_CTRL_EMPTY   ((uint8_t)0x80)
+#define MAP_CTRL_DELETED ((uint8_t)0xfe)
+
+/* Returns the 7-bit tag stored in the control byte of a full bucket */
+static inline uint8_t _map_tag(size_t hash) {
+    return (uint8_t)(((uint64_t)hash * 0x9e3779b97f4a7c15ull) >> 57);
+}
+
+/* Returns a bit mask with bit i set if group[i] == value, for the MAP_GROUP_WIDTH bytes at group */
+static inline uint32_t _map_group_match(const uint8_t *group, uint8_t value) {
+#if defined(__SSE2__)
+    __m128i g = _mm_loadu_si128((const __m128i *)group);
+    return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(g, _mm_set1_epi8((char)value)));
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t lane_bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t eq = vandq_u8(vceqq_u8(vld1q_u8(group), vdupq_n_u8(value)), vld1q_u8(lane_bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(eq)) | ((uint32_t)vaddv_u8(vget_high_u8(eq)) << 8);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP_WIDTH; i++)
+        mask |= (uint32_t)(group[i] == value) << i;
+    return mask;
+#endif
+}
+
+/* Returns a bit mask with bit i set if group[i] is a full bucket's tag (high bit clear) */
+static inline uint32_t _map_group_full(const uint8_t *group) {
+#if defined(__SSE2__)
+    return ~(uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i *)group)) & 0xffffu;
+#elif defined(__ARM_NEON) && defined(__aarch64__)
+    static const uint8_t lane_bits[16] = { 1, 2, 4, 8, 16, 32, 64, 128, 1, 2, 4, 8, 16, 32, 64, 128 };
+    uint8x16_t full = vandq_u8(vcltq_u8(vld1q_u8(group), vdupq_n_u8(0x80)), vld1q_u8(lane_bits));
+    return (uint32_t)vaddv_u8(vget_low_u8(full)) | ((uint32_t)vaddv_u8(vget_high_u8(full)) << 8);
+#else
+    uint32_t mask = 0;
+    for (int i = 0; i < MAP_GROUP_WIDTH; i++)
+        mask |= (uint32_t)!(group[i] & 0x80) << i;
+    return mask;
+#endif
+}
+#endif
+
+/* Byte offset from the start of the bucket array to the per-bucket metadata.
+ * The metadata follows the buckets in this order: cached hashes (MAP_CACHE_HASH),
+ * key lengths (MAP_STORE_KEY_LEN), probe distances (MAP_ROBIN_HOOD), and either the
+ * control bytes (MAP_CONTROL_BYTES) or an occupancy bitmap with one bit per bucket.
+ */
+static inline size_t _map_meta_offset(size_t cap, size_t elem_size) {
+    return ((cap * elem_size + sizeof(size_t) - 1) / sizeof(size_t)) * sizeof(size_t);
+}
+
+/* Byte offset from the start of the bucket array to the stored key lengths */
+static inline size_t _map_lens_offset(size_t cap, size_t elem_size) {
+#ifdef MAP_CACHE_HASH
+    return _map_meta_offset(cap, elem_size) + cap * sizeof(size_t);
+#else
+    return _map_meta_offset(cap, elem_size);
+#endif
+}
+
+/* Byte offset from the start of the bucket array to the probe distances */
+static inline size_t _map_dists_offset(size_t cap, size_t elem_size) {
+#ifdef MAP_STORE_KEY_LEN
+    return _map_lens_offset(cap, elem_size) + cap * sizeof(size_t);
+#else
+    return _map_lens_offset(cap, elem_size);
+#endif
+}
+
+/* Byte offset from the start of the bucket array to the control bytes */
+static inline size_t _map_ctrl_offset(size_t cap, size_t elem_size) {
+#ifdef MAP_ROBIN_HOOD
+    return _map_dists_offset(cap, elem_size) + cap * sizeof(uint32_t);
+#else
+    return _map_dists_offset(cap, elem_size);
+#endif
+}
+
+#ifndef MAP_CONTROL_BYTES
+/* Byte offset from the start of the bucket array to the occupancy bitmap, which takes
+ * the place of the control bytes so that iteration can skip 64 empty buckets at a time
+ */
+static inline size_t _map_occupancy_offset(size_t cap, size_t elem_size) {
+    return ((_map_ctrl_offset(cap, elem_size) + sizeof(uint64_t) - 1) / sizeof(uint64_t)) * sizeof(uint64_t);
+}
+#endif
+
+/* Total number of bytes used by the buckets and their metadata (excluding the header) */
+static inline size_t _map_data_size(size_t cap, size_t elem_size) {
+#if defined(MAP_CONTROL_BYTES)
+    /* The first MAP_GROUP_WIDTH - 1 control bytes are mirrored after the last one
+       so that a group can always be loaded without wrapping */
+    return _map_ctrl_offset(cap, elem_size) + cap + MAP_GROUP_WIDTH - 1;
+#else
+    return _map_occupancy_offset(cap, elem_size) + ((cap + 63) / 64) * sizeof(uint64_t);
+#endif
+}
+
+#ifdef MAP_CACHE_HASH
+/* Returns the array of cached hashes that follows the buckets */
+static inline size_t *_map_hashes(void *tbl, size_t cap, size_t elem_size) {
+    return (size_t *)((char *)tbl + _map_meta_offset(cap, elem_size));
+}
+#endif
+
+#ifdef MAP_STORE_KEY_LEN
+/* Returns the array of key lengths that follows the buckets (and cached hashes) */
+static inline size_t *_map_lens(void *tbl, size_t cap, size_t elem_size) {
+    return (size_t *)((char *)tbl + _map_lens_offset(cap, elem_size));
+}
+#endif
+
+/* Returns the number of buckets between the home bucket of hash and bucket idx */
+static inline size_t _map_probe_dist(size_t hash, size_t idx, size_t cap) {
+    size_t home = _map_home(hash, cap);
+    return idx >= home ? idx - home : idx + cap - home;
+}
+
+#ifdef MAP_ROBIN_HOOD
+/* Returns the array of probe distances that follows the buckets (and hashes and lengths) */
+static inline uint32_t *_map_dists(void *tbl, size_t cap, size_t elem_size) {
+    return (uint32_t *)((char *)tbl + _map_dists_offset(cap, elem_size));
+}
+#endif
+
+#ifdef MAP_CONTROL_BYTES
+/* Returns the control byte array that follows the buckets and the other metadata */
+static inline uint8_t *_map_ctrl(void *tbl, size_t cap, size_t elem_size) {
+    return (uint8_t *)tbl + _map_ctrl_offset(cap, elem_size);
+}
+
+/* Sets the control byte for bucket idx, keeping the mirrored tail in sync */
+static inline void _map_set_ctrl(uint8_t *ctrl, size_t cap, size_t idx, uint8_t value) {
+    ctrl[idx] = value;
+    for (size_t i = idx + cap; i < cap + MAP_GROUP_WIDTH - 1; i += cap)
+        ctrl[i] = value;
+}
+#else
+/* Returns the occupancy bitmap that follows the buckets and the other metadata */
+static inline uint64_t *_map_occupancy(void *tbl, size_t cap, size_t elem_size) {
+    return (uint64_t *)((char *)tbl + _map_occupancy_offset(cap, elem_size));
+}
+#endif
+
+/* Returns a mask with bit i set if bucket base + i is full, for the 64 buckets
+   starting at base (which must be a multiple of 64); buckets past cap are clear */
+static inline uint64_t _map_full_mask(void *tbl, size_t cap, size_t elem_size, size_t base) {
+#ifdef MAP_CONTROL_BYTES
+    const uint8_t *ctrl = _map_ctrl(tbl, cap, elem_size);
+    uint64_t mask = 0;
+    for (size_t g = 0; g < 64 && base + g < cap; g += MAP_GROUP_WIDTH)
+        mask |= (uint64_t)_map_group_full(ctrl + base + g) << g;
+    /* Drop the mirrored control bytes */
+    if (cap - base < 64)
+        mask &= ((uint64_t)1 << (cap - base)) - 1;
+    return mask;
+#else
+    return _map_occupancy(tbl, cap, elem_size)[base / 64];
+#endif
+}
+
+/* Returns the first full bucket at or after idx, or cap if there is none */
+static inline size_t _map_next_full(void *tbl, size_t cap, size_t elem_size, size_t idx) {
+    while (idx < cap) {
+        size_t base = idx & ~(size_t)63;
+        uint64_t mask = _map_full_mask(tbl, cap, elem_size, base) >> (idx - base);
+        if (mask)
+            return idx + (size_t)__builtin_ctzll(mask);
+        idx = base + 64;
+    }
+    return cap;
+}
+
+/* Records the metadata (cached hash, key length, probe distance, control byte) of the
+   key stored at bucket idx */
+static inline void _map_set_meta(void *tbl, size_t cap, size_t elem_size, size_t idx, size_t hash, size_t len) {
+#ifdef MAP_CACHE_HASH
+    _map_hashes(tbl, cap, elem_size)[idx] = hash;
+#endif
+#ifdef MAP_STORE_KEY_LEN
+    _map_lens(tbl, cap, elem_size)[idx] = len;
+#endif
+#ifdef MAP_ROBIN_HOOD
+    _map_dists(tbl, cap, elem_size)[idx] = (uint32_t)_map_probe_dist(hash, idx, cap);
+#endif
+#ifdef MAP_CONTROL_BYTES
+    _map_set_ctrl(_map_ctrl(tbl, cap, elem_size), cap, idx, _map_tag(hash));
+#else
+    _map_occupancy(tbl, cap, elem_size)[idx / 64] |= (uint64_t)1 << (idx % 64);
+#endif
+    (void)hash; (void)len;
+}
+
+/* Marks the metadata of bucket idx as empty */
+static inline void _map_clear_meta(void *tbl, size_t cap, size_t elem_size, size_t idx) {
+#ifdef MAP_CONTROL_BYTES
+    _map_set_ctrl(_map_ctrl(tbl, cap, elem_size), cap, idx, MAP_CTRL_EMPTY);
+#else
+    _map_occupancy(tbl, cap, elem_size)[idx / 64] &= ~((uint64_t)1 << (idx % 64));
+#endif
+}
+
+/* Copies the element, cached hash, key length and probe distance of bucket from of src
+   into bucket to of dst (both with capacity cap), but not its control byte or occupancy bit */
+static inline void _map_copy_bucket(void *dst, void *src, size_t cap, size_t elem_size, size_t from, size_t to) {
+    memcpy((char *)dst + to * elem_size, (char *)src + from * elem_size, elem_size);
+#ifdef MAP_CACHE_HASH
+    _map_hashes(dst, cap, elem_size)[to] = _map_hashes(src, cap, elem_size)[from];
+#endif
+#ifdef MAP_STORE_KEY_LEN
+    _map_lens(dst, cap, elem_size)[to] = _map_lens(src, cap, elem_size)[from];
+#endif
+#ifdef MAP_ROBIN_HOOD
+    _map_dists(dst, cap, elem_size)[to] = _map_dists(src, cap, elem_size)[from];
+#endif
+    (void)cap;
+}
+
+/* Copies the element and metadata of bucket from into bucket to */
+static inline void _map_move_bucket(void *tbl, size_t cap, size_t elem_size, size_t from, size_t to) {
+    _map_copy_bucket(tbl, tbl, cap, elem_size, from, to);
+#ifdef MAP_CONTROL_BYTES
+    uint8_t *ctrl = _map_ctrl(tbl, cap, elem_size);
+    _map_set_ctrl(ctrl, cap, to, ctrl[from]);
+#else
+    _map_occupancy(tbl, cap, elem_size)[to / 64] |= (uint64_t)1 << (to % 64);
+#endif
+}
+
+/* Returns non-zero if the size bytes at field are all zero (the empty-key sentinel) */
+static inline int _map_field_is_zero(const void *field, size_t size) {
+    if (size == sizeof(uint64_t))
+        return _map_read8((const uint8_t *)field) == 0;
+    if (size == sizeof(uint32_t))
+        return _map_read4((const uint8_t *)field) == 0;
+    unsigned char acc = 0;
+    for (size_t i = 0; i < size; i++)
+        acc |= ((const unsigned char *)field)[i];
+    return acc == 0;
+}
+
+/* Returns the key bytes described by an element's key field: for string keys the
+   field holds a pointer to them, otherwise the field itself holds them */
+static inline const void *_map_field_key(const void *field, map_key_policy kp) {
+    return kp.kind == MAP_KEY_STRING ? *(const char *const *)field : field;
+}
+
+/* Returns the length of the key held in an element's key field */
+static inline size_t _map_field_key_len(const void *field, map_key_policy kp) {
+    return kp.kind == MAP_KEY_STRING ? strlen(*(const char *const *)field) : kp.size;
+}
+
+/* Returns the key bytes described by a lookup argument of type MAP_KEY_ARG_TYPE */
+static inline const void *_map_arg_key(const void *arg, map_key_policy kp) {
+    return kp.kind == MAP_KEY_INT ? arg : *(const void *const *)arg;
+}
+
+/* Returns the length of the key described by a lookup argument of type MAP_KEY_ARG_TYPE */
+static inline size_t _map_arg_key_len(const void *arg, map_key_policy kp) {
+    return kp.kind == MAP_KEY_STRING ? strlen(*(const char *const *)arg) : kp.size;
+}
+
+/* Returns non-zero if bucket idx holds an element */
+static inline int _map_bucket_full(void *tbl, size_t cap, size_t elem_size, size_t idx, map_key_policy kp) {
+#ifdef MAP_CONTROL_BYTES
+    (void)kp;
+    return !(_map_ctrl(tbl, cap, elem_size)[idx] & 0x80);
+#else
+    (void)cap;
+    return !_map_field_is_zero((char *)tbl + idx * elem_size, kp.size);
+#endif
+}
+
+/* Empties bucket idx: resets its key field to the sentinel and clears its metadata */
+static inline void _map_clear_bucket(void *tbl, size_t cap, size_t elem_size, size_t idx, map_key_policy kp) {
+    memset((char *)tbl + idx * elem_size, 0, kp.size);
+    _map_clear_meta(tbl, cap, elem_size, idx);
+}
+
+/* Returns the length of the key stored at bucket idx */
+static inline size_t _map_bucket_len(void *tbl, size_t cap, size_t elem_size, size_t idx, map_key_policy kp) {
+#ifdef MAP_STORE_KEY_LEN
+    if (kp.kind == MAP_KEY_STRING)
+        return _map_lens(tbl, cap, elem_size)[idx];
+#endif
+    (void)cap;
+    return _map_field_key_len((char *)tbl + idx * elem_size, kp);
+}
+
+/* Returns the hash of the key stored at bucket idx, using the cached value when available */
+static inline size_t _map_bucket_hash(void *tbl, size_t cap, size_t elem_size, size_t idx, map_key_policy kp) {
+#ifdef MAP_CACHE_HASH
+    (void)kp;
+    return _map_hashes(tbl, cap, elem_size)[idx];
+#else
+    const void *key = _map_field_key((char *)tbl + idx * elem_size, kp);
+    return _map_hash_key(key, _map_bucket_len(tbl, cap, elem_size, idx, kp), kp);
+#endif
+}
+
+/* Returns non-zero if the key stored at bucket idx equals the len-byte key with the given hash */
+static inline int _map_key_equal(void *tbl, size_t cap, size_t elem_size, size_t idx,
+                                 const void *key, size_t len, size_t hash, map_key_policy kp) {
+    const char *field = (char *)tbl + idx * elem_size;
+    if (kp.kind == MAP_KEY_INT)
+        return _map_read_int_key(field, kp) == _map_read_int_key(key, kp);
+    if (kp.kind == MAP_KEY_BYTES)
+        return memcmp(field, key, kp.size) == 0;
+    const char *stored = *(const char *const *)field;
+#ifdef MAP_CACHE_HASH
+    if (_map_hashes(tbl, cap, elem_size)[idx] != hash)
+        return 0;
+#endif
+    (void)hash;
+#ifdef MAP_STORE_KEY_LEN
+    return _map_lens(tbl, cap, elem_size)[idx] == len && memcmp(stored, key, len) == 0;
+#else
+    (void)cap;
+    return strncmp(stored, (const char *)key, len) == 0 && stored[len] == '\0';
+#endif
+}
+
+#ifdef MAP_OWN_KEYS
+/* ------------------------------------------------------------------
+   Key pool (MAP_OWN_KEYS)
+   String keys are copied, NUL-terminated and back to back, into chunks
+   that are never moved. With MAP_INTERN_KEYS, an open-addressing index
+   over the stored strings (keyed by the map's own hash of each key) lets
+   an equal key reuse an earlier copy.
+   Every map has a pool of its own. A map_dup copy shares the chunks that
+   exist at that point (each chunk counts the pools holding it and is
+   freed with the last one), but appends to chunks and an index of its
+   own, so a map and its copies can be updated from different threads.
+------------------------------------------------------------------ */
+typedef struct map_key_chunk {
+    struct map_key_chunk *next;
+    size_t refcount; /* pools holding the chunk (updated atomically) */
+    size_t size; /* usable bytes in data */
+    size_t used; /* bytes handed out from data */
+    char data[];
+} map_key_chunk;
+
+#ifdef MAP_INTERN_KEYS
+typedef struct {
+    const char *str; /* NULL for an empty slot */
+    size_t len;
+    size_t hash;
+} map_interned_key;
+#endif
+
+/* Fields:
+ *   - head:       Newest chunk holding the map's keys (older ones follow through next);
+ *                 chunks from before a map_dup are shared with the copy.
+ *   - open:       Chunk new keys are copied into, which no other pool appends to (NULL
+ *                 until the first key, and in a fresh map_dup copy).
+ *   - allocator:  Allocator of the map that created the pool.
+ *   - interned, interned_count, interned_cap: The index of stored strings (MAP_INTERN_KEYS).
+ */
+typedef struct map_key_pool {
+    map_key_chunk *head;
+    map_key_chunk *open;
+    const simple_allocator *allocator;
+#ifdef MAP_INTERN_KEYS
+    map_interned_key *interned;
+    size_t interned_count;
+    size_t interned_cap;
+#endif
+} map_key_pool;
+
+/* Returns size bytes from the pool's open chunk, starting a new chunk if needed */
+static inline char *_map_key_pool_alloc(map_key_pool *pool, size_t size) {
+    map_key_chunk *chunk = pool->open;
+    if (!chunk || chunk->size - chunk->used < size) {
+        size_t chunk_size = size > MAP_KEY_POOL_CHUNK ? size : MAP_KEY_POOL_CHUNK;
+        chunk = (map_key_chunk *)simple_ds_malloc(pool->allocator, sizeof(map_key_chunk) + chunk_size);
+        if (!chunk)
+            return NULL;
+        chunk->next = pool->head;
+        chunk->refcount = 1;
+        chunk->size = chunk_size;
+        chunk->used = 0;
+        pool->head = chunk;
+        pool->open = chunk;
+    }
+    char *ptr = chunk->data + chunk->used;
+    chunk->used += size;
+    return ptr;
+}
+
+#ifdef MAP_INTERN_KEYS
+/* Returns the index slot for the len-byte key with the given hash: the slot holding it, or
+   the empty slot where it would go. The index must have at least one empty slot. */
+static inline map_interned_key *_map_key_pool_slot(map_key_pool *pool, const void *key, size_t len,
+                                                   size_t hash) {
+    size_t mask = pool->interned_cap - 1;
+    for (size_t i = hash & mask;; i = (i + 1) & mask) {
+        map_interned_key *slot = &pool->interned[i];
+        if (!slot->str || (slot->hash == hash && slot->len == len && memcmp(slot->str, key, len) == 0))
+            return slot;
+    }
+}
+
+/* Doubles the index (from nothing to 64 slots). Returns non-zero on success. */
+static inline int _map_key_pool_grow_index(map_key_pool *pool) {
+    size_t new_cap = pool->interned_cap ? pool->interned_cap * 2 : 64;
+    map_interned_key *old = pool->interned;
+    size_t old_cap = pool->interned_cap;
+    map_interned_key *fresh = (map_interned_key *)simple_ds_calloc(pool->allocator, new_cap * sizeof(*fresh));
+    if (!fresh)
+        return 0;
+    pool->interned = fresh;
+    pool->interned_cap = new_cap;
+    for (size_t i = 0; i < old_cap; i++) {
+        if (old[i].str)
+            *_map_key_pool_slot(pool, old[i].str, old[i].len, old[i].hash) = old[i];
+    }
+    simple_ds_free(pool->allocator, old, old_cap * sizeof(*old));
+    return 1;
+}
+#endif
+
+/* ------------------------------------------------------------------
+   Internal function: _map_key_pool_copy
+   Returns the pool's copy of the len-byte key with the given hash,
+   creating the pool of hdr (from the map's allocator) on first use. With
+   MAP_INTERN_KEYS, an equal key that is already in the pool is reused.
+   Returns NULL if memory cannot be allocated.
+------------------------------------------------------------------ */
+static inline const char *_map_key_pool_copy(map_header *hdr, const void *key, size_t len, size_t hash) {
+    map_key_pool *pool = hdr->key_pool;
+    if (!pool) {
+        pool = (map_key_pool *)simple_ds_calloc(hdr->allocator, sizeof(map_key_pool));
+        if (!pool)
+            return NULL;
+        pool->allocator = hdr->allocator;
+        hdr->key_pool = pool;
+    }
+#ifdef MAP_INTERN_KEYS
+    if (pool->interned_count >= pool->interned_cap / 2 && !_map_key_pool_grow_index(pool))
+        return NULL;
+    map_interned_key *slot = _map_key_pool_slot(pool, key, len, hash);
+    if (slot->str)
+        return slot->str;
+#else
+    (void)hash;
+#endif
+    char *copy = _map_key_pool_alloc(pool, len + 1);
+    if (!copy)
+        return NULL;
+    memcpy(copy, key, len);
+    copy[len] = '\0';
+#ifdef MAP_INTERN_KEYS
+    slot->str = copy;
+    slot->len = len;
+    slot->hash = hash;
+    pool->interned_count++;
+#endif
+    return copy;
+}
+
+/* Returns a pool for a map_dup copy of a map with the given pool: it holds a reference
+   to each existing chunk (and a copy of the index with MAP_INTERN_KEYS), and copies new
+   keys into chunks of its own. Returns NULL if pool is NULL or memory cannot be allocated. */
+static inline map_key_pool *_map_key_pool_share(map_key_pool *pool) {
+    if (!pool)
+        return NULL;
+    map_key_pool *share = (map_key_pool *)simple_ds_calloc(pool->allocator, sizeof(map_key_pool));
+    if (!share)
+        return NULL;
+    share->allocator = pool->allocator;
+#ifdef MAP_INTERN_KEYS
+    if (pool->interned_cap) {
+        share->interned = (map_interned_key *)simple_ds_malloc(pool->allocator,
+                                                               pool->interned_cap * sizeof(map_interned_key));
+        if (!share->interned) {
+            simple_ds_free(pool->allocator, share, sizeof(map_key_pool));
+            return NULL;
+        }
+        memcpy(share->interned, pool->interned, pool->interned_cap * sizeof(map_interned_key));
+        share->interned_count = pool->interned_count;
+        share->interned_cap = pool->interned_cap;
+    }
+#endif
+    share->head = pool->head;
+    for (map_key_chunk *chunk = pool->head; chunk; chunk = chunk->next)
+        __atomic_fetch_add(&chunk->refcount, 1, __ATOMIC_RELAXED);
+    return share;
+}
+
+/* Frees pool (which may be NULL) and each of its chunks that no other pool holds */
+static inline void _map_key_pool_release(map_key_pool *pool) {
+    if (!pool)
+        return;
+    map_key_chunk *chunk = pool->head;
+    while (chunk) {
+        /* Once the reference is dropped, another pool may free the chunk */
+        map_key_chunk *next = chunk->next;
+        if (__atomic_sub_fetch(&chunk->refcount, 1, __ATOMIC_ACQ_REL) == 0)
+            simple_ds_free(pool->allocator, chunk, sizeof(map_key_chunk) + chunk->size);
+        chunk = next;
+    }
+#ifdef MAP_INTERN_KEYS
+    simple_ds_free(pool->allocator, pool->interned, pool->interned_cap * sizeof(map_interned_key));
+#endif
+    simple_ds_free(pool->allocator, pool, sizeof(map_key_pool));
+}
+#endif
+
+/* Returns the pooled key pointer held in an element's key field, for reuse when the
+   element is replaced, or NULL if keys are not owned by the map (MAP_OWN_KEYS) */
+static inline const void *_map_owned_key(const void *field, map_key_policy kp) {
+#ifdef MAP_OWN_KEYS
+    if (kp.kind == MAP_KEY_STRING)
+        return *(const char *const *)field;
+#endif
+    (void)field; (void)kp;
+    return NULL;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_own_key
+   With MAP_OWN_KEYS, points the string key field of a just-stored element
+   at owned (the pooled copy of its key, when it replaced an element with
+   the same key) or at a new pooled copy of the len-byte key it holds.
+   Nothing is done otherwise. If the pool cannot grow, the caller's
+   pointer is left in place.
+------------------------------------------------------------------ */
+static inline void _map_own_key(map_header *hdr, void *field, const void *owned, size_t len, size_t hash,
+                                map_key_policy kp) {
+#ifdef MAP_OWN_KEYS
+    if (kp.kind != MAP_KEY_STRING)
+        return;
+    if (!owned)
+        owned = _map_key_pool_copy(hdr, *(const char *const *)field, len, hash);
+    if (owned)
+        memcpy(field, &owned, sizeof(owned));
+#else
+    (void)hdr; (void)field; (void)owned; (void)len; (void)hash; (void)kp;
+#endif
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_alloc_impl
+   Allocates an empty map block with the given capacity (rounded by
+   _map_round_capacity) and default load and growth factors from allocator
+   (NULL for SIMPLE_DS_CALLOC).
+   Returns a pointer to the (zeroed) bucket array, or NULL on failure.
+   The rest of the header (tombstone count, migration state, key pool) starts zeroed.
+------------------------------------------------------------------ */
+static inline void *_map_alloc_impl(size_t cap, size_t elem_size, size_t header_size,
+                                    const simple_allocator *allocator) {
+    cap = _map_round_capacity(cap);
+    /* calloc lets large blocks come straight from zeroed pages instead of being memset */
+    map_header *hdr = (map_header *)simple_ds_calloc(allocator, header_size + _map_data_size(cap, elem_size));
+    if (!hdr)
+        return NULL;
+    hdr->allocator = allocator;
+    hdr->capacity = cap;
+    hdr->count = 0;
+    hdr->load_factor = MAP_LOAD_FACTOR;
+    hdr->growth_factor = MAP_GROWTH_FACTOR_DEFAULT;
+    hdr->shrink_factor = MAP_SHRINK_FACTOR_DEFAULT;
+    _map_update_threshold(hdr);
+    SIMPLE_DS_SET_MAGIC(hdr, MAP_MAGIC_NUMBER);
+#ifdef MAP_TOMBSTONES
+    hdr->deleted = 0;
+#endif
+    char *tbl = (char *)hdr + header_size;
+#ifdef MAP_CONTROL_BYTES
+    memset(_map_ctrl(tbl, cap, elem_size), MAP_CTRL_EMPTY, cap + MAP_GROUP_WIDTH - 1);
+#endif
+    return tbl;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_find_slot
+   Probes for the len-byte key (whose hash is given) starting at its home bucket.
+   key points to the key bytes: the characters of a string key, or the
+   value of an integer or byte-array key.
+   Returns the index of the bucket holding key, the index of the first
+   empty bucket on the probe path if key is absent, or the capacity if
+   every bucket was probed without finding either.
+   With MAP_ROBIN_HOOD, the probe also stops (returning the capacity) as
+   soon as it reaches a bucket whose element is closer to its home than
+   key would be, since key cannot be stored past that point. Insertions
+   must then go through _map_insert_slot.
+------------------------------------------------------------------ */
+static inline size_t _map_find_slot(void *tbl_void, const void *key, size_t len, size_t hash,
+                                     size_t elem_size, map_key_policy kp) {
+    char *tbl = (char *)tbl_void;
+    map_header *hdr = MAP_HEADER(tbl);
+    size_t cap = hdr->capacity;
+    MAP_STAT_ADD(hdr, lookups, 1);
+#if defined(MAP_ROBIN_HOOD)
+    /* Elements are ordered by home bucket, so only those at exactly our distance can match */
+    const uint32_t *dists = _map_dists(tbl, cap, elem_size);
+    size_t h = _map_home(hash, cap);
+    for (size_t dist = 0; dist < cap; dist++) {
+        MAP_STAT_ADD(hdr, probes, 1);
+        if (!_map_bucket_full(tbl, cap, elem_size, h, kp))
+            return h;
+        if (dists[h] < dist)
+            return cap;
+        if (dists[h] == dist) {
+            MAP_STAT_ADD(hdr, key_compares, 1);
+            if (_map_key_equal(tbl, cap, elem_size, h, key, len, hash, kp))
+                return h;
+        }
+        h = _map_next(h, cap);
+    }
+    return cap;
+#elif defined(MAP_CONTROL_BYTES)
+    /* Scan MAP_GROUP_WIDTH control bytes at a time and only touch the buckets whose
+       tag matches. Candidates past the first empty bucket are not part of the probe path. */
+    const uint8_t *ctrl = _map_ctrl(tbl, cap, elem_size);
+    uint8_t tag = _map_tag(hash);
+    size_t h = _map_home(hash, cap);
+    for (size_t probed = 0; probed < cap; probed += MAP_GROUP_WIDTH) {
+        MAP_STAT_ADD(hdr, probes, 1);
+        uint32_t match = _map_group_match(ctrl + h, tag);
+        uint32_t empty = _map_group_match(ctrl + h, MAP_CTRL_EMPTY);
+        if (empty)
+            match &= (empty & (0u - empty)) - 1;
+        while (match) {
+            size_t idx = _map_wrap(h + (size_t)__builtin_ctz(match), cap);
+            MAP_STAT_ADD(hdr, key_compares, 1);
+            if (_map_key_equal(tbl, cap, elem_size, idx, key, len, hash, kp))
+                return idx;
+            match &= match - 1;
+        }
+        if (empty) {
+            return _map_wrap(h + (size_t)__builtin_ctz(empty), cap);
+        }
+        h = _map_wrap(h + MAP_GROUP_WIDTH, cap);
+    }
+    return cap;
+#else
+    size_t h = _map_home(hash, cap);
+    size_t start = h;
+    while (1) {
+         MAP_STAT_ADD(hdr, probes, 1);
+         if (!_map_bucket_full(tbl, cap, elem_size, h, kp))
+             return h;
+         MAP_STAT_ADD(hdr, key_compares, 1);
+         if (_map_key_equal(tbl, cap, elem_size, h, key, len, hash, kp))
+             return h;
+         h = _map_next(h, cap);
+         if (h == start)
+             return cap;
+    }
+#endif
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_insert_slot
+   Returns the bucket where a new element with the given hash should be
+   stored, given the result of _map_find_slot for its (absent) key. The
+   map must have at least one empty bucket.
+   With MAP_ROBIN_HOOD, the new element takes the place of the first
+   element on its probe path that is closer to its own home, and that
+   element and the rest of its run are shifted one bucket forward (each
+   one getting one bucket further from home). Otherwise, slot is the
+   first empty bucket on the probe path and is returned unchanged.
+------------------------------------------------------------------ */
+static inline size_t _map_insert_slot(void *tbl, size_t cap, size_t elem_size, size_t slot, size_t hash,
+                                      map_key_policy kp) {
+#ifdef MAP_ROBIN_HOOD
+    (void)slot;
+    uint32_t *dists = _map_dists(tbl, cap, elem_size);
+    size_t pos = _map_home(hash, cap);
+    for (size_t dist = 0; _map_bucket_full(tbl, cap, elem_size, pos, kp) && dists[pos] >= dist; dist++)
+        pos = _map_next(pos, cap);
+    size_t end = pos;
+    while (_map_bucket_full(tbl, cap, elem_size, end, kp))
+        end = _map_next(end, cap);
+    while (end != pos) {
+        size_t prev = _map_wrap(end + cap - 1, cap);
+        _map_move_bucket(tbl, cap, elem_size, prev, end);
+        dists[end]++;
+        MAP_STAT_MAX(MAP_HEADER((char *)tbl), max_displacement, dists[end]);
+        end = prev;
+    }
+    if (_map_bucket_full(tbl, cap, elem_size, pos, kp))
+        _map_clear_bucket(tbl, cap, elem_size, pos, kp);
+    MAP_STAT_MAX(MAP_HEADER((char *)tbl), max_displacement, _map_probe_dist(hash, pos, cap));
+    return pos;
+#elif defined(MAP_TOMBSTONES)
+    /* Reuse the first tombstone on the probe path, if it comes before slot */
+    (void)kp;
+    const uint8_t *ctrl = _map_ctrl(tbl, cap, elem_size);
+    size_t pos = _map_home(hash, cap);
+    while (pos != slot && ctrl[pos] != MAP_CTRL_DELETED)
+        pos = _map_next(pos, cap);
+    if (pos != slot)
+        MAP_HEADER((char *)tbl)->deleted--;
+    MAP_STAT_MAX(MAP_HEADER((char *)tbl), max_displacement, _map_probe_dist(hash, pos, cap));
+    return pos;
+#else
+    (void)tbl; (void)cap; (void)elem_size; (void)hash; (void)kp;
+    MAP_STAT_MAX(MAP_HEADER((char *)tbl), max_displacement, _map_probe_dist(hash, slot, cap));
+    return slot;
+#endif
+}
+
+/* Returns the capacity to resize to before inserting n new keys, or 0 if the map
+   has room for them. Buckets holding tombstones count as used; when most of them
+   are tombstones, the map is rebuilt at the same capacity instead of growing.
+   The map grows by at least its growth factor, and enough to fit all n keys. */
+static inline size_t _map_grow_capacity_n(map_header *hdr, size_t n) {
+    size_t used = hdr->count;
+#ifdef MAP_TOMBSTONES
+    used += hdr->deleted;
+#endif
+    if (used + n < hdr->grow_threshold)
+        return 0;
+#ifdef MAP_TOMBSTONES
+    if (hdr->count + n < hdr->grow_threshold / 2)
+        return hdr->capacity;
+#endif
+    size_t new_cap = (size_t)(hdr->capacity * hdr->growth_factor);
+    size_t min_cap = (size_t)((hdr->count + n + 1) / hdr->load_factor) + 1;
+    if (new_cap < min_cap)
+        new_cap = min_cap;
+    return new_cap > hdr->capacity ? new_cap : hdr->capacity + 1;
+}
+
+/* Returns the capacity to resize to before inserting, or 0 if the map has room */
+static inline size_t _map_grow_capacity(map_header *hdr) {
+    return _map_grow_capacity_n(hdr, 1);
+}
+
+/* Returns non-zero if one more key would leave the map without an empty bucket, which
+   probes need to stop at. Only a map that could not grow gets this full. */
+static inline int _map_is_full(map_header *hdr) {
+    size_t used = hdr->count;
+#ifdef MAP_TOMBSTONES
+    used += hdr->deleted;
+#endif
+    return used + 1 >= hdr->capacity;
+}
+
+/* Returns the smallest capacity that holds the elements of hdr and one more insert
+   without growing (at least min_cap), or 0 if that would not free any buckets */
+static inline size_t _map_fit_capacity(map_header *hdr, size_t min_cap) {
+    size_t new_cap = (size_t)((hdr->count + 2) / hdr->load_factor) + 1;
+    if (new_cap < min_cap)
+        new_cap = min_cap;
+    return _map_round_capacity(new_cap) < hdr->capacity ? new_cap : 0;
+}
+
+/* Returns the capacity to shrink to after a delete, or 0 to keep the capacity. A map
+   with fewer than shrink_threshold elements is cut down until it is load_factor /
+   growth_factor full (at least MAP_INIT_CAPACITY buckets), so it can grow by one
+   growth step before it is resized again. */
+static inline size_t _map_shrink_capacity(map_header *hdr) {
+    if (hdr->count >= hdr->shrink_threshold)
+        return 0;
+    size_t target = (size_t)(hdr->count * hdr->growth_factor / hdr->load_factor) + 1;
+    return _map_fit_capacity(hdr, target > MAP_INIT_CAPACITY ? target : MAP_INIT_CAPACITY);
+}
+
+/* Moves the element in bucket idx of src into a free bucket of dst (which must not
+   hold the same key), without changing either element count */
+static inline void _map_reinsert(void *dst, size_t dst_cap, void *src, size_t src_cap, size_t idx,
+                                 size_t elem_size, map_key_policy kp) {
+    size_t hash = _map_bucket_hash(src, src_cap, elem_size, idx, kp);
+    size_t len = _map_bucket_len(src, src_cap, elem_size, idx, kp);
+#ifdef MAP_ROBIN_HOOD
+    size_t h = _map_insert_slot(dst, dst_cap, elem_size, dst_cap, hash, kp);
+#else
+    size_t h = _map_home(hash, dst_cap);
+    while (_map_bucket_full(dst, dst_cap, elem_size, h, kp)) {
+        h = _map_next(h, dst_cap);
+    }
+#ifdef MAP_TOMBSTONES
+    if (_map_ctrl(dst, dst_cap, elem_size)[h] == MAP_CTRL_DELETED)
+        MAP_HEADER((char *)dst)->deleted--;
+#endif
+    MAP_STAT_MAX(MAP_HEADER((char *)dst), max_displacement, _map_probe_dist(hash, h, dst_cap));
+#endif
+    memcpy((char *)dst + h * elem_size, (char *)src + idx * elem_size, elem_size);
+    _map_set_meta(dst, dst_cap, elem_size, h, hash, len);
+}
+
+/* Returns the bucket array still being migrated into tbl, or NULL */
+static inline char *_map_old_tbl(map_header *hdr) {
+#ifdef MAP_INCREMENTAL_RESIZE
+    return hdr->old;
+#else
+    (void)hdr;
+    return NULL;
+#endif
+}
+
+/* Returns the capacity of the bucket array still being migrated, or 0 */
+static inline size_t _map_old_capacity(map_header *hdr) {
+#ifdef MAP_INCREMENTAL_RESIZE
+    return hdr->old ? ((map_header *)hdr->old_hdr)->capacity : 0;
+#else
+    (void)hdr;
+    return 0;
+#endif
+}
+
+/* Returns non-zero if bucket idx of the bucket array being migrated holds an element
+   that has not been migrated or deleted yet */
+static inline int _map_old_live(map_header *hdr, size_t elem_size, size_t idx, map_key_policy kp) {
+#ifdef MAP_INCREMENTAL_RESIZE
+    if (idx < hdr->migrate_pos || (hdr->old_gone[idx / 8] & (1u << (idx % 8))))
+        return 0;
+    return _map_bucket_full(hdr->old, _map_old_capacity(hdr), elem_size, idx, kp);
+#else
+    (void)hdr; (void)elem_size; (void)idx; (void)kp;
+    return 0;
+#endif
+}
+
+/* Frees the bucket array being migrated (without migrating the rest of it) */
+static inline void _map_release_old(map_header *hdr, size_t elem_size) {
+#ifdef MAP_INCREMENTAL_RESIZE
+    if (hdr->old) {
+        size_t old_cap = _map_old_capacity(hdr);
+        size_t old_size = (size_t)(hdr->old - (char *)hdr->old_hdr) + _map_data_size(old_cap, elem_size);
+        simple_ds_free(((map_header *)hdr->old_hdr)->allocator, hdr->old_hdr, old_size);
+        simple_ds_free(hdr->allocator, hdr->old_gone, (old_cap + 7) / 8);
+        hdr->old = NULL;
+        hdr->old_hdr = NULL;
+        hdr->old_gone = NULL;
+    }
+#else
+    (void)hdr; (void)elem_size;
+#endif
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_migrate
+   With MAP_INCREMENTAL_RESIZE, moves up to n buckets of the bucket array
+   being migrated into tbl, and frees it once every bucket has been moved.
+   Does nothing otherwise, or if no migration is pending.
+------------------------------------------------------------------ */
+static inline void _map_migrate(void *tbl, size_t elem_size, map_key_policy kp, size_t n) {
+#ifdef MAP_INCREMENTAL_RESIZE
+    if (!tbl)
+        return;
+    map_header *hdr = MAP_HEADER((char *)tbl);
+    if (!hdr->old)
+        return;
+    size_t old_cap = _map_old_capacity(hdr);
+    for (; n && hdr->migrate_pos < old_cap; n--, hdr->migrate_pos++) {
+        if (_map_old_live(hdr, elem_size, hdr->migrate_pos, kp))
+            _map_reinsert(tbl, hdr->capacity, hdr->old, old_cap, hdr->migrate_pos, elem_size, kp);
+    }
+    if (hdr->migrate_pos == old_cap)
+        _map_release_old(hdr, elem_size);
+#else
+    (void)tbl; (void)elem_size; (void)kp; (void)n;
+#endif
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_find_old
+   Looks up the len-byte key (with the given hash) in the bucket array
+   being migrated into tbl. If mark_gone is non-zero, the element is
+   marked as deleted there (its bytes stay readable until the migration
+   finishes). Returns a pointer to the element, or NULL if not found.
+------------------------------------------------------------------ */
+static inline void *_map_find_old(void *tbl, const void *key, size_t len, size_t hash, size_t elem_size,
+                                  map_key_policy kp, int mark_gone) {
+#ifdef MAP_INCREMENTAL_RESIZE
+    map_header *hdr = MAP_HEADER((char *)tbl);
+    if (!hdr->old)
+        return NULL;
+    size_t idx = _map_find_slot(hdr->old, key, len, hash, elem_size, kp);
+    if (idx == _map_old_capacity(hdr) || !_map_old_live(hdr, elem_size, idx, kp))
+        return NULL;
+    if (mark_gone)
+        hdr->old_gone[idx / 8] |= (uint8_t)(1u << (idx % 8));
+    return hdr->old + idx * elem_size;
+#else
+    (void)tbl; (void)key; (void)len; (void)hash; (void)elem_size; (void)kp; (void)mark_gone;
+    return NULL;
+#endif
+}
 
-/* djb2 hash function for string keys (remains unchanged) */
-static inline size_t _hash_string(const char *str) {
-    size_t hash = 5381;
-    int c;
-    while ((c = (unsigned char)*str++))
-         hash = ((hash << 5) + hash) + c;
-    return hash;
+/* ------------------------------------------------------------------
+   Internal function: _map_lookup_impl
+   Looks up the len-byte key with the given hash in tbl_void (which may be
+   NULL) without modifying the map, so that concurrent readers may call it.
+   During an incremental resize, the bucket array being migrated is
+   searched as well. Returns a pointer to the element, or NULL if not found.
+------------------------------------------------------------------ */
+static inline void *_map_lookup_impl(void *tbl_void, const void *key, size_t len, size_t hash, size_t elem_size,
+                                     map_key_policy kp) {
+    if (!tbl_void)
+        return NULL;
+    char *tbl = (char *)tbl_void;
+    size_t cap = MAP_HEADER(tbl)->capacity;
+    size_t h = _map_find_slot(tbl, key, len, hash, elem_size, kp);
+    if (h == cap || !_map_bucket_full(tbl, cap, elem_size, h, kp))
+        return _map_find_old(tbl, key, len, hash, elem_size, kp, 0);
+    return tbl + h * elem_size;
 }
 
 /* ------------------------------------------------------------------
    Internal function: _map_get_impl
-   Looks up an element in the hash map by key.
-   Assumes that the element's first field is a pointer (const char *) holding the key.
+   Looks up an element in the hash map by its len-byte key (see _map_find_slot).
+   Assumes that the element's first field is the key.
    Returns a pointer to the element, or NULL if not found.
+   During an incremental resize, the lookup migrates a few buckets and then falls
+   back to the old bucket array; the result is only valid until the next operation.
 ------------------------------------------------------------------ */
-static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_size) {
+static inline void *_map_get_impl(void *tbl_void, const void *key, size_t len, size_t elem_size, map_key_policy kp) {
     if (!tbl_void)
         return NULL;
+    _map_migrate(tbl_void, elem_size, kp, MAP_MIGRATE_BUCKETS);
+    return _map_lookup_impl(tbl_void, key, len, _map_hash_key(key, len, kp), elem_size, kp);
+}
+
+/* Looks up an element by a key argument of type MAP_KEY_ARG_TYPE (see map_get) */
+static inline void *_map_get_arg(void *tbl, const void *arg, size_t elem_size, map_key_policy kp) {
+    const void *key = _map_arg_key(arg, kp);
+    if (!tbl || !key)
+        return NULL;
+    return _map_get_impl(tbl, key, _map_arg_key_len(arg, kp), elem_size, kp);
+}
+
+/* Prefetches the home bucket of a key and the metadata a probe reads first (the
+   occupancy bitmap is not read by probes, which test the key field instead) */
+static inline void _map_prefetch_home(char *tbl, size_t cap, size_t elem_size, size_t home) {
+    __builtin_prefetch(tbl + home * elem_size);
+#ifdef MAP_CACHE_HASH
+    __builtin_prefetch(&_map_hashes(tbl, cap, elem_size)[home]);
+#endif
+#ifdef MAP_STORE_KEY_LEN
+    __builtin_prefetch(&_map_lens(tbl, cap, elem_size)[home]);
+#endif
+#ifdef MAP_ROBIN_HOOD
+    __builtin_prefetch(&_map_dists(tbl, cap, elem_size)[home]);
+#endif
+#ifdef MAP_CONTROL_BYTES
+    __builtin_prefetch(_map_ctrl(tbl, cap, elem_size) + home);
+#endif
+    (void)cap;
+}
+
+/* Prefetches the characters of the string key stored in the home bucket of hash,
+   unless the bucket is empty or its cached hash or tag shows that it cannot match */
+static inline void _map_prefetch_home_key(char *tbl, size_t cap, size_t elem_size, size_t hash,
+                                          map_key_policy kp) {
+    size_t home = _map_home(hash, cap);
+    if (!_map_bucket_full(tbl, cap, elem_size, home, kp))
+        return;
+#ifdef MAP_CONTROL_BYTES
+    if (_map_ctrl(tbl, cap, elem_size)[home] != _map_tag(hash))
+        return;
+#endif
+#ifdef MAP_CACHE_HASH
+    if (_map_hashes(tbl, cap, elem_size)[home] != hash)
+        return;
+#endif
+    __builtin_prefetch(*(const char *const *)(tbl + home * elem_size));
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_get_batch_impl
+   Looks up the n key arguments (each arg_size bytes, of type MAP_KEY_ARG_TYPE)
+   at args and stores a pointer to each element, or NULL, in the n pointers at
+   out. Keys are handled MAP_BATCH_WIDTH at a time: all of them are hashed and
+   their home buckets prefetched, then (for string keys) the stored key of each
+   home bucket that may match is prefetched, and only then are the probes
+   resolved, so that the cache misses of a batch overlap instead of being paid
+   one after another. Returns the number of keys found.
+------------------------------------------------------------------ */
+static inline size_t _map_get_batch_impl(void *tbl_void, const void *args, size_t arg_size, size_t n, void *out,
+                                         size_t elem_size, map_key_policy kp) {
     char *tbl = (char *)tbl_void;
-    map_header *hdr = MAP_HEADER(tbl);
-    size_t cap = hdr->capacity;
-    size_t h = _hash_string(key) % cap;
-    size_t start = h;
-    while (1) {
-         void *elem_ptr = tbl + h * elem_size;
-         const char *elem_key = *((const char **)elem_ptr);
-         if (!elem_key)
-             break;
-         if (strcmp(elem_key, key) == 0)
-             return elem_ptr;
-         h = (h + 1) % cap;
-         if (h == start)
-             break;
+    const void *res = NULL;
+    size_t found = 0;
+    if (!tbl) {
+        for (size_t i = 0; i < n; i++)
+            memcpy((char *)out + i * sizeof(res), &res, sizeof(res));
+        return 0;
     }
-    return NULL;
+    _map_migrate(tbl, elem_size, kp, MAP_MIGRATE_BUCKETS);
+    size_t cap = MAP_HEADER(tbl)->capacity;
+    const void *keys[MAP_BATCH_WIDTH];
+    size_t lens[MAP_BATCH_WIDTH], hashes[MAP_BATCH_WIDTH];
+    for (size_t base = 0; base < n; base += MAP_BATCH_WIDTH) {
+        size_t m = n - base < MAP_BATCH_WIDTH ? n - base : MAP_BATCH_WIDTH;
+        for (size_t i = 0; i < m; i++) {
+            const void *arg = (const char *)args + (base + i) * arg_size;
+            keys[i] = _map_arg_key(arg, kp);
+            if (!keys[i])
+                continue;
+            lens[i] = _map_arg_key_len(arg, kp);
+            hashes[i] = _map_hash_key(keys[i], lens[i], kp);
+            _map_prefetch_home(tbl, cap, elem_size, _map_home(hashes[i], cap));
+        }
+        if (kp.kind == MAP_KEY_STRING) {
+            for (size_t i = 0; i < m; i++)
+                if (keys[i])
+                    _map_prefetch_home_key(tbl, cap, elem_size, hashes[i], kp);
+        }
+        for (size_t i = 0; i < m; i++) {
+            res = keys[i] ? _map_lookup_impl(tbl, keys[i], lens[i], hashes[i], elem_size, kp) : NULL;
+            found += res != NULL;
+            memcpy((char *)out + (base + i) * sizeof(res), &res, sizeof(res));
+        }
+    }
+    return found;
+}
+
+/* Copies the SIMPLE_MAP_STATS counters of old_hdr into new_hdr, the header of the bucket
+   array the map is being resized into, and records the resize and the bytes it moves */
+static inline void _map_stats_carry(map_header *new_hdr, map_header *old_hdr, size_t elem_size) {
+#ifdef SIMPLE_MAP_STATS
+    new_hdr->stats = old_hdr->stats;
+    new_hdr->stats.resizes++;
+    new_hdr->stats.resize_bytes += old_hdr->count * elem_size;
+#else
+    (void)new_hdr; (void)old_hdr; (void)elem_size;
+#endif
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_resize_impl
+   Allocates a new block with capacity new_cap, re-inserts all items of
+   tbl_void (which may be NULL) with _map_reinsert, copies over the
+   load_factor, growth_factor, shrink_factor and allocator, and frees the old block.
+   With MAP_INCREMENTAL_RESIZE, the items are not re-inserted here: the old
+   block is kept alive and migrated MAP_MIGRATE_BUCKETS buckets at a time by
+   later operations (a migration that is still pending is finished first).
+   Returns a pointer to the new bucket array. If it cannot be allocated,
+   tbl_void is returned unchanged (NULL for a NULL tbl_void).
+------------------------------------------------------------------ */
+static inline void *_map_resize_impl(void *tbl_void, size_t new_cap, size_t elem_size, size_t header_size,
+                                     map_key_policy kp) {
+    if (!tbl_void)
+        return _map_alloc_impl(new_cap, elem_size, header_size, NULL);
+    char *old_tbl = (char *)tbl_void;
+    map_header *old_hdr = (map_header *)(old_tbl - header_size);
+    char *new_tbl = (char *)_map_alloc_impl(new_cap, elem_size, header_size, old_hdr->allocator);
+    if (!new_tbl)
+        return old_tbl;
+    map_header *new_hdr = (map_header *)(new_tbl - header_size);
+    size_t old_cap = old_hdr->capacity;
+    new_cap = new_hdr->capacity;
+    new_hdr->load_factor = old_hdr->load_factor;
+    new_hdr->growth_factor = old_hdr->growth_factor;
+    new_hdr->shrink_factor = old_hdr->shrink_factor;
+    _map_update_threshold(new_hdr);
+#ifdef MAP_OWN_KEYS
+    new_hdr->key_pool = old_hdr->key_pool;
+#endif
+    _map_stats_carry(new_hdr, old_hdr, elem_size);
+#ifdef MAP_INCREMENTAL_RESIZE
+    _map_migrate(old_tbl, elem_size, kp, (size_t)-1);
+    if (old_hdr->count) {
+        new_hdr->old_gone = (uint8_t *)simple_ds_calloc(new_hdr->allocator, (old_cap + 7) / 8);
+        if (new_hdr->old_gone) {
+            new_hdr->old = old_tbl;
+            new_hdr->old_hdr = old_hdr;
+            new_hdr->count = old_hdr->count;
+            return new_tbl;
+        }
+    }
+#endif
+    for (size_t i = 0; i < old_cap; i++) {
+        if (_map_bucket_full(old_tbl, old_cap, elem_size, i, kp)) {
+            _map_reinsert(new_tbl, new_cap, old_tbl, old_cap, i, elem_size, kp);
+            new_hdr->count++;
+        }
+    }
+    simple_ds_free(old_hdr->allocator, old_hdr, header_size + _map_data_size(old_cap, elem_size));
+    return new_tbl;
 }
 
 /* ------------------------------------------------------------------
    Internal macro: MAP_RESIZE
-   Resizes the hash map to a new capacity.
-   Allocates a new block (with the updated capacity), re-inserts all existing
-   items using linear probing, copies over the load_factor and growth_factor,
-   frees the old block, and updates the map pointer.
------------------------------------------------------------------- */
-#define MAP_RESIZE(tbl, new_cap)                                                                                                                         \
-    do {                                                                                                                                                 \
-        _Static_assert(__builtin_types_compatible_p(__typeof__(new_cap), size_t), "new_cap must be size_t");                                             \
-        __typeof__(tbl) _ms_tbl = (tbl);                                                                                                                 \
-        size_t _ms_new_cap = (new_cap);                                                                                                                  \
-        size_t _ms_elem_size = sizeof(*(_ms_tbl));                                                                                                       \
-        size_t _ms_header_size = MAP_HEADER_SIZE(_ms_tbl ? _ms_tbl : ((_ms_tbl = 0), (_ms_tbl)));                                                        \
-        map_header *_ms_old_hdr = _ms_tbl ? MAP_HEADER(_ms_tbl) : NULL;                                                                                  \
-        size_t _ms_old_cap = _ms_tbl ? _ms_old_hdr->capacity : 0;                                                                                        \
-        void *_ms_old_ptr = _ms_tbl ? ((char *)(_ms_tbl) - MAP_HEADER_SIZE(_ms_tbl)) : NULL;                                                             \
-        map_header *_ms_new_hdr = (map_header *)malloc(MAP_HEADER_SIZE(_ms_tbl ? _ms_tbl : ((_ms_tbl = 0), _ms_tbl)) + _ms_new_cap * _ms_elem_size);     \
-        _ms_new_hdr->capacity = _ms_new_cap;                                                                                                             \
-        _ms_new_hdr->count = 0;                                                                                                                          \
-        _ms_new_hdr->load_factor = _ms_old_hdr ? _ms_old_hdr->load_factor : MAP_LOAD_FACTOR;                                                             \
-        _ms_new_hdr->growth_factor = _ms_old_hdr ? _ms_old_hdr->growth_factor : MAP_GROWTH_FACTOR_DEFAULT;                                               \
-        _ms_new_hdr->magic_number = MAP_MAGIC_NUMBER;                                                                                                    \
-        char *_ms_new_arr = (char *)_ms_new_hdr + MAP_HEADER_SIZE(_ms_tbl ? _ms_tbl : ((_ms_tbl = 0), _ms_tbl));                                         \
-        memset(_ms_new_arr, 0, _ms_new_cap * _ms_elem_size);                                                                                             \
-        if (_ms_old_ptr) {                                                                                                                               \
-            char *old_items = (char *)_ms_old_ptr + MAP_HEADER_SIZE(_ms_tbl);                                                                            \
-            for (size_t _ms_i = 0; _ms_i < _ms_old_cap; _ms_i++) {                                                                                       \
-                char *cur = old_items + _ms_i * _ms_elem_size;                                                                                           \
-                if (*((const char **)cur) != NULL) {                                                                                                     \
-                    size_t _ms = _hash_string(*((const char **)cur)) % _ms_new_cap;                                                                      \
-                    while (*((const char **)(_ms_new_arr + _ms * _ms_elem_size)) != NULL) {                                                              \
-                        _ms = (_ms + 1) % _ms_new_cap;                                                                                                   \
-                    }                                                                                                                                    \
-                    memcpy(_ms_new_arr + _ms * _ms_elem_size, cur, _ms_elem_size);                                                                       \
-                    _ms_new_hdr->count++;                                                                                                                \
-                }                                                                                                                                        \
-            }                                                                                                                                            \
-            free(_ms_old_ptr);                                                                                                                           \
-        }                                                                                                                                                \
-        (tbl) = (void *)_ms_new_arr;                                                                                                                     \
+   Resizes the hash map to new_cap buckets (rounded by _map_round_capacity)
+   and updates the map pointer; see _map_resize_impl.
+   - Callers: puts that cross the load factor (growing by growth_factor, or
+     rebuilding at the same capacity when most used buckets are tombstones),
+     map_set_min_capacity, map_shrink_to_fit, and deletes that leave fewer
+     than shrink_factor * capacity elements (see map_set_shrink_factor).
+   - The new block comes from the map's allocator (see map_set_allocator).
+     It inherits the load, growth and shrink factors, the key pool and the
+     statistics.
+   - Without MAP_INCREMENTAL_RESIZE, every element is re-inserted (with
+     Robin Hood displacement under MAP_ROBIN_HOOD) and the old block is
+     freed. With it, a pending migration is finished, the old block is kept,
+     and later operations move MAP_MIGRATE_BUCKETS buckets at a time.
+   - If the new block cannot be allocated, the map is left unchanged.
+------------------------------------------------------------------ */
+#define MAP_RESIZE(tbl, new_cap)                                                                             \
+    do {                                                                                                     \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(new_cap), size_t), "new_cap must be size_t"); \
+        (tbl) = _map_resize_impl((tbl), (new_cap), sizeof(*(tbl)), MAP_HEADER_SIZE(tbl),                     \
+                                 MAP_KEY_POLICY(tbl));                                                       \
     } while (0)
 
+/* ------------------------------------------------------------------
+   Internal macro: MAP_PUT_IMPL
+   Shared implementation of map_put_free and map_put_n_free.
+   key_len is evaluated once, after the item has been copied into _mp_item,
+   and gives the length of _mp_item.key in bytes. Items whose key is the
+   empty-bucket sentinel (NULL, 0 or all zeros) are ignored.
+   Evaluates to a pointer to the stored element, or NULL if the item was ignored
+   (or dropped because the map is full and could not grow).
+   If check_load is 0, (tbl) must not be NULL and the caller guarantees that
+   the map has room for the item (see _map_reserve_impl).
+------------------------------------------------------------------ */
+#define MAP_PUT_IMPL(tbl, item, key_len, free_func, check_load)                                                       \
+    ({                                                                                                                \
+        __typeof__(tbl) _mp_slot = NULL;                                                                              \
+        do {                                                                                                          \
+            /* Use a dummy 0 pointer cast to the type of tbl to get the element type even if tbl is NULL */           \
+            __typeof__(*( (__typeof__(tbl))0 )) _dummy;                                                               \
+            __typeof__(tbl) _mp_tbl = (tbl);                                                                          \
+            __typeof__(item) _mp_item = (item);                                                                       \
+            void (^_mp_free_func)(__typeof__(_mp_tbl[0])) =                                                           \
+                _Generic((free_func),                                                                                 \
+                    void (*)(__typeof__(_mp_tbl[0])): (free_func),  /* if a function pointer is passed */             \
+                    void (^)(__typeof__(_mp_tbl[0])): (free_func),  /* if a block is passed */                        \
+                    default: ((void (^)(__typeof__(_mp_tbl[0])))0) /* if free_func is NULL or another type */         \
+                );                                                                                                    \
+            _Static_assert(__builtin_types_compatible_p(__typeof__(_mp_item), __typeof__(*((__typeof__(tbl))0))),     \
+                           "item must be of the same type as *tbl");                                                  \
+            MAP_CHECK_KEY_TYPE(tbl);                                                                                  \
+            map_key_policy _mp_kp = MAP_KEY_POLICY(tbl);                                                              \
+            if (_map_field_is_zero(&_mp_item.key, _mp_kp.size)) {                                                     \
+                break;                                                                                                \
+            }                                                                                                         \
+            if ((check_load) && !_mp_tbl) {                                                                           \
+                _mp_tbl = _map_alloc_impl(MAP_INIT_CAPACITY, sizeof(*((__typeof__(tbl))0)), MAP_HEADER_SIZE(_mp_tbl), \
+                                          NULL);                                                                      \
+                if (!_mp_tbl) {                                                                                       \
+                    break;                                                                                            \
+                }                                                                                                     \
+            }                                                                                                         \
+            map_header *_mp_hdr = MAP_HEADER(_mp_tbl);                                                                \
+            size_t _mp_new_cap = (check_load) ? _map_grow_capacity(_mp_hdr) : 0;                                      \
+            if (_mp_new_cap) {                                                                                        \
+                MAP_RESIZE(_mp_tbl, _mp_new_cap);                                                                     \
+                _mp_hdr = MAP_HEADER(_mp_tbl);                                                                        \
+                if (_map_is_full(_mp_hdr)) {                                                                          \
+                    break;                                                                                            \
+                }                                                                                                     \
+            }                                                                                                         \
+            _map_migrate(_mp_tbl, sizeof(*(_mp_tbl)), _mp_kp, MAP_MIGRATE_BUCKETS);                                   \
+            size_t _mp_len = (key_len);                                                                               \
+            const void *_mp_key = _map_field_key(&_mp_item.key, _mp_kp);                                              \
+            size_t _mp_hash = _map_hash_key(_mp_key, _mp_len, _mp_kp);                                                \
+            size_t _mp_h = _map_find_slot(_mp_tbl, _mp_key, _mp_len, _mp_hash, sizeof(*(_mp_tbl)), _mp_kp);           \
+            const void *_mp_owned = NULL;                                                                             \
+            if (_mp_h < _mp_hdr->capacity &&                                                                          \
+                _map_bucket_full(_mp_tbl, _mp_hdr->capacity, sizeof(*(_mp_tbl)), _mp_h, _mp_kp)) {                    \
+                _mp_owned = _map_owned_key(&_mp_tbl[_mp_h], _mp_kp);                                                  \
+                if (_mp_free_func) {                                                                                  \
+                    _mp_free_func(_mp_tbl[_mp_h]);                                                                    \
+                }                                                                                                     \
+            } else {                                                                                                  \
+                __typeof__(_mp_tbl) _mp_old = _map_find_old(_mp_tbl, _mp_key, _mp_len, _mp_hash,                      \
+                                                            sizeof(*(_mp_tbl)), _mp_kp, 1);                           \
+                if (!_mp_old) {                                                                                       \
+                    _mp_hdr->count++;                                                                                 \
+                } else {                                                                                              \
+                    _mp_owned = _map_owned_key(_mp_old, _mp_kp);                                                      \
+                    if (_mp_free_func) {                                                                              \
+                        _mp_free_func(*_mp_old);                                                                      \
+                    }                                                                                                 \
+                }                                                                                                     \
+                _mp_h = _map_insert_slot(_mp_tbl, _mp_hdr->capacity, sizeof(*(_mp_tbl)), _mp_h, _mp_hash, _mp_kp);    \
+            }                                                                                                         \
+            _mp_tbl[_mp_h] = _mp_item;                                                                                \
+            _map_own_key(_mp_hdr, &_mp_tbl[_mp_h], _mp_owned, _mp_len, _mp_hash, _mp_kp);                             \
+            _map_set_meta(_mp_tbl, _mp_hdr->capacity, sizeof(*(_mp_tbl)), _mp_h, _mp_hash, _mp_len);                  \
+            _mp_slot = &_mp_tbl[_mp_h];                                                                               \
+            (tbl) = _mp_tbl;                                                                                          \
+        } while (0);                                                                                                  \
+        _mp_slot;                                                                                                     \
+    })
+
 /* ------------------------------------------------------------------
    map_put_free(tbl, item, free_func)
    Inserts a new element (or updates an existing one) in the hash map.
    - If (tbl) is NULL, a new map is allocated with MAP_INIT_CAPACITY.
-   - The element type's first field must be a pointer (const char * or char *)
-     representing the key.
+   - The element type's first field is the key: a string (const char * or char *),
+     a 4- or 8-byte integer, or a fixed-width byte array (see MAP_KEY_STRING).
    - The type of item must match the element type (i.e. *tbl).
    - If an element with the same key already exists, then:
        * If free_func is non-NULL, it is invoked with a pointer to the existing
          element to allow for any necessary cleanup (e.g. freeing allocated memory)
          before it is replaced.
        * The existing element is then replaced with the new item.
+   - Evaluates to a pointer to the stored element (valid until the map is next
+     modified), or NULL if the key is the empty-bucket sentinel, so the caller
+     does not need a separate map_get to find it. If the map has to grow and
+     its allocator fails, the map is left unchanged, and once it is too full
+     to take the item, the item is dropped and NULL is returned.
    - The free_func parameter can be provided as either a traditional function pointer
      or as a block (e.g., a block literal), as long as it accepts a single parameter
      of type (element_type) and returns void.
@@ -197,72 +1741,17 @@ static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_s
        map_put_free(table, item, my_cleanup_function);
        // Insert/update with a block callback:
        map_put_free(table, item, ^(Foo *old_item) { free(old_item->key); });
+       // Keep a pointer to the stored element:
+       Foo *stored = map_put(table, item);
 ------------------------------------------------------------------ */
-#define map_put_free(tbl, item, free_func)                                                                          \
-    do {                                                                                                            \
-        /* Use a dummy 0 pointer cast to the type of tbl to get the element type even if tbl is NULL */             \
-        __typeof__(*( (__typeof__(tbl))0 )) _dummy;                                                                 \
-        __typeof__(tbl) _mp_tbl = (tbl);                                                                            \
-        __typeof__(item) _mp_item = (item);                                                                         \
-        void (^_mp_free_func)(__typeof__(_mp_tbl[0])) =                                                             \
-            _Generic((free_func),                                                                                   \
-                void (*)(__typeof__(_mp_tbl[0])): (free_func),  /* if a function pointer is passed */               \
-                void (^)(__typeof__(_mp_tbl[0])): (free_func),  /* if a block is passed */                          \
-                default: ((void (^)(__typeof__(_mp_tbl[0])))0) /* if free_func is NULL or another type */           \
-            );                                                                                                      \
-        _Static_assert(__builtin_types_compatible_p(__typeof__(_mp_item), __typeof__(*((__typeof__(tbl))0))),       \
-                       "item must be of the same type as *tbl");                                                    \
-        _Static_assert(                                                                                             \
-            __builtin_types_compatible_p(__typeof__((_mp_item).key), char *) ||                                     \
-            __builtin_types_compatible_p(__typeof__((_mp_item).key), const char *),                                 \
-            "item.key must be a char* or const char*"                                                               \
-        );                                                                                                          \
-        if (!_mp_tbl) {                                                                                             \
-            size_t _mp_cap = MAP_INIT_CAPACITY;                                                                     \
-            size_t _mp_elem_size = sizeof(*((__typeof__(tbl))0));                                                   \
-            size_t _mp_header_size = (((sizeof(map_header) + __alignof__(*((__typeof__(tbl))0)) - 1)                \
-                / __alignof__(*((__typeof__(tbl))0))) * __alignof__(*((__typeof__(tbl))0)));                        \
-            map_header *_mp_hdr = (map_header *)malloc(_mp_header_size + _mp_cap * _mp_elem_size);                  \
-            _mp_hdr->capacity = _mp_cap;                                                                            \
-            _mp_hdr->count = 0;                                                                                     \
-            _mp_hdr->load_factor = MAP_LOAD_FACTOR;                                                                 \
-            _mp_hdr->growth_factor = MAP_GROWTH_FACTOR_DEFAULT;                                                     \
-            _mp_hdr->magic_number = MAP_MAGIC_NUMBER;                                                               \
-            _mp_tbl = (void *)((char *)_mp_hdr + _mp_header_size);                                                  \
-            memset(_mp_tbl, 0, _mp_cap * _mp_elem_size);                                                            \
-        }                                                                                                           \
-        map_header *_mp_hdr = MAP_HEADER(_mp_tbl);                                                                  \
-        if ((_mp_hdr->count + 1) >= (size_t)(_mp_hdr->capacity * _mp_hdr->load_factor)) {                           \
-            size_t _mp_new_cap = (size_t)(_mp_hdr->capacity * _mp_hdr->growth_factor);                              \
-            if (_mp_new_cap <= _mp_hdr->capacity) _mp_new_cap = _mp_hdr->capacity + 1;                              \
-            MAP_RESIZE(_mp_tbl, _mp_new_cap);                                                                       \
-            _mp_hdr = MAP_HEADER(_mp_tbl);                                                                          \
-        }                                                                                                           \
-        size_t _mp_cap = _mp_hdr->capacity;                                                                         \
-        size_t _mp_h = _hash_string(_mp_item.key) % _mp_cap;                                                        \
-        while (_mp_tbl[_mp_h].key) {                                                                                \
-            if (strcmp(_mp_tbl[_mp_h].key, _mp_item.key) == 0) {                                                    \
-                if (_mp_free_func) {                                                                                \
-                    _mp_free_func(_mp_tbl[_mp_h]);                                                                  \
-                }                                                                                                   \
-                _mp_tbl[_mp_h] = _mp_item;                                                                          \
-                break;                                                                                              \
-            }                                                                                                       \
-            _mp_h = (_mp_h + 1) % _mp_cap;                                                                          \
-        }                                                                                                           \
-        if (!_mp_tbl[_mp_h].key) {                                                                                  \
-            _mp_tbl[_mp_h] = _mp_item;                                                                              \
-            _mp_hdr->count++;                                                                                       \
-        }                                                                                                           \
-        (tbl) = _mp_tbl;                                                                                            \
-    } while (0)
+#define map_put_free(tbl, item, free_func) \
+    MAP_PUT_IMPL(tbl, item, _map_field_key_len(&_mp_item.key, _mp_kp), free_func, 1)
 
 /* ------------------------------------------------------------------
    map_put(tbl, item)
    Inserts a new element (or updates an existing one) into the hash map.
    - If (tbl) is NULL, a new map is allocated with MAP_INIT_CAPACITY.
-   - Expects that the element type's first field is a pointer (const char *)
-     holding the key.
+   - Expects that the element type's first field is the key.
    - Also checks that the type of item matches the element type (i.e. *tbl).
    Example:
        Foo item = { "apple", 10, 3.14, 'A' };
@@ -270,24 +1759,255 @@ static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_s
 ------------------------------------------------------------------ */
 #define map_put(tbl, item) map_put_free(tbl, item, NULL)
 
+/* ------------------------------------------------------------------
+   Internal function: _map_reserve_impl
+   Makes room for n more keys in tbl_void (which may be NULL) with at most
+   one resize, and finishes any pending incremental migration, so that n
+   items can then be inserted without checking the load factor.
+   Returns a pointer to the (possibly new) bucket array, which may be NULL
+   or still lack room for the n keys if memory cannot be allocated.
+------------------------------------------------------------------ */
+static inline void *_map_reserve_impl(void *tbl_void, size_t n, size_t elem_size, size_t header_size,
+                                      map_key_policy kp) {
+    if (!tbl_void && !(tbl_void = _map_alloc_impl(MAP_INIT_CAPACITY, elem_size, header_size, NULL)))
+        return NULL;
+    size_t new_cap = _map_grow_capacity_n((map_header *)((char *)tbl_void - header_size), n);
+    if (new_cap)
+        tbl_void = _map_resize_impl(tbl_void, new_cap, elem_size, header_size, kp);
+    _map_migrate(tbl_void, elem_size, kp, (size_t)-1);
+    return tbl_void;
+}
+
+/* ------------------------------------------------------------------
+   map_put_many_free(tbl, items, n, free_func)
+   map_put_many(tbl, items, n)
+   Inserts (or updates) the n elements at items, as if by calling
+   map_put_free on each of them in order.
+   - If (tbl) is NULL, a new map is allocated.
+   - The map is sized for all n items up front with at most one resize,
+     and the items are then inserted without re-checking the load factor.
+   - items must point to elements of the same type as *tbl, and must not
+     point into the map.
+   Example:
+       Foo items[3] = { { "apple", 1 }, { "pear", 2 }, { "plum", 3 } };
+       map_put_many(table, items, 3);
+------------------------------------------------------------------ */
+#define map_put_many_free(tbl, items, n, free_func)                                                                 \
+    do {                                                                                                            \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(*(items)), __typeof__(*((__typeof__(tbl))0))),       \
+                       "items must point to elements of the same type as *tbl");                                    \
+        __typeof__(tbl) _pm_tbl = (tbl);                                                                            \
+        const __typeof__(*((__typeof__(tbl))0)) *_pm_items = (items);                                               \
+        size_t _pm_n = (n);                                                                                         \
+        if (_pm_n) {                                                                                                \
+            MAP_CHECK_KEY_TYPE(tbl);                                                                                \
+            _pm_tbl = _map_reserve_impl(_pm_tbl, _pm_n, sizeof(*((__typeof__(tbl))0)), MAP_HEADER_SIZE(_pm_tbl),    \
+                                        MAP_KEY_POLICY(tbl));                                                       \
+            /* If the reserve could not allocate, every put checks the load factor itself */                        \
+            int _pm_check = !_pm_tbl || _map_grow_capacity_n(MAP_HEADER(_pm_tbl), _pm_n);                           \
+            for (size_t _pm_i = 0; _pm_i < _pm_n; _pm_i++) {                                                        \
+                MAP_PUT_IMPL(_pm_tbl, _pm_items[_pm_i], _map_field_key_len(&_mp_item.key, _mp_kp), free_func,       \
+                             _pm_check);                                                                            \
+            }                                                                                                       \
+        }                                                                                                           \
+        (tbl) = _pm_tbl;                                                                                            \
+    } while (0)
+#define map_put_many(tbl, items, n) map_put_many_free(tbl, items, n, NULL)
+
+#ifdef MAP_STORE_KEY_LEN
+/* ------------------------------------------------------------------
+   map_put_n_free(tbl, item, len, free_func)
+   map_put_n(tbl, item, len)
+   Like map_put_free/map_put, but item.key is a len-byte key that does not
+   need to be NUL-terminated (e.g. a slice of a network buffer). The map
+   stores the pointer and the length, so the key bytes must stay valid for
+   as long as the element is in the map.
+   Only available when MAP_STORE_KEY_LEN is defined, and only for string keys.
+   Example:
+       Foo item = { buf + 5, 10, 3.14, 'A' };
+       map_put_n(table, item, 12);
+------------------------------------------------------------------ */
+#define map_put_n_free(tbl, item, len, free_func)                                                          \
+    ({                                                                                                     \
+        _Static_assert(MAP_KEY_KIND(tbl) == MAP_KEY_STRING, "map_put_n requires a string key");            \
+        MAP_PUT_IMPL(tbl, item, (size_t)(len), free_func, 1);                                              \
+    })
+#define map_put_n(tbl, item, len) map_put_n_free(tbl, item, len, NULL)
+#endif
+
+/* ------------------------------------------------------------------
+   Internal macro: MAP_CHECK_KEY_ARG
+   Statically checks that a lookup key for a string-keyed map is a
+   char* or const char* (or NULL). Integer keys are converted to the key
+   type, and byte-array keys are passed as a pointer to the key bytes.
+------------------------------------------------------------------ */
+#define MAP_CHECK_KEY_ARG(tbl, key, name)                                                           \
+    _Static_assert(                                                                                 \
+        MAP_KEY_KIND(tbl) != MAP_KEY_STRING ||                                                      \
+        __builtin_types_compatible_p(__typeof__(key), char *) ||                                    \
+        __builtin_types_compatible_p(__typeof__(key), const char *) ||                              \
+        (__builtin_constant_p(key) && ((key) == 0)),                                                \
+        name " must be a char* or const char* (or NULL)"                                            \
+    )
+
 /* ------------------------------------------------------------------
    map_get(tbl, key)
    Retrieves a pointer to the element with the given key, or NULL if not found.
    The returned pointer is cast to the same type as (tbl).
+   - For string keys, key is a char* or const char*.
+   - For integer keys, key is an integer value.
+   - For byte-array keys, key points to the key bytes.
+   Examples:
+       Foo *item = map_get(table, "apple");
+       Bar *bar = map_get(by_id, 42);
+       Baz *baz = map_get(by_uuid, uuid_bytes);
+------------------------------------------------------------------ */
+#define map_get(tbl, key)                                                                           \
+    ({                                                                                              \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                    \
+        MAP_CHECK_KEY_ARG(tbl, key, "key");                                                         \
+        MAP_KEY_ARG_TYPE(tbl) _mg_key = (key);                                                      \
+        (__typeof__(tbl))_map_get_arg((tbl), &_mg_key, sizeof(*(tbl)), MAP_KEY_POLICY(tbl));        \
+    })
+
+/* ------------------------------------------------------------------
+   map_get_n(tbl, key, len)
+   Retrieves a pointer to the element whose key equals the len bytes at key,
+   or NULL if not found. key does not need to be NUL-terminated, so slices of
+   a larger buffer can be looked up without copying them.
+   Only available for string keys.
+   Example:
+       Foo *item = map_get_n(table, buf + 5, 12);
+------------------------------------------------------------------ */
+#define map_get_n(tbl, key, len)                                                                  \
+    ({                                                                                            \
+        _Static_assert(MAP_KEY_KIND(tbl) == MAP_KEY_STRING, "map_get_n requires a string key");   \
+        _Static_assert(                                                                           \
+            __builtin_types_compatible_p(__typeof__(key), char *) ||                              \
+            __builtin_types_compatible_p(__typeof__(key), const char *),                          \
+            "key must be a char* or const char*"                                                  \
+        );                                                                                        \
+        __typeof__(tbl) _mg_tbl = (tbl);                                                          \
+        const char *_mg_key = (key);                                                              \
+        _mg_tbl && _mg_key                                                                        \
+            ? (__typeof__(tbl))_map_get_impl(_mg_tbl, _mg_key, (size_t)(len), sizeof(*(_mg_tbl)), \
+                                             MAP_KEY_POLICY(tbl))                                 \
+            : NULL;                                                                               \
+    })
+
+/* ------------------------------------------------------------------
+   map_get_batch(tbl, keys, n, out)
+   Looks up n keys at once and stores a pointer to each element (or NULL if
+   it is not found) in out[0..n-1], which must have the same type as &tbl.
+   keys points to n keys given as for map_get: strings (const char *),
+   integer values, or pointers to the key bytes. Returns the number of keys
+   found.
+   For a map much larger than the cache this is faster than n calls to
+   map_get: the keys are hashed and their buckets prefetched MAP_BATCH_WIDTH
+   at a time before any probe waits on memory. The pointers are only valid
+   until the map is next modified.
+   Example:
+       const char *words[64];
+       Foo *found[64];
+       size_t hits = map_get_batch(table, words, 64, found);
+------------------------------------------------------------------ */
+#define map_get_batch(tbl, keys, n, out)                                                                      \
+    ({                                                                                                        \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                              \
+        _Static_assert(sizeof(*(keys)) == sizeof(MAP_KEY_ARG_TYPE(tbl)) &&                                    \
+                       (MAP_KEY_KIND(tbl) != MAP_KEY_STRING ||                                                \
+                        __builtin_types_compatible_p(__typeof__(*(keys)), char *) ||                          \
+                        __builtin_types_compatible_p(__typeof__(*(keys)), const char *)),                     \
+                       "keys must point to lookup keys of the map's key type (see map_get)");                 \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(*(out)), __typeof__(tbl)),                     \
+                       "out must point to pointers of the same type as tbl");                                 \
+        _map_get_batch_impl((tbl), (keys), sizeof(*(keys)), (n), (out), sizeof(*(tbl)), MAP_KEY_POLICY(tbl)); \
+    })
+
+/* ------------------------------------------------------------------
+   Internal function: _map_get_or_insert_impl
+   Finds the element whose key is described by arg (of type MAP_KEY_ARG_TYPE),
+   inserting a zeroed element holding that key if there is none, with a single
+   hash and probe. *tbl_ptr may be NULL; a bucket array that is allocated or
+   resized beforehand is stored back through tbl_ptr.
+   Sets *inserted (if non-NULL) to 1 for a new element and 0 otherwise.
+   Returns a pointer to the element, or NULL for the empty-bucket sentinel
+   key or if the map could not be allocated (or is full and could not grow).
 ------------------------------------------------------------------ */
-#define map_get(tbl, key)                                                                \
-    ({                                                                                   \
-        _Static_assert(                                                                  \
-            __builtin_types_compatible_p(__typeof__(key), char *) ||                     \
-            __builtin_types_compatible_p(__typeof__(key), const char *) ||               \
-            (__builtin_constant_p(key) && ((key) == 0)),                                 \
-            "key must be a char* or const char* (or NULL)"                               \
-        );                                                                               \
-        __typeof__(tbl) _mg_tbl = (tbl);                                                 \
-        const char *_mg_key = (key);                                                     \
-        _mg_tbl && _mg_key                                                               \
-            ? (__typeof__(tbl))_map_get_impl(_mg_tbl, _mg_key, sizeof(*(_mg_tbl)))       \
-            : NULL;                                                                      \
+static inline void *_map_get_or_insert_impl(void **tbl_ptr, const void *arg, size_t elem_size, size_t header_size,
+                                            map_key_policy kp, int *inserted) {
+    const void *key = _map_arg_key(arg, kp);
+    if (inserted)
+        *inserted = 0;
+    if (!key || (kp.kind != MAP_KEY_STRING && _map_field_is_zero(key, kp.size)))
+        return NULL;
+    char *tbl = *tbl_ptr;
+    if (!tbl && !(tbl = _map_alloc_impl(MAP_INIT_CAPACITY, elem_size, header_size, NULL)))
+        return NULL;
+    map_header *hdr = (map_header *)(tbl - header_size);
+    size_t new_cap = _map_grow_capacity(hdr);
+    if (new_cap) {
+        tbl = _map_resize_impl(tbl, new_cap, elem_size, header_size, kp);
+        hdr = (map_header *)(tbl - header_size);
+    }
+    *tbl_ptr = tbl;
+    if (_map_is_full(hdr))
+        return NULL;
+    _map_migrate(tbl, elem_size, kp, MAP_MIGRATE_BUCKETS);
+    size_t len = _map_arg_key_len(arg, kp);
+    size_t hash = _map_hash_key(key, len, kp);
+    size_t h = _map_find_slot(tbl, key, len, hash, elem_size, kp);
+    if (h < hdr->capacity && _map_bucket_full(tbl, hdr->capacity, elem_size, h, kp))
+        return tbl + h * elem_size;
+    const void *old = _map_find_old(tbl, key, len, hash, elem_size, kp, 1);
+    h = _map_insert_slot(tbl, hdr->capacity, elem_size, h, hash, kp);
+    char *elem = tbl + h * elem_size;
+    if (old) {
+        memcpy(elem, old, elem_size);
+    } else {
+        memset(elem, 0, elem_size);
+        if (kp.kind == MAP_KEY_STRING)
+            memcpy(elem, &key, sizeof(key));
+        else
+            memcpy(elem, key, kp.size);
+        _map_own_key(hdr, elem, NULL, len, hash, kp);
+        hdr->count++;
+        if (inserted)
+            *inserted = 1;
+    }
+    _map_set_meta(tbl, hdr->capacity, elem_size, h, hash, len);
+    return elem;
+}
+
+/* ------------------------------------------------------------------
+   map_get_or_insert(tbl, key, inserted)
+   Returns a pointer to the element with the given key, inserting it first if
+   it is not in the map, so that a lookup followed by an insert costs a single
+   hash and probe. The pointer is cast to the same type as (tbl).
+   - If (tbl) is NULL, a new map is allocated with MAP_INIT_CAPACITY.
+   - A new element has its key set to key and all other fields zeroed.
+     For string keys the map stores the key pointer as map_put does (or a
+     pooled copy of it with MAP_OWN_KEYS).
+   - inserted is an int * (or NULL) that is set to 1 if the element is new
+     and to 0 if it already existed.
+   - Returns NULL if key is the empty-bucket sentinel (NULL or 0).
+   - The pointer is valid until the map is next modified.
+   Example:
+       int inserted;
+       Counter *c = map_get_or_insert(counts, word, &inserted);
+       c->n++;
+------------------------------------------------------------------ */
+#define map_get_or_insert(tbl, key, inserted)                                                              \
+    ({                                                                                                     \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                           \
+        MAP_CHECK_KEY_ARG(tbl, key, "key");                                                                \
+        MAP_KEY_ARG_TYPE(tbl) _gi_key = (key);                                                             \
+        void *_gi_tbl = (tbl);                                                                             \
+        __typeof__(tbl) _gi_elem = _map_get_or_insert_impl(&_gi_tbl, &_gi_key, sizeof(*(tbl)),             \
+                                                           MAP_HEADER_SIZE(tbl), MAP_KEY_POLICY(tbl),      \
+                                                           (inserted));                                    \
+        (tbl) = _gi_tbl;                                                                                   \
+        _gi_elem;                                                                                          \
     })
 
 /* ------------------------------------------------------------------
@@ -305,17 +2025,7 @@ static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_s
         __typeof__(tbl) _m_tbl = (tbl);                                                                           \
         if (!_m_tbl) {                                                                                            \
             size_t _m_cap = _m_min_cap > MAP_INIT_CAPACITY ? _m_min_cap : MAP_INIT_CAPACITY;                      \
-            size_t _m_elem_size = sizeof(*((__typeof__(tbl))0));                                                  \
-            size_t _m_header_size = (((sizeof(map_header) + __alignof__(*((__typeof__(tbl))0)) - 1)               \
-                / __alignof__(*((__typeof__(tbl))0))) * __alignof__(*((__typeof__(tbl))0)));                      \
-            map_header *_m_hdr = (map_header *)malloc(_m_header_size + _m_cap * _m_elem_size);                    \
-            _m_hdr->capacity = _m_cap;                                                                            \
-            _m_hdr->count = 0;                                                                                    \
-            _m_hdr->load_factor = MAP_LOAD_FACTOR;                                                                \
-            _m_hdr->growth_factor = MAP_GROWTH_FACTOR_DEFAULT;                                                    \
-            _m_hdr->magic_number = MAP_MAGIC_NUMBER;                                                              \
-            _m_tbl = (void *)((char *)_m_hdr + _m_header_size);                                                   \
-            memset(_m_tbl, 0, _m_cap * _m_elem_size);                                                             \
+            _m_tbl = _map_alloc_impl(_m_cap, sizeof(*((__typeof__(tbl))0)), MAP_HEADER_SIZE(_m_tbl), NULL);       \
         } else {                                                                                                  \
             map_header *_m_hdr = MAP_HEADER(_m_tbl);                                                              \
             if (_m_hdr->capacity < _m_min_cap) {                                                                  \
@@ -338,7 +2048,9 @@ static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_s
         _Static_assert(__builtin_types_compatible_p(__typeof__(factor), double), "factor must be double");     \
         __typeof__(tbl) _mg_tbl = (tbl);                                                                       \
         if (_mg_tbl) {                                                                                         \
-            MAP_HEADER(_mg_tbl)->growth_factor = (factor);                                                     \
+            map_header *_mg_hdr = MAP_HEADER(_mg_tbl);                                                         \
+            _mg_hdr->growth_factor = (factor);                                                                 \
+            _map_update_threshold(_mg_hdr);                                                                    \
         }                                                                                                      \
     } while (0)
 
@@ -346,7 +2058,9 @@ static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_s
    map_set_load_factor(tbl, factor)
    Sets the load factor for the hash map.
    The load factor determines the threshold at which the map will be resized.
-   The value is stored in the map's header and used for future resize decisions.
+   The value is stored in the map's header, together with the number of used
+   buckets that it allows at the current capacity, and used for future resize
+   decisions.
    Example:
        map_set_load_factor(table, 0.8);
 ------------------------------------------------------------------ */
@@ -355,57 +2069,386 @@ static inline void *_map_get_impl(void *tbl_void, const char *key, size_t elem_s
         _Static_assert(__builtin_types_compatible_p(__typeof__(factor), double), "factor must be double");     \
         __typeof__(tbl) _ml_tbl = (tbl);                                                                       \
         if (_ml_tbl) {                                                                                         \
-            MAP_HEADER(_ml_tbl)->load_factor = (factor);                                                       \
+            map_header *_ml_hdr = MAP_HEADER(_ml_tbl);                                                         \
+            _ml_hdr->load_factor = (factor);                                                                   \
+            _map_update_threshold(_ml_hdr);                                                                    \
+        }                                                                                                      \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   map_set_shrink_factor(tbl, factor)
+   Sets the shrink factor for the hash map: once a delete leaves fewer than
+   factor * capacity elements, the map is resized until it is load_factor /
+   growth_factor full (but to no fewer than MAP_INIT_CAPACITY buckets).
+   0.0 turns shrinking off. factor is capped at load_factor / (2 *
+   growth_factor), also when either of those changes later, so that a
+   shrunk map has to lose half its elements before it shrinks again and
+   draining it costs O(n) overall.
+   Example:
+       map_set_shrink_factor(table, 0.1);
+------------------------------------------------------------------ */
+#define map_set_shrink_factor(tbl, factor)                                                                     \
+    do {                                                                                                       \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(factor), double), "factor must be double");     \
+        __typeof__(tbl) _ms_tbl = (tbl);                                                                       \
+        if (_ms_tbl) {                                                                                         \
+            map_header *_ms_hdr = MAP_HEADER(_ms_tbl);                                                         \
+            _ms_hdr->shrink_factor = (factor);                                                                 \
+            _map_update_threshold(_ms_hdr);                                                                    \
+        }                                                                                                      \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   map_shrink_to_fit(tbl)
+   Resizes the hash map to the smallest capacity that holds its elements
+   (and one more) within the load factor, giving the rest of its memory
+   back to its allocator and dropping any tombstones. Pointers to elements
+   are invalidated. If (tbl) is NULL, or no smaller capacity fits, no
+   action is taken.
+   Example:
+       map_shrink_to_fit(table);
+------------------------------------------------------------------ */
+#define map_shrink_to_fit(tbl)                                                                                 \
+    do {                                                                                                       \
+        __typeof__(tbl) _mf_tbl = (tbl);                                                                       \
+        if (_mf_tbl) {                                                                                         \
+            size_t _mf_new_cap = _map_fit_capacity(MAP_HEADER(_mf_tbl), 1);                                    \
+            if (_mf_new_cap) {                                                                                 \
+                MAP_RESIZE(_mf_tbl, _mf_new_cap);                                                              \
+            }                                                                                                  \
         }                                                                                                      \
+        (tbl) = _mf_tbl;                                                                                       \
+    } while (0)
+
+/* Returns the distance between the element in (full) bucket idx and its home bucket */
+static inline size_t _map_bucket_dist(void *tbl, size_t cap, size_t elem_size, size_t idx, map_key_policy kp) {
+#ifdef MAP_ROBIN_HOOD
+    (void)kp;
+    return _map_dists(tbl, cap, elem_size)[idx];
+#else
+    return _map_probe_dist(_map_bucket_hash(tbl, cap, elem_size, idx, kp), idx, cap);
+#endif
+}
+
+/* Returns the largest distance between any element and its home bucket */
+static inline size_t _map_max_probe_length_impl(void *tbl, size_t elem_size, map_key_policy kp) {
+    if (!tbl)
+        return 0;
+    size_t cap = MAP_HEADER(tbl)->capacity;
+    size_t max = 0;
+    for (size_t i = 0; i < cap; i++) {
+        if (!_map_bucket_full(tbl, cap, elem_size, i, kp))
+            continue;
+        size_t dist = _map_bucket_dist(tbl, cap, elem_size, i, kp);
+        if (dist > max)
+            max = dist;
+    }
+    return max;
+}
+
+/* ------------------------------------------------------------------
+   map_max_probe_length(tbl)
+   Returns the largest number of buckets any element is stored past its
+   home bucket (0 if every element is in its home bucket, or if tbl is NULL).
+   A lookup of a present key touches at most this many buckets plus one.
+   With MAP_ROBIN_HOOD this reads the stored probe distances; otherwise
+   each element's home bucket is recomputed from its (cached) hash.
+   Example:
+       size_t worst = map_max_probe_length(table);
+------------------------------------------------------------------ */
+#define map_max_probe_length(tbl) _map_max_probe_length_impl((tbl), sizeof(*(tbl)), MAP_KEY_POLICY(tbl))
+
+/* A summary of a map, as returned by map_stats.
+ * Fields:
+ *   - counters:          The SIMPLE_MAP_STATS counters (all 0 without SIMPLE_MAP_STATS).
+ *   - count, capacity:   As map_count and map_capacity.
+ *   - tombstones:        Buckets holding tombstones (MAP_TOMBSTONES only).
+ *   - clusters:          Runs of consecutive used (full or tombstone) buckets.
+ *   - max_cluster:       Number of buckets in the longest run.
+ *   - max_probe_length:  As map_max_probe_length.
+ *   - mean_cluster:      Average number of buckets in a run.
+ *   - mean_probe_length: Average distance of an element from its home bucket.
+ */
+typedef struct {
+    map_stats_counters counters;
+    size_t count;
+    size_t capacity;
+    size_t tombstones;
+    size_t clusters;
+    size_t max_cluster;
+    size_t max_probe_length;
+    double mean_cluster;
+    double mean_probe_length;
+} map_stats_report;
+
+/* Returns non-zero if bucket idx holds an element or a tombstone, i.e. if probes go past it */
+static inline int _map_bucket_used(void *tbl, size_t cap, size_t elem_size, size_t idx, map_key_policy kp) {
+#ifdef MAP_CONTROL_BYTES
+    (void)kp;
+    return _map_ctrl(tbl, cap, elem_size)[idx] != MAP_CTRL_EMPTY;
+#else
+    return _map_bucket_full(tbl, cap, elem_size, idx, kp);
+#endif
+}
+
+static inline void _map_hist_add(size_t *hist, size_t n, size_t value) {
+    if (hist && n)
+        hist[value < n ? value : n - 1]++;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_stats_impl
+   Walks every bucket of tbl (which may be NULL) once, finishing a pending
+   incremental migration first, and fills in report. If probe_hist is not
+   NULL, its probe_n entries count the elements at each distance from their
+   home bucket; if cluster_hist is not NULL, its cluster_n entries count the
+   runs of used buckets of each length. The last entry of each histogram
+   also counts every larger value. Runs are cyclic, so one that wraps past
+   the last bucket is counted once.
+------------------------------------------------------------------ */
+static inline void _map_stats_impl(void *tbl, size_t elem_size, map_key_policy kp, map_stats_report *report,
+                                   size_t *probe_hist, size_t probe_n, size_t *cluster_hist, size_t cluster_n) {
+    memset(report, 0, sizeof(*report));
+    if (probe_hist)
+        memset(probe_hist, 0, probe_n * sizeof(*probe_hist));
+    if (cluster_hist)
+        memset(cluster_hist, 0, cluster_n * sizeof(*cluster_hist));
+    if (!tbl)
+        return;
+    _map_migrate(tbl, elem_size, kp, (size_t)-1);
+    map_header *hdr = MAP_HEADER((char *)tbl);
+    size_t cap = hdr->capacity;
+#ifdef SIMPLE_MAP_STATS
+    map_header snapshot;
+    _map_copy_header(&snapshot, hdr);
+    report->counters = snapshot.stats;
+#endif
+    report->count = hdr->count;
+    report->capacity = cap;
+#ifdef MAP_TOMBSTONES
+    report->tombstones = hdr->deleted;
+#endif
+    /* Start right after an unused bucket, so that no run is split by the wrap-around */
+    size_t start = 0;
+    while (start < cap && _map_bucket_used(tbl, cap, elem_size, start, kp))
+        start++;
+    size_t total_dist = 0, used = 0, run = 0;
+    for (size_t step = 1; step <= cap; step++) {
+        size_t i = (start + step) % cap;
+        if (_map_bucket_used(tbl, cap, elem_size, i, kp)) {
+            run++;
+            used++;
+            if (_map_bucket_full(tbl, cap, elem_size, i, kp)) {
+                size_t dist = _map_bucket_dist(tbl, cap, elem_size, i, kp);
+                total_dist += dist;
+                if (dist > report->max_probe_length)
+                    report->max_probe_length = dist;
+                _map_hist_add(probe_hist, probe_n, dist);
+            }
+        }
+        if (run && (!_map_bucket_used(tbl, cap, elem_size, i, kp) || step == cap)) {
+            report->clusters++;
+            if (run > report->max_cluster)
+                report->max_cluster = run;
+            _map_hist_add(cluster_hist, cluster_n, run);
+            run = 0;
+        }
+    }
+    if (report->clusters)
+        report->mean_cluster = (double)used / (double)report->clusters;
+    if (report->count)
+        report->mean_probe_length = (double)total_dist / (double)report->count;
+}
+
+/* ------------------------------------------------------------------
+   map_stats(tbl)
+   Returns a map_stats_report for the map: its counters (when compiled
+   with SIMPLE_MAP_STATS) and the cluster and probe length figures of a
+   walk over every bucket. A pending incremental migration is finished
+   first. If (tbl) is NULL, every field is 0.
+   SIMPLE_MAP_STATS counts, for the lifetime of the map (including across
+   resizes, and inherited by map_dup copies): probe sequences and the
+   buckets and keys they examined, resizes and the bytes they moved, and
+   the largest displacement of any stored element. Without it, the header
+   has no counters and the probe loops do no extra work.
+   Example:
+       map_stats_report st = map_stats(table);
+       printf("%.2f probes per lookup\n", (double)st.counters.probes / st.counters.lookups);
+------------------------------------------------------------------ */
+#define map_stats(tbl)                                                                              \
+    ({                                                                                              \
+        map_stats_report _ms_report;                                                                \
+        _map_stats_impl((tbl), sizeof(*(tbl)), MAP_KEY_POLICY(tbl), &_ms_report, NULL, 0, NULL, 0); \
+        _ms_report;                                                                                 \
+    })
+
+/* ------------------------------------------------------------------
+   map_probe_histogram(tbl, hist, n)
+   map_cluster_histogram(tbl, hist, n)
+   Fill the n size_t entries at hist with a distribution over the map's
+   buckets and return the number of values counted. map_probe_histogram
+   counts in hist[d] the elements stored d buckets past their home bucket
+   (so it returns map_count). map_cluster_histogram counts in hist[k] the
+   runs of k consecutive used (full or tombstone) buckets (hist[0] stays
+   0) and returns the number of runs. The last entry also counts every
+   larger value. A pending incremental migration is finished first.
+   Example:
+       size_t hist[16];
+       map_probe_histogram(table, hist, 16);
+------------------------------------------------------------------ */
+#define map_probe_histogram(tbl, hist, n)                                                               \
+    ({                                                                                                  \
+        map_stats_report _mh_report;                                                                    \
+        _map_stats_impl((tbl), sizeof(*(tbl)), MAP_KEY_POLICY(tbl), &_mh_report, (hist), (n), NULL, 0); \
+        _mh_report.count;                                                                               \
+    })
+
+#define map_cluster_histogram(tbl, hist, n)                                                             \
+    ({                                                                                                  \
+        map_stats_report _mh_report;                                                                    \
+        _map_stats_impl((tbl), sizeof(*(tbl)), MAP_KEY_POLICY(tbl), &_mh_report, NULL, 0, (hist), (n)); \
+        _mh_report.clusters;                                                                            \
+    })
+
+/* ------------------------------------------------------------------
+   map_stats_reset(tbl)
+   Zeroes the SIMPLE_MAP_STATS counters of the map (no action without
+   SIMPLE_MAP_STATS, or if (tbl) is NULL).
+------------------------------------------------------------------ */
+#ifdef SIMPLE_MAP_STATS
+#define map_stats_reset(tbl)                                                                     \
+    do {                                                                                         \
+        if (tbl) {                                                                               \
+            size_t *_sr_stats = (size_t *)&MAP_HEADER(tbl)->stats;                               \
+            for (size_t _sr_i = 0; _sr_i < sizeof(map_stats_counters) / sizeof(size_t); _sr_i++) \
+                __atomic_store_n(&_sr_stats[_sr_i], 0, __ATOMIC_RELAXED);                        \
+        }                                                                                        \
     } while (0)
+#else
+#define map_stats_reset(tbl) ((void)(tbl))
+#endif
+
+/* Returns non-zero if an element in bucket j whose home bucket is home can be moved
+   back to bucket hole, i.e. if home is not in the cyclic range (hole, j] */
+static inline int _map_can_shift(size_t home, size_t hole, size_t j) {
+    if (hole <= j)
+        return home <= hole || home > j;
+    return home <= hole && home > j;
+}
 
-/* New helper function that deletes the element at a given index and rehashes subsequent items. */
-static inline void map_delete_impl_idx(void *tbl_void, size_t elem_size, size_t idx) {
+/* ------------------------------------------------------------------
+   Internal function: map_delete_impl_idx
+   Deletes the element at bucket idx.
+   - With MAP_TOMBSTONES, the bucket is marked deleted (or empty, if the
+     next bucket is empty) and reclaimed by a later insert or resize.
+   - Otherwise the rest of the cluster is compacted by backward shifting:
+     each following element is moved into the hole only if that keeps it
+     reachable from its home bucket, without rehashing or re-probing. The
+     home buckets come from the cached hashes when MAP_CACHE_HASH is defined.
+------------------------------------------------------------------ */
+static inline void map_delete_impl_idx(void *tbl_void, size_t elem_size, size_t idx, map_key_policy kp) {
     char *tbl = (char *)tbl_void;
     map_header *hdr = MAP_HEADER(tbl);
     size_t cap = hdr->capacity;
-    /* Remove the element at the given index */
-    void *elem_ptr = tbl + idx * elem_size;
-    *((const char **)elem_ptr) = NULL;
     hdr->count--;
-
-    /* Rehash items in the cluster that follow the deleted element */
-    size_t j = (idx + 1) % cap;
-    while (1) {
-        void *item_ptr = tbl + j * elem_size;
-        const char *ik = *((const char **)item_ptr);
-        if (!ik)
-            break;
-        /* Copy the item into a temporary buffer */
-        char temp[elem_size];
-        memcpy(temp, item_ptr, elem_size);
-        /* Clear the bucket */
-        *((const char **)item_ptr) = NULL;
-        hdr->count--;
-        /* Find new position for the copied item */
-        size_t new_idx = _hash_string(*((const char **)temp)) % cap;
-        while (1) {
-            void *new_item_ptr = tbl + new_idx * elem_size;
-            if (!*((const char **)new_item_ptr))
-                break;
-            new_idx = (new_idx + 1) % cap;
+#if defined(MAP_ROBIN_HOOD)
+    /* Shift the following elements back by one until one is already in its home bucket */
+    uint32_t *dists = _map_dists(tbl, cap, elem_size);
+    size_t next = _map_next(idx, cap);
+    while (_map_bucket_full(tbl, cap, elem_size, next, kp) && dists[next] > 0) {
+        _map_move_bucket(tbl, cap, elem_size, next, idx);
+        dists[idx]--;
+        idx = next;
+        next = _map_next(next, cap);
+    }
+    _map_clear_bucket(tbl, cap, elem_size, idx, kp);
+#elif defined(MAP_TOMBSTONES)
+    /* A probe that reaches idx would stop at the next bucket anyway if it is empty */
+    uint8_t *ctrl = _map_ctrl(tbl, cap, elem_size);
+    int keep_probing = ctrl[_map_next(idx, cap)] != MAP_CTRL_EMPTY;
+    _map_clear_bucket(tbl, cap, elem_size, idx, kp);
+    if (keep_probing) {
+        _map_set_ctrl(ctrl, cap, idx, MAP_CTRL_DELETED);
+        hdr->deleted++;
+    }
+#else
+    size_t hole = idx;
+    for (size_t j = _map_next(idx, cap); _map_bucket_full(tbl, cap, elem_size, j, kp); j = _map_next(j, cap)) {
+        size_t home = _map_home(_map_bucket_hash(tbl, cap, elem_size, j, kp), cap);
+        if (_map_can_shift(home, hole, j)) {
+            _map_move_bucket(tbl, cap, elem_size, j, hole);
+            hole = j;
         }
-        memcpy(tbl + new_idx * elem_size, temp, elem_size);
-        hdr->count++;
-        j = (j + 1) % cap;
     }
+    _map_clear_bucket(tbl, cap, elem_size, hole, kp);
+#endif
 }
 
+/* ------------------------------------------------------------------
+   Internal macro: MAP_DELETE_IMPL
+   Shared implementation of map_delete_free and map_delete_n_free.
+   key_len is evaluated once, after the lookup key has been copied into
+   _md_arg (of type MAP_KEY_ARG_TYPE), and gives the length of the key in bytes.
+------------------------------------------------------------------ */
+#define MAP_DELETE_IMPL(tbl, lookup_key, key_len, free_func)                                          \
+    do {                                                                                              \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                      \
+        MAP_CHECK_KEY_ARG(tbl, lookup_key, "lookup_key");                                             \
+        __typeof__(tbl) _md_tbl = (tbl);                                                              \
+        map_key_policy _md_kp = MAP_KEY_POLICY(tbl);                                                  \
+        MAP_KEY_ARG_TYPE(tbl) _md_arg = (lookup_key);                                                 \
+        const void *_md_key = _map_arg_key(&_md_arg, _md_kp);                                         \
+        void (^_md_free_func)(__typeof__(_md_tbl[0])) =                                               \
+            _Generic((free_func),                                                                     \
+                void (*)(__typeof__(_md_tbl[0])): (free_func),                                        \
+                void (^)(__typeof__(_md_tbl[0])): (free_func),                                        \
+                default: ((void (^)(__typeof__(_md_tbl[0])))0)                                        \
+            );                                                                                        \
+        if (_md_tbl && _md_key) {                                                                     \
+            _map_migrate(_md_tbl, sizeof(*(_md_tbl)), _md_kp, MAP_MIGRATE_BUCKETS);                   \
+            size_t _md_len = (key_len);                                                               \
+            size_t _md_cap = MAP_HEADER(_md_tbl)->capacity;                                           \
+            size_t _md_hash = _map_hash_key(_md_key, _md_len, _md_kp);                                \
+            size_t _md_idx = _map_find_slot(_md_tbl, _md_key, _md_len, _md_hash,                      \
+                                            sizeof(*(_md_tbl)), _md_kp);                              \
+            int _md_found = _md_idx < _md_cap &&                                                      \
+                            _map_bucket_full(_md_tbl, _md_cap, sizeof(*(_md_tbl)), _md_idx, _md_kp);  \
+            if (_md_found) {                                                                          \
+                __typeof__(_md_tbl[0]) _temp_elem = _md_tbl[_md_idx];                                 \
+                if (_md_free_func) {                                                                  \
+                    _md_free_func(_temp_elem);                                                        \
+                }                                                                                     \
+                map_delete_impl_idx((void *)_md_tbl, sizeof(*(_md_tbl)), _md_idx, _md_kp);            \
+            } else {                                                                                  \
+                __typeof__(_md_tbl) _md_old = _map_find_old(_md_tbl, _md_key, _md_len, _md_hash,      \
+                                                            sizeof(*(_md_tbl)), _md_kp, 1);           \
+                if (_md_old) {                                                                        \
+                    if (_md_free_func) {                                                              \
+                        _md_free_func(*_md_old);                                                      \
+                    }                                                                                 \
+                    MAP_HEADER(_md_tbl)->count--;                                                     \
+                }                                                                                     \
+            }                                                                                         \
+            size_t _md_new_cap = _map_shrink_capacity(MAP_HEADER(_md_tbl));                           \
+            if (_md_new_cap) {                                                                        \
+                MAP_RESIZE(_md_tbl, _md_new_cap);                                                     \
+            }                                                                                         \
+        }                                                                                             \
+        (tbl) = _md_tbl;                                                                              \
+    } while (0)
+
 /* ------------------------------------------------------------------
    map_delete_free(tbl, key, free_func)
    Removes the element with the given key from the hash map.
    - If (tbl) is NULL, no action is taken.
-   - The key must be a char* or const char*.
+   - The key is given as for map_get.
    - If an element with the given key is found:
          * If free_func is non-NULL, it is invoked with the existing element
            to allow for any necessary cleanup (e.g. freeing allocated memory)
            before it is removed.
          * The element is then removed from the hash map.
+   - The map may then shrink (see map_set_shrink_factor), which invalidates
+     pointers to its elements.
    - The free_func parameter may be provided as either a traditional function pointer
      or as a block (e.g. a block literal), as long as it accepts a single parameter of
      type (element_type) and returns void.
@@ -423,46 +2466,8 @@ static inline void map_delete_impl_idx(void *tbl_void, size_t elem_size, size_t
        // Remove an element with a cleanup callback (block):
        map_delete_free(table, "apple", ^(Foo old_item) { free(old_item->key); });
 ------------------------------------------------------------------ */
-#define map_delete_free(tbl, lookup_key, free_func)                                   \
-    do {                                                                              \
-        _Static_assert(                                                               \
-            __builtin_types_compatible_p(__typeof__(lookup_key), char *) ||           \
-            __builtin_types_compatible_p(__typeof__(lookup_key), const char *) ||     \
-            (__builtin_constant_p(lookup_key) && ((lookup_key) == 0)),                \
-            "lookup_key must be a char* or const char* (or NULL)"                     \
-        );                                                                            \
-        __typeof__(tbl) _md_tbl = (tbl);                                              \
-        const char *_md_key = (lookup_key);                                           \
-        void (^_md_free_func)(__typeof__(_md_tbl[0])) =                               \
-            _Generic((free_func),                                                     \
-                void (*)(__typeof__(_md_tbl[0])): (free_func),                        \
-                void (^)(__typeof__(_md_tbl[0])): (free_func),                        \
-                default: ((void (^)(__typeof__(_md_tbl[0])))0)                        \
-            );                                                                        \
-        if (_md_tbl) {                                                                \
-            size_t _md_cap = MAP_HEADER(_md_tbl)->capacity;                           \
-            size_t _md_idx = _hash_string(_md_key) % _md_cap;                         \
-            int _md_found = 0;                                                        \
-            for (;;) {                                                                \
-                if (!_md_tbl[_md_idx].key) {                                          \
-                    break;                                                            \
-                }                                                                     \
-                if (strcmp(_md_tbl[_md_idx].key, _md_key) == 0) {                     \
-                    _md_found = 1;                                                    \
-                    break;                                                            \
-                }                                                                     \
-                _md_idx = (_md_idx + 1) % _md_cap;                                    \
-            }                                                                         \
-            if (_md_found) {                                                          \
-                __typeof__(_md_tbl[0]) _temp_elem = _md_tbl[_md_idx];                 \
-                if (_md_free_func) {                                                  \
-                    _md_free_func(_temp_elem);                                        \
-                }                                                                     \
-                map_delete_impl_idx((void *)_md_tbl, sizeof(*(_md_tbl)), _md_idx);    \
-            }                                                                         \
-        }                                                                             \
-        (tbl) = _md_tbl;                                                              \
-    } while (0)
+#define map_delete_free(tbl, lookup_key, free_func) \
+    MAP_DELETE_IMPL(tbl, lookup_key, _map_arg_key_len(&_md_arg, _md_kp), free_func)
 
 /* ------------------------------------------------------------------
    map_delete(tbl, key)
@@ -472,41 +2477,198 @@ static inline void map_delete_impl_idx(void *tbl_void, size_t elem_size, size_t
 ------------------------------------------------------------------ */
 #define map_delete(tbl, key) map_delete_free(tbl, key, NULL)
 
+/* ------------------------------------------------------------------
+   map_delete_n_free(tbl, key, len, free_func)
+   map_delete_n(tbl, key, len)
+   Like map_delete_free/map_delete, but the key is given as len bytes that
+   do not need to be NUL-terminated. Only available for string keys.
+   Example:
+       map_delete_n(table, buf + 5, 12);
+------------------------------------------------------------------ */
+#define map_delete_n_free(tbl, key, len, free_func)                                                        \
+    do {                                                                                                   \
+        _Static_assert(MAP_KEY_KIND(tbl) == MAP_KEY_STRING, "map_delete_n requires a string key");         \
+        MAP_DELETE_IMPL(tbl, key, (size_t)(len), free_func);                                               \
+    } while (0)
+#define map_delete_n(tbl, key, len) map_delete_n_free(tbl, key, len, NULL)
+
+/* ------------------------------------------------------------------
+   Internal function: _map_set_allocator_impl
+   Moves the block of tbl (which must not be NULL) to memory from allocator,
+   finishing a pending incremental migration first.
+   Returns a pointer to the moved bucket array, or tbl if allocation fails.
+------------------------------------------------------------------ */
+static inline void *_map_set_allocator_impl(void *tbl, size_t elem_size, size_t header_size, map_key_policy kp,
+                                            const simple_allocator *allocator) {
+    _map_migrate(tbl, elem_size, kp, (size_t)-1);
+    map_header *old_hdr = (map_header *)((char *)tbl - header_size);
+    size_t size = header_size + _map_data_size(old_hdr->capacity, elem_size);
+    map_header *new_hdr = (map_header *)simple_ds_malloc(allocator, size);
+    if (!new_hdr)
+        return tbl;
+    memcpy(new_hdr, old_hdr, size);
+    new_hdr->allocator = allocator;
+    simple_ds_free(old_hdr->allocator, old_hdr, size);
+    return (char *)new_hdr + header_size;
+}
+
+/* ------------------------------------------------------------------
+   map_set_allocator(tbl, allocator)
+   Binds the map to allocator (a const simple_allocator *, or NULL for
+   SIMPLE_DS_MALLOC and friends), which is then used for every later
+   allocation of the map, including resizes, map_dup and map_free.
+   - If (tbl) is NULL, an empty map with MAP_INIT_CAPACITY is allocated from it.
+   - Otherwise, the map's block is moved to memory from allocator.
+   Example:
+       map_set_allocator(table, simple_arena_allocator(&arena));
+------------------------------------------------------------------ */
+#define map_set_allocator(tbl, alloc)                                                                  \
+    do {                                                                                               \
+        const simple_allocator *_sa_allocator = (alloc);                                               \
+        __typeof__(tbl) _sa_tbl = (tbl);                                                               \
+        if (!_sa_tbl) {                                                                                \
+            _sa_tbl = _map_alloc_impl(MAP_INIT_CAPACITY, sizeof(*(_sa_tbl)), MAP_HEADER_SIZE(_sa_tbl), \
+                                      _sa_allocator);                                                  \
+        } else {                                                                                       \
+            _sa_tbl = _map_set_allocator_impl(_sa_tbl, sizeof(*(_sa_tbl)), MAP_HEADER_SIZE(_sa_tbl),   \
+                                              MAP_KEY_POLICY(tbl), _sa_allocator);                     \
+        }                                                                                              \
+        (tbl) = _sa_tbl;                                                                               \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   Internal function: _map_next_impl
+   Returns the first element stored after it in bucket order (the first
+   element of tbl if it is NULL), or NULL if there is none. Empty buckets
+   are skipped 64 at a time using the control bytes or occupancy bitmap.
+   Starting an iteration finishes any pending incremental migration.
+------------------------------------------------------------------ */
+static inline void *_map_next_impl(void *tbl, const void *it, size_t elem_size, map_key_policy kp) {
+    if (!tbl)
+        return NULL;
+    size_t idx = 0;
+    if (it)
+        idx = (size_t)((const char *)it - (char *)tbl) / elem_size + 1;
+    else
+        _map_migrate(tbl, elem_size, kp, (size_t)-1);
+    size_t cap = MAP_HEADER((char *)tbl)->capacity;
+    idx = _map_next_full(tbl, cap, elem_size, idx);
+    return idx < cap ? (char *)tbl + idx * elem_size : NULL;
+}
+
+/* ------------------------------------------------------------------
+   map_next(tbl, it)
+   Returns a pointer to the element after it (or the first element if it
+   is NULL), or NULL once every element has been visited. Elements are
+   visited in bucket order.
+   - The map must not be modified while it is being iterated, except for
+     updating the non-key fields of visited elements.
+   Example:
+       for (Foo *it = map_next(table, NULL); it; it = map_next(table, it))
+           printf("%s\n", it->key);
+------------------------------------------------------------------ */
+#define map_next(tbl, it) \
+    ((__typeof__(tbl))_map_next_impl((tbl), (it), sizeof(*(tbl)), MAP_KEY_POLICY(tbl)))
+
+/* ------------------------------------------------------------------
+   map_foreach(tbl, it)
+   Loops over every element of the map, declaring it as a pointer to the
+   current element (see map_next for the rules on modifying the map).
+   Example:
+       map_foreach(table, it) {
+           total += it->value;
+       }
+------------------------------------------------------------------ */
+#define map_foreach(tbl, it) \
+    for (__typeof__(tbl) it = map_next(tbl, NULL); it; it = map_next(tbl, it))
+
+/* ------------------------------------------------------------------
+   Internal function: _map_dup_impl
+   Copies the block of tbl (which must not be NULL) into a new block from
+   the same allocator, finishing a pending incremental migration first.
+   A mostly empty map is copied one full bucket at a time into zeroed
+   memory, followed by its control bytes or occupancy bitmap, so the
+   empty buckets are never read. Returns the new bucket array, or NULL.
+------------------------------------------------------------------ */
+static inline void *_map_dup_impl(void *tbl, size_t elem_size, size_t header_size, map_key_policy kp) {
+    _map_migrate(tbl, elem_size, kp, (size_t)-1);
+    map_header *orig_hdr = (map_header *)((char *)tbl - header_size);
+    size_t cap = orig_hdr->capacity;
+    size_t size = header_size + _map_data_size(cap, elem_size);
+    int sparse = orig_hdr->count < cap / 4;
+    map_header *new_hdr = (map_header *)(sparse ? simple_ds_calloc(orig_hdr->allocator, size)
+                                                : simple_ds_malloc(orig_hdr->allocator, size));
+    if (!new_hdr)
+        return NULL;
+    char *dup = (char *)new_hdr + header_size;
+#ifdef MAP_OWN_KEYS
+    map_key_pool *pool = _map_key_pool_share(orig_hdr->key_pool);
+    if (orig_hdr->key_pool && !pool) {
+        simple_ds_free(orig_hdr->allocator, new_hdr, size);
+        return NULL;
+    }
+#endif
+    _map_copy_header(new_hdr, orig_hdr);
+#ifdef MAP_OWN_KEYS
+    new_hdr->key_pool = pool;
+#endif
+    if (!sparse) {
+        memcpy(dup, tbl, size - header_size);
+        return dup;
+    }
+    for (size_t i = _map_next_full(tbl, cap, elem_size, 0); i < cap; i = _map_next_full(tbl, cap, elem_size, i + 1))
+        _map_copy_bucket(dup, tbl, cap, elem_size, i, i);
+#ifdef MAP_CONTROL_BYTES
+    size_t occupancy = _map_ctrl_offset(cap, elem_size);
+#else
+    size_t occupancy = _map_occupancy_offset(cap, elem_size);
+#endif
+    memcpy(dup + occupancy, (char *)tbl + occupancy, _map_data_size(cap, elem_size) - occupancy);
+    return dup;
+}
+
 /* ------------------------------------------------------------------
    map_dup(tbl)
    Duplicates the entire hash map (including its hidden map header) and
    returns a pointer to the new map.
    - The map is shallow-copied: pointer values (including keys) are duplicated.
+     With MAP_OWN_KEYS, the copy shares the key pool chunks that hold the
+     existing keys (each is freed with the last map that uses it), but new
+     keys of either map go into chunks of their own, so the map and the copy
+     can still be updated from different threads.
+   - The copy is allocated from, and stays bound to, the allocator of (tbl).
+   - With MAP_INCREMENTAL_RESIZE, a pending migration of (tbl) is finished first.
+   - A map that is less than a quarter full is copied bucket by bucket,
+     skipping the empty ones; fuller maps are copied with a single memcpy.
    - Returns NULL if (tbl) is NULL or if memory allocation fails.
    Example:
        MyType *new_map = map_dup(old_map);
 ------------------------------------------------------------------ */
-#define map_dup(tbl)                                                                        \
-    ({ __typeof__(tbl) _orig = (tbl);                                                       \
-       __typeof__(tbl) _dup = NULL;                                                         \
-       if (_orig) {                                                                         \
-           map_header *_orig_hdr = MAP_HEADER(_orig);                                       \
-           size_t _cap = _orig_hdr->capacity;                                               \
-           size_t _elem_size = sizeof(*(_orig));                                            \
-           size_t _header_size = MAP_HEADER_SIZE(_orig);                                    \
-           map_header *_new_hdr = malloc(_header_size + _cap * _elem_size);                 \
-           if (_new_hdr) {                                                                  \
-               _new_hdr->count = _orig_hdr->count;                                          \
-               _new_hdr->capacity = _cap;                                                   \
-               _new_hdr->load_factor = _orig_hdr->load_factor;                              \
-               _new_hdr->growth_factor = _orig_hdr->growth_factor;                          \
-               _new_hdr->magic_number = MAP_MAGIC_NUMBER;                                   \
-               void *_new_arr = (char *)_new_hdr + _header_size;                            \
-               memcpy(_new_arr, _orig, _cap * _elem_size);                                  \
-               _dup = _new_arr;                                                             \
-           }                                                                                \
-       }                                                                                    \
-       _dup; })
+#define map_dup(tbl)                                                                                 \
+    ((tbl) ? (__typeof__(tbl))_map_dup_impl((tbl), sizeof(*(tbl)), MAP_HEADER_SIZE(tbl),             \
+                                            MAP_KEY_POLICY(tbl))                                     \
+           : NULL)
+
+/* ------------------------------------------------------------------
+   Internal function: _map_free_block
+   Frees the block of tbl (which must not be NULL), the bucket array it is
+   still migrating from and its reference to the key pool, without calling
+   any free_func.
+------------------------------------------------------------------ */
+static inline void _map_free_block(void *tbl, size_t elem_size, size_t header_size) {
+    map_header *hdr = (map_header *)((char *)tbl - header_size);
+    _map_release_old(hdr, elem_size);
+#ifdef MAP_OWN_KEYS
+    _map_key_pool_release(hdr->key_pool);
+#endif
+    simple_ds_free(hdr->allocator, hdr, header_size + _map_data_size(hdr->capacity, elem_size));
+}
 
 /* ------------------------------------------------------------------
    map_free_free(tbl, free_func)
    Frees the entire hash map (including its hidden map header) and calls
-   free_func on every bucket with a non-NULL key before freeing.
+   free_func on every occupied bucket before freeing (empty buckets are
+   skipped as in map_next).
    - If (tbl) is NULL, no action is taken.
    - The free_func parameter may be provided as either a traditional function
      pointer or as a block, as long as it accepts a single parameter of the
@@ -532,14 +2694,27 @@ static inline void map_delete_impl_idx(void *tbl_void, size_t elem_size, size_t
                 );                                                             \
             map_header *_mff_hdr = MAP_HEADER(_mff_tbl);                       \
             size_t _mff_cap = _mff_hdr->capacity;                              \
-            for (size_t _mff_i = 0; _mff_i < _mff_cap; _mff_i++) {             \
-                if (_mff_tbl[_mff_i].key) {                                    \
+            for (size_t _mff_i = 0; _mff_free_func && _mff_i < _mff_cap;       \
+                 _mff_i++) {                                                   \
+                _mff_i = _map_next_full(_mff_tbl, _mff_cap,                    \
+                                        sizeof(*(_mff_tbl)), _mff_i);          \
+                if (_mff_i < _mff_cap) {                                       \
+                    _mff_free_func(_mff_tbl[_mff_i]);                          \
+                }                                                              \
+            }                                                                  \
+            /* Elements not yet migrated by an incremental resize */           \
+            __typeof__(_mff_tbl) _mff_old = (void *)_map_old_tbl(_mff_hdr);    \
+            size_t _mff_old_cap = _map_old_capacity(_mff_hdr);                 \
+            for (size_t _mff_i = 0; _mff_i < _mff_old_cap; _mff_i++) {         \
+                if (_map_old_live(_mff_hdr, sizeof(*(_mff_tbl)), _mff_i,       \
+                                  MAP_KEY_POLICY(tbl))) {                      \
                     if (_mff_free_func) {                                      \
-                        _mff_free_func(_mff_tbl[_mff_i]);                      \
+                        _mff_free_func(_mff_old[_mff_i]);                      \
                     }                                                          \
                 }                                                              \
             }                                                                  \
-            free((char *)(_mff_tbl) - MAP_HEADER_SIZE(_mff_tbl));              \
+            _map_free_block(_mff_tbl, sizeof(*(_mff_tbl)),                     \
+                            MAP_HEADER_SIZE(_mff_tbl));                        \
             (tbl) = NULL;                                                      \
         }                                                                      \
     } while (0)
@@ -550,4 +2725,78 @@ static inline void map_delete_impl_idx(void *tbl_void, size_t elem_size, size_t
 ------------------------------------------------------------------ */
 #define map_free(tbl) map_free_free(tbl, NULL)
 
+/* Type of the key parameter of the functions defined by SIMPLE_MAP_DEFINE: const char *
+   for string keys, otherwise the same as MAP_KEY_ARG_TYPE */
+#define MAP_KEY_PARAM_TYPE(tbl)                                                                   \
+    __typeof__(__builtin_choose_expr(MAP_KEY_KIND(tbl) == MAP_KEY_STRING, (const char *)0,        \
+                                     (MAP_KEY_ARG_TYPE(tbl))0))
+
+/* Attributes of the functions defined by SIMPLE_MAP_DEFINE. flatten inlines every helper
+   they call, so the element size and key policy become constants throughout; define it
+   as empty to leave inlining to the compiler. */
+#ifndef MAP_SPECIALIZE_ATTR
+#define MAP_SPECIALIZE_ATTR __attribute__((flatten))
+#endif
+
+/* ------------------------------------------------------------------
+   SIMPLE_MAP_DEFINE(name, T)
+   Defines static inline functions for maps of element type T, so the
+   put, get and delete paths are expanded once per type instead of at
+   every call site, and compiled with a constant element size and the
+   hash and key comparison of T's key policy inlined:
+       T *name_get(T *tbl, key)
+       size_t name_get_batch(T *tbl, const key *keys, size_t n, T **out)
+       T *name_get_or_insert(T **tbl, key, int *inserted)
+       T *name_put(T **tbl, T item)
+       T *name_put_free(T **tbl, T item, void (*free_func)(T))
+       void name_delete(T **tbl, key)
+       void name_delete_free(T **tbl, key, void (*free_func)(T))
+       size_t name_count(const T *tbl)
+       void name_free(T **tbl)
+   key is a const char * for string keys and is otherwise given as for
+   map_get. The functions take the map by address where the macros would
+   reassign it, and work on the same maps as the generic macros, which
+   may be mixed freely with them.
+   Example:
+       typedef struct { const char *key; int value; } Word;
+       SIMPLE_MAP_DEFINE(words, Word)
+
+       Word *tbl = NULL;
+       words_put(&tbl, (Word){ "apple", 1 });
+       Word *w = words_get(tbl, "apple");
+       words_free(&tbl);
+------------------------------------------------------------------ */
+#define SIMPLE_MAP_DEFINE(name, T)                                                                            \
+    static inline MAP_SPECIALIZE_ATTR T *name##_get(T *tbl, MAP_KEY_PARAM_TYPE((T *)0) key) {                 \
+        return map_get(tbl, key);                                                                             \
+    }                                                                                                         \
+    static inline MAP_SPECIALIZE_ATTR size_t name##_get_batch(T *tbl, MAP_KEY_PARAM_TYPE((T *)0) const *keys, \
+                                                              size_t n, T **out) {                            \
+        return map_get_batch(tbl, keys, n, out);                                                              \
+    }                                                                                                         \
+    static inline MAP_SPECIALIZE_ATTR T *name##_get_or_insert(T **tbl, MAP_KEY_PARAM_TYPE((T *)0) key,        \
+                                                              int *inserted) {                                \
+        return map_get_or_insert(*tbl, key, inserted);                                                        \
+    }                                                                                                         \
+    static inline MAP_SPECIALIZE_ATTR T *name##_put_free(T **tbl, T item,                                     \
+                                                         void (*free_func)(T)) {                              \
+        return map_put_free(*tbl, item, free_func);                                                           \
+    }                                                                                                         \
+    static inline MAP_SPECIALIZE_ATTR T *name##_put(T **tbl, T item) {                                        \
+        return map_put(*tbl, item);                                                                           \
+    }                                                                                                         \
+    static inline MAP_SPECIALIZE_ATTR void name##_delete_free(T **tbl, MAP_KEY_PARAM_TYPE((T *)0) key,        \
+                                                              void (*free_func)(T)) {                         \
+        map_delete_free(*tbl, key, free_func);                                                                \
+    }                                                                                                         \
+    static inline MAP_SPECIALIZE_ATTR void name##_delete(T **tbl, MAP_KEY_PARAM_TYPE((T *)0) key) {           \
+        map_delete(*tbl, key);                                                                                \
+    }                                                                                                         \
+    static inline size_t name##_count(const T *tbl) {                                                         \
+        return map_count(tbl);                                                                                \
+    }                                                                                                         \
+    static inline void name##_free(T **tbl) {                                                                 \
+        map_free(*tbl);                                                                                       \
+    }
+
 #endif  /* SIMPLE_MAP_H */
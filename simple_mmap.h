@@ -0,0 +1,608 @@
+/*
+ * Saves simple_map and simple_array containers to files that can be memory-mapped back.
+ *
+ * A saved file holds a small file header followed by an image of the container's block:
+ * its hidden header and, for a map, the bucket array and per-bucket metadata exactly as
+ * they are laid out in memory. Loading maps the file and returns a pointer into the
+ * mapping that map_get (or plain indexing, for arrays) can use directly. Nothing is
+ * rehashed or re-inserted, so loading costs a few system calls rather than a rebuild,
+ * and the page cache behind the file is shared by every process that maps it.
+ *
+ * String keys cannot be stored as pointers, so the file stores each string key as an
+ * offset into a string pool that follows the buckets. When a map with string keys is
+ * loaded, the file is mapped privately and each key field is turned back into a pointer
+ * into the pool (one pass over the buckets, without hashing); the pool itself stays
+ * shared. Maps with integer or byte-array keys, and arrays, are mapped read-only and
+ * shared with no fixup at all.
+ *
+ * The file header records the element size, key type, hash seed, size_t width and the
+ * storage modes (MAP_CACHE_HASH, MAP_CONTROL_BYTES, ...) the file was written with, and
+ * a file is only loaded by a program compiled with the same ones. MAP_HASH_FUNCTION
+ * cannot be checked and must also be the same.
+ *
+ * Usage notes:
+ *   - Requires POSIX (open, mmap).
+ *   - Files are written to "<path>.tmp" and renamed over path, so processes that have
+ *     the previous file mapped keep a consistent view.
+ *   - A loaded container is read-only. It must not be passed to a macro that modifies it
+ *     (map_put, map_delete, array_push, map_free, ...) and is released with map_munmap or
+ *     array_munmap instead. Saved maps never have a pending incremental migration, so
+ *     map_get does not write to them. With SIMPLE_MAP_STATS, a loaded map is mapped
+ *     privately and map_get updates the counters in its header, which are not saved.
+ *   - Only the key fields are translated. Any other pointer in an element is saved as
+ *     is and is meaningless after loading, so elements should otherwise be plain data.
+ *   - A loaded empty map or array is NULL.
+ *
+ * Public API macros:
+ *   - map_save(tbl, path):      Writes the map to path. Returns 0, or -1 with errno set.
+ *   - map_mmap(tbl, path):      Sets tbl to the map stored in path. Returns 0, or -1 with errno set.
+ *   - map_munmap(tbl):          Unmaps a map loaded with map_mmap and sets tbl to NULL.
+ *   - array_save(arr, path):    Writes the array to path. Returns 0, or -1 with errno set.
+ *   - array_mmap(arr, path):    Sets arr to the array stored in path. Returns 0, or -1 with errno set.
+ *   - array_munmap(arr):        Unmaps an array loaded with array_mmap and sets arr to NULL.
+ */
+
+#ifndef SIMPLE_MMAP_H
+#define SIMPLE_MMAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "simple_map.h"
+#include "simple_array.h"
+
+#define SIMPLE_MMAP_MAGIC_NUMBER 0x5d5f11e5
+#define SIMPLE_MMAP_VERSION      2
+
+#define SIMPLE_MMAP_KIND_MAP   1
+#define SIMPLE_MMAP_KIND_ARRAY 2
+
+/* Number of buckets translated and written per write call by map_save */
+#ifndef SIMPLE_MMAP_CHUNK
+#define SIMPLE_MMAP_CHUNK 4096
+#endif
+
+/* The simple_map.h storage modes that change the layout of a saved map */
+#define SIMPLE_MMAP_MODE_CACHE_HASH         0x01
+#define SIMPLE_MMAP_MODE_CONTROL_BYTES      0x02
+#define SIMPLE_MMAP_MODE_POW2_CAPACITY      0x04
+#define SIMPLE_MMAP_MODE_STORE_KEY_LEN      0x08
+#define SIMPLE_MMAP_MODE_TOMBSTONES         0x10
+#define SIMPLE_MMAP_MODE_INCREMENTAL_RESIZE 0x20
+#define SIMPLE_MMAP_MODE_ROBIN_HOOD         0x40
+#define SIMPLE_MMAP_MODE_OWN_KEYS           0x80
+/* Set for maps and arrays saved with SIMPLE_DS_NO_MAGIC */
+#define SIMPLE_MMAP_MODE_NO_MAGIC           0x100
+/* Set for maps saved with SIMPLE_MAP_STATS, whose header holds counters */
+#define SIMPLE_MMAP_MODE_STATS              0x200
+
+static inline uint32_t _map_mmap_modes(void) {
+    uint32_t modes = 0;
+#ifdef MAP_CACHE_HASH
+    modes |= SIMPLE_MMAP_MODE_CACHE_HASH;
+#endif
+#ifdef MAP_CONTROL_BYTES
+    modes |= SIMPLE_MMAP_MODE_CONTROL_BYTES;
+#endif
+#ifdef MAP_POW2_CAPACITY
+    modes |= SIMPLE_MMAP_MODE_POW2_CAPACITY;
+#endif
+#ifdef MAP_STORE_KEY_LEN
+    modes |= SIMPLE_MMAP_MODE_STORE_KEY_LEN;
+#endif
+#ifdef MAP_TOMBSTONES
+    modes |= SIMPLE_MMAP_MODE_TOMBSTONES;
+#endif
+#ifdef MAP_INCREMENTAL_RESIZE
+    modes |= SIMPLE_MMAP_MODE_INCREMENTAL_RESIZE;
+#endif
+#ifdef MAP_ROBIN_HOOD
+    modes |= SIMPLE_MMAP_MODE_ROBIN_HOOD;
+#endif
+#ifdef MAP_OWN_KEYS
+    modes |= SIMPLE_MMAP_MODE_OWN_KEYS;
+#endif
+#ifdef SIMPLE_DS_NO_MAGIC
+    modes |= SIMPLE_MMAP_MODE_NO_MAGIC;
+#endif
+#ifdef SIMPLE_MAP_STATS
+    modes |= SIMPLE_MMAP_MODE_STATS;
+#endif
+    return modes;
+}
+
+/* Header at the start of every saved file.
+ * Fields:
+ *   - magic_number, version: Identify the format.
+ *   - kind:                  SIMPLE_MMAP_KIND_MAP or SIMPLE_MMAP_KIND_ARRAY.
+ *   - modes:                 SIMPLE_MMAP_MODE_* flags the map was compiled with (0 for arrays).
+ *   - word_size:             sizeof(size_t) of the writer.
+ *   - byte_order:            0x01020304 as written by the writer, to reject other byte orders.
+ *   - elem_size:             Size of an element.
+ *   - header_size:           Size of the container's hidden header (MAP_HEADER_SIZE / ARRAY_HEADER_SIZE).
+ *   - key_kind, key_size:    The map's key policy.
+ *   - hash_seed:             MAP_HASH_SEED of the writer.
+ *   - data_offset:           File offset of the hidden header (the block image follows it).
+ *   - data_size:             Size of the block image, including the hidden header.
+ *   - pool_offset:           File offset of the string pool.
+ *   - pool_size:             Size of the string pool.
+ *   - file_size:             Size of the whole file.
+ */
+typedef struct {
+    uint32_t magic_number;
+    uint32_t version;
+    uint32_t kind;
+    uint32_t modes;
+    uint32_t word_size;
+    uint32_t byte_order;
+    uint64_t elem_size;
+    uint64_t header_size;
+    uint64_t key_kind;
+    uint64_t key_size;
+    uint64_t hash_seed;
+    uint64_t data_offset;
+    uint64_t data_size;
+    uint64_t pool_offset;
+    uint64_t pool_size;
+    uint64_t file_size;
+} simple_mmap_file_header;
+
+/* The block image starts on a 64-byte boundary of the (page aligned) mapping */
+#define SIMPLE_MMAP_DATA_OFFSET ((sizeof(simple_mmap_file_header) + 63) / 64 * 64)
+
+/* Writes size bytes to f, returning non-zero on success */
+static inline int _simple_mmap_write(FILE *f, const void *data, size_t size) {
+    return size == 0 || fwrite(data, 1, size, f) == size;
+}
+
+/* Writes size zero bytes to f, returning non-zero on success */
+static inline int _simple_mmap_write_zeros(FILE *f, size_t size) {
+    static const char zeros[64];
+    while (size) {
+        size_t n = size < sizeof(zeros) ? size : sizeof(zeros);
+        if (!_simple_mmap_write(f, zeros, n))
+            return 0;
+        size -= n;
+    }
+    return 1;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _simple_mmap_save
+   Writes fh, then header_size bytes of the container header hdr (of
+   hdr_struct_size bytes, zero padded), then calls body(f, ctx) to write
+   the rest, to "<path>.tmp", and renames it over path. Returns 0, or -1
+   with errno set (the temporary file is removed).
+------------------------------------------------------------------ */
+static inline int _simple_mmap_save(const char *path, const simple_mmap_file_header *fh, const void *hdr,
+                                    size_t hdr_struct_size, int (*body)(FILE *f, void *ctx), void *ctx) {
+    size_t path_len = strlen(path);
+    char *tmp = (char *)SIMPLE_DS_MALLOC(path_len + 5);
+    if (!tmp) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(tmp, path, path_len);
+    memcpy(tmp + path_len, ".tmp", 5);
+    FILE *f = fopen(tmp, "wb");
+    if (!f) {
+        SIMPLE_DS_FREE(tmp);
+        return -1;
+    }
+    int ok = _simple_mmap_write(f, fh, sizeof(*fh)) &&
+             _simple_mmap_write_zeros(f, fh->data_offset - sizeof(*fh)) &&
+             _simple_mmap_write(f, hdr, hdr_struct_size) &&
+             _simple_mmap_write_zeros(f, fh->header_size - hdr_struct_size) &&
+             body(f, ctx);
+    int saved_errno = errno;
+    if (fclose(f) != 0 && ok) {
+        ok = 0;
+        saved_errno = errno;
+    }
+    if (ok && rename(tmp, path) != 0) {
+        ok = 0;
+        saved_errno = errno;
+    }
+    if (!ok)
+        remove(tmp);
+    SIMPLE_DS_FREE(tmp);
+    errno = saved_errno;
+    return ok ? 0 : -1;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _simple_mmap_open
+   Maps the file at path and checks that its header matches expected in
+   every field except the offsets and sizes, and that the sizes agree with
+   the file. String-key maps (writable != 0) are mapped privately and
+   writable so that their keys can be translated; everything else is
+   mapped shared and read-only. Returns the mapping, or NULL with errno set.
+------------------------------------------------------------------ */
+static inline simple_mmap_file_header *_simple_mmap_open(const char *path, const simple_mmap_file_header *expected,
+                                                         int writable) {
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return NULL;
+    struct stat st;
+    simple_mmap_file_header fh;
+    if (fstat(fd, &st) != 0 || pread(fd, &fh, sizeof(fh), 0) != (ssize_t)sizeof(fh)) {
+        int saved_errno = errno ? errno : EINVAL;
+        close(fd);
+        errno = saved_errno;
+        return NULL;
+    }
+    if (fh.magic_number != expected->magic_number || fh.version != expected->version ||
+        fh.kind != expected->kind || fh.modes != expected->modes || fh.word_size != expected->word_size ||
+        fh.byte_order != expected->byte_order || fh.elem_size != expected->elem_size ||
+        fh.header_size != expected->header_size || fh.key_kind != expected->key_kind ||
+        fh.key_size != expected->key_size || fh.hash_seed != expected->hash_seed ||
+        fh.data_offset != SIMPLE_MMAP_DATA_OFFSET || fh.file_size != (uint64_t)st.st_size ||
+        fh.data_size < fh.header_size || fh.data_offset + fh.data_size > fh.pool_offset ||
+        fh.pool_offset + fh.pool_size != fh.file_size) {
+        close(fd);
+        errno = EINVAL;
+        return NULL;
+    }
+    void *base = mmap(NULL, (size_t)fh.file_size, writable ? PROT_READ | PROT_WRITE : PROT_READ,
+                      writable ? MAP_PRIVATE : MAP_SHARED, fd, 0);
+    int saved_errno = errno;
+    close(fd);
+    if (base == MAP_FAILED) {
+        errno = saved_errno;
+        return NULL;
+    }
+    return (simple_mmap_file_header *)base;
+}
+
+/* Returns the file header in front of a container loaded from a file */
+static inline simple_mmap_file_header *_simple_mmap_file_header_of(void *container, size_t header_size) {
+    return (simple_mmap_file_header *)((char *)container - header_size - SIMPLE_MMAP_DATA_OFFSET);
+}
+
+/* ------------------------------------------------------------------
+   Maps
+------------------------------------------------------------------ */
+
+/* Fills in the file header fields that describe a map of this element type */
+static inline void _map_mmap_describe(simple_mmap_file_header *fh, size_t elem_size, size_t header_size,
+                                      map_key_policy kp) {
+    memset(fh, 0, sizeof(*fh));
+    fh->magic_number = SIMPLE_MMAP_MAGIC_NUMBER;
+    fh->version = SIMPLE_MMAP_VERSION;
+    fh->kind = SIMPLE_MMAP_KIND_MAP;
+    fh->modes = _map_mmap_modes();
+    fh->word_size = (uint32_t)sizeof(size_t);
+    fh->byte_order = 0x01020304;
+    fh->elem_size = elem_size;
+    fh->header_size = header_size;
+    fh->key_kind = (uint64_t)kp.kind;
+    fh->key_size = kp.size;
+    fh->hash_seed = (uint64_t)(MAP_HASH_SEED);
+    fh->data_offset = SIMPLE_MMAP_DATA_OFFSET;
+}
+
+typedef struct {
+    char *tbl;
+    size_t cap;
+    size_t elem_size;
+    map_key_policy kp;
+} _map_mmap_ctx;
+
+/* Writes the buckets (string keys replaced by pool offsets + 1), the metadata and the pool */
+static inline int _map_mmap_write_body(FILE *f, void *ctx_void) {
+    _map_mmap_ctx *ctx = (_map_mmap_ctx *)ctx_void;
+    if (!ctx->tbl)
+        return 1;
+    size_t es = ctx->elem_size;
+    size_t data_size = _map_data_size(ctx->cap, es);
+    if (ctx->kp.kind != MAP_KEY_STRING)
+        return _simple_mmap_write(f, ctx->tbl, data_size);
+    char *chunk = (char *)SIMPLE_DS_MALLOC(SIMPLE_MMAP_CHUNK * es);
+    if (!chunk) {
+        errno = ENOMEM;
+        return 0;
+    }
+    uint64_t pool_pos = 0;
+    int ok = 1;
+    for (size_t start = 0; ok && start < ctx->cap; start += SIMPLE_MMAP_CHUNK) {
+        size_t n = ctx->cap - start < SIMPLE_MMAP_CHUNK ? ctx->cap - start : SIMPLE_MMAP_CHUNK;
+        memcpy(chunk, ctx->tbl + start * es, n * es);
+        for (size_t i = 0; i < n; i++) {
+            if (!_map_bucket_full(ctx->tbl, ctx->cap, es, start + i, ctx->kp))
+                continue;
+            uintptr_t offset = (uintptr_t)(pool_pos + 1);
+            memcpy(chunk + i * es, &offset, sizeof(offset));
+            pool_pos += _map_bucket_len(ctx->tbl, ctx->cap, es, start + i, ctx->kp) + 1;
+        }
+        ok = _simple_mmap_write(f, chunk, n * es);
+    }
+    SIMPLE_DS_FREE(chunk);
+    /* Metadata (including the padding in front of it) as is */
+    ok = ok && _simple_mmap_write(f, ctx->tbl + ctx->cap * es, data_size - ctx->cap * es);
+    for (size_t i = _map_next_full(ctx->tbl, ctx->cap, es, 0); ok && i < ctx->cap;
+         i = _map_next_full(ctx->tbl, ctx->cap, es, i + 1)) {
+        const char *key = *(const char *const *)(ctx->tbl + i * es);
+        ok = _simple_mmap_write(f, key, _map_bucket_len(ctx->tbl, ctx->cap, es, i, ctx->kp)) &&
+             _simple_mmap_write_zeros(f, 1);
+    }
+    return ok;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_save_impl
+   Saves tbl (which may be NULL) to path. A pending incremental migration
+   is finished first. The saved header has no allocator and no migration
+   state. Returns 0, or -1 with errno set.
+------------------------------------------------------------------ */
+static inline int _map_save_impl(void *tbl, const char *path, size_t elem_size, size_t header_size,
+                                 map_key_policy kp) {
+    simple_mmap_file_header fh;
+    _map_mmap_describe(&fh, elem_size, header_size, kp);
+    map_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    _map_mmap_ctx ctx = { (char *)tbl, 0, elem_size, kp };
+    uint64_t pool_size = 0;
+    if (tbl) {
+        _map_migrate(tbl, elem_size, kp, (size_t)-1);
+        map_header *orig = (map_header *)((char *)tbl - header_size);
+        hdr.load_factor = orig->load_factor;
+        hdr.growth_factor = orig->growth_factor;
+        hdr.shrink_factor = orig->shrink_factor;
+        hdr.count = orig->count;
+        hdr.capacity = orig->capacity;
+        hdr.grow_threshold = orig->grow_threshold;
+        hdr.shrink_threshold = orig->shrink_threshold;
+#ifdef MAP_TOMBSTONES
+        hdr.deleted = orig->deleted;
+#endif
+        SIMPLE_DS_SET_MAGIC(&hdr, MAP_MAGIC_NUMBER);
+        ctx.cap = orig->capacity;
+        fh.data_size = header_size + _map_data_size(ctx.cap, elem_size);
+        if (kp.kind == MAP_KEY_STRING) {
+            for (size_t i = _map_next_full(tbl, ctx.cap, elem_size, 0); i < ctx.cap;
+                 i = _map_next_full(tbl, ctx.cap, elem_size, i + 1))
+                pool_size += _map_bucket_len(tbl, ctx.cap, elem_size, i, kp) + 1;
+        }
+    } else {
+        fh.data_size = header_size;
+    }
+    fh.pool_offset = fh.data_offset + fh.data_size;
+    fh.pool_size = pool_size;
+    fh.file_size = fh.pool_offset + pool_size;
+    return _simple_mmap_save(path, &fh, &hdr, sizeof(hdr), _map_mmap_write_body, &ctx);
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_mmap_impl
+   Maps the map saved in path and stores its bucket array in *out (NULL
+   for an empty map, which is unmapped right away). String keys are
+   translated from pool offsets back to pointers, after which the mapping
+   is made read-only (except for the header with SIMPLE_MAP_STATS).
+   Returns 0, or -1 with errno set.
+------------------------------------------------------------------ */
+static inline int _map_mmap_impl(const char *path, void **out, size_t elem_size, size_t header_size,
+                                 map_key_policy kp) {
+    simple_mmap_file_header expected;
+    _map_mmap_describe(&expected, elem_size, header_size, kp);
+    int strings = kp.kind == MAP_KEY_STRING;
+#ifdef SIMPLE_MAP_STATS
+    /* Lookups update the counters in the header, so the page holding it stays writable
+       (and is copied from the file on the first lookup) */
+    int writable = 1;
+#else
+    int writable = strings;
+#endif
+    simple_mmap_file_header *fh = _simple_mmap_open(path, &expected, writable);
+    if (!fh)
+        return -1;
+    char *base = (char *)fh;
+    map_header *hdr = (map_header *)(base + fh->data_offset);
+    char *tbl = (char *)hdr + header_size;
+    size_t file_size = (size_t)fh->file_size;
+    if (fh->data_size == header_size) {
+        /* An empty map */
+        munmap(base, file_size);
+        *out = NULL;
+        return 0;
+    }
+    if (!SIMPLE_DS_HAS_MAGIC(hdr, MAP_MAGIC_NUMBER) || fh->data_size != header_size + _map_data_size(hdr->capacity, elem_size)) {
+        munmap(base, file_size);
+        errno = EINVAL;
+        return -1;
+    }
+    if (strings) {
+        char *pool = base + fh->pool_offset;
+        size_t cap = hdr->capacity;
+        for (size_t i = _map_next_full(tbl, cap, elem_size, 0); i < cap; i = _map_next_full(tbl, cap, elem_size, i + 1)) {
+            uintptr_t offset;
+            memcpy(&offset, tbl + i * elem_size, sizeof(offset));
+            if (offset == 0 || offset - 1 >= fh->pool_size) {
+                munmap(base, file_size);
+                errno = EINVAL;
+                return -1;
+            }
+            const char *key = pool + (offset - 1);
+            memcpy(tbl + i * elem_size, &key, sizeof(key));
+        }
+    }
+    if (writable) {
+        mprotect(base, file_size, PROT_READ);
+#ifdef SIMPLE_MAP_STATS
+        size_t page = (size_t)sysconf(_SC_PAGESIZE);
+        size_t first = (size_t)fh->data_offset / page * page;
+        mprotect(base + first, (size_t)fh->data_offset + header_size - first, PROT_READ | PROT_WRITE);
+#endif
+    }
+    *out = tbl;
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   map_save(tbl, path)
+   Writes the map (which may be NULL) to the file path, replacing it
+   atomically. Returns 0 on success, or -1 with errno set.
+   Example:
+       if (map_save(table, "table.map") != 0)
+           perror("map_save");
+------------------------------------------------------------------ */
+#define map_save(tbl, path)                                                                         \
+    ({                                                                                              \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                    \
+        _map_save_impl((tbl), (path), sizeof(*(tbl)), MAP_HEADER_SIZE(tbl), MAP_KEY_POLICY(tbl));   \
+    })
+
+/* ------------------------------------------------------------------
+   map_mmap(tbl, path)
+   map_munmap(tbl)
+   map_mmap sets tbl (which must be NULL) to the map saved in path, which
+   must have been written with the same element type and storage modes.
+   Returns 0 on success, or -1 with errno set (EINVAL if the file does not
+   match). The map can be queried with map_get, map_count, map_next and
+   map_foreach, but not modified, and is released with map_munmap.
+   Example:
+       Foo *table = NULL;
+       if (map_mmap(table, "table.map") == 0) {
+           Foo *item = map_get(table, "apple");
+           ...
+           map_munmap(table);
+       }
+------------------------------------------------------------------ */
+#define map_mmap(tbl, path)                                                                         \
+    ({                                                                                              \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                    \
+        void *_mm_tbl = NULL;                                                                       \
+        int _mm_ret = _map_mmap_impl((path), &_mm_tbl, sizeof(*(tbl)), MAP_HEADER_SIZE(tbl),        \
+                                     MAP_KEY_POLICY(tbl));                                          \
+        if (_mm_ret == 0)                                                                           \
+            (tbl) = (__typeof__(tbl))_mm_tbl;                                                       \
+        _mm_ret;                                                                                    \
+    })
+
+#define map_munmap(tbl)                                                                                 \
+    do {                                                                                                \
+        if (tbl) {                                                                                      \
+            simple_mmap_file_header *_mu_fh = _simple_mmap_file_header_of((tbl), MAP_HEADER_SIZE(tbl)); \
+            munmap(_mu_fh, (size_t)_mu_fh->file_size);                                                  \
+            (tbl) = NULL;                                                                               \
+        }                                                                                               \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   Arrays
+------------------------------------------------------------------ */
+
+/* Fills in the file header fields that describe an array of this element type */
+static inline void _array_mmap_describe(simple_mmap_file_header *fh, size_t elem_size, size_t header_size) {
+    memset(fh, 0, sizeof(*fh));
+    fh->magic_number = SIMPLE_MMAP_MAGIC_NUMBER;
+    fh->version = SIMPLE_MMAP_VERSION;
+    fh->kind = SIMPLE_MMAP_KIND_ARRAY;
+#ifdef SIMPLE_DS_NO_MAGIC
+    fh->modes = SIMPLE_MMAP_MODE_NO_MAGIC;
+#endif
+    fh->word_size = (uint32_t)sizeof(size_t);
+    fh->byte_order = 0x01020304;
+    fh->elem_size = elem_size;
+    fh->header_size = header_size;
+    fh->data_offset = SIMPLE_MMAP_DATA_OFFSET;
+}
+
+typedef struct {
+    const void *arr;
+    size_t size;
+} _array_mmap_ctx;
+
+static inline int _array_mmap_write_body(FILE *f, void *ctx_void) {
+    _array_mmap_ctx *ctx = (_array_mmap_ctx *)ctx_void;
+    return _simple_mmap_write(f, ctx->arr, ctx->size);
+}
+
+/* Saves the count elements of arr to path, with a header whose capacity is count */
+static inline int _array_save_impl(const void *arr, const array_header *orig, const char *path, size_t elem_size,
+                                   size_t header_size) {
+    simple_mmap_file_header fh;
+    _array_mmap_describe(&fh, elem_size, header_size);
+    array_header hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    size_t count = orig ? orig->count : 0;
+    if (orig) {
+        hdr.growth_factor = orig->growth_factor;
+        hdr.shrink_factor = orig->shrink_factor;
+        hdr.count = count;
+        hdr.capacity = count;
+        SIMPLE_DS_SET_MAGIC(&hdr, ARRAY_MAGIC_NUMBER);
+    }
+    _array_mmap_ctx ctx = { arr, count * elem_size };
+    fh.data_size = header_size + count * elem_size;
+    fh.pool_offset = fh.data_offset + fh.data_size;
+    fh.file_size = fh.pool_offset;
+    return _simple_mmap_save(path, &fh, &hdr, sizeof(hdr), _array_mmap_write_body, &ctx);
+}
+
+/* Maps the array saved in path and stores it in *out (NULL for an empty array) */
+static inline int _array_mmap_impl(const char *path, void **out, size_t elem_size, size_t header_size) {
+    simple_mmap_file_header expected;
+    _array_mmap_describe(&expected, elem_size, header_size);
+    simple_mmap_file_header *fh = _simple_mmap_open(path, &expected, 0);
+    if (!fh)
+        return -1;
+    array_header *hdr = (array_header *)((char *)fh + fh->data_offset);
+    size_t file_size = (size_t)fh->file_size;
+    if (fh->data_size == header_size || !SIMPLE_DS_HAS_MAGIC(hdr, ARRAY_MAGIC_NUMBER)) {
+        int empty = fh->data_size == header_size;
+        munmap(fh, file_size);
+        *out = NULL;
+        if (empty)
+            return 0;
+        errno = EINVAL;
+        return -1;
+    }
+    if (fh->data_size != header_size + hdr->count * elem_size || hdr->capacity != hdr->count) {
+        munmap(fh, file_size);
+        errno = EINVAL;
+        return -1;
+    }
+    *out = (char *)hdr + header_size;
+    return 0;
+}
+
+/* ------------------------------------------------------------------
+   array_save(arr, path)
+   array_mmap(arr, path)
+   array_munmap(arr)
+   array_save writes the count elements of arr (which may be NULL) to path,
+   replacing it atomically. array_mmap sets arr (which must be NULL) to a
+   read-only view of the array saved in path, which can be indexed and
+   passed to array_count, and is released with array_munmap. Elements are
+   saved byte for byte, so they should not contain pointers. Both return
+   0 on success, or -1 with errno set.
+------------------------------------------------------------------ */
+#define array_save(arr, path)                                                                       \
+    _array_save_impl((arr), (arr) ? ARRAY_HEADER(arr) : NULL, (path), sizeof(*(arr)), ARRAY_HEADER_SIZE(arr))
+
+#define array_mmap(arr, path)                                                                       \
+    ({                                                                                              \
+        void *_am_arr = NULL;                                                                       \
+        int _am_ret = _array_mmap_impl((path), &_am_arr, sizeof(*(arr)), ARRAY_HEADER_SIZE(arr));   \
+        if (_am_ret == 0)                                                                           \
+            (arr) = (__typeof__(arr))_am_arr;                                                       \
+        _am_ret;                                                                                    \
+    })
+
+#define array_munmap(arr)                                                                                 \
+    do {                                                                                                  \
+        if (arr) {                                                                                        \
+            simple_mmap_file_header *_au_fh = _simple_mmap_file_header_of((arr), ARRAY_HEADER_SIZE(arr)); \
+            munmap(_au_fh, (size_t)_au_fh->file_size);                                                    \
+            (arr) = NULL;                                                                                 \
+        }                                                                                                 \
+    } while (0)
+
+#endif  /* SIMPLE_MMAP_H */
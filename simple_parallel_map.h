@@ -0,0 +1,503 @@
+/*
+ * Multi-threaded bulk construction and resizing for simple_map.
+ *
+ * map_build_parallel inserts a large array of items with several threads, and
+ * map_resize_parallel rebuilds a map at a new capacity the same way. Both split the
+ * bucket array into one region of consecutive home buckets per thread (a multiple of
+ * 64 buckets, so that no two regions share a word of the occupancy bitmap) and work in
+ * four phases:
+ *   1. The items (or the old buckets) are cut into one slice per thread; each thread
+ *      hashes its slice and counts how many of its keys have their home in each region.
+ *   2. Each thread copies the indices of its slice into one list per region, at offsets
+ *      found from a prefix sum of the counts, so each list keeps the items in order.
+ *   3. Each thread inserts the items of one region, probing only inside the region. An
+ *      item whose probe would run past the end of the region is set aside.
+ *   4. The calling thread inserts the items that were set aside with the usual probing.
+ * Since threads never read or write buckets outside their own region, phase 3 needs no
+ * locks, and with a good hash only the few items whose probe crosses a region boundary
+ * are left to phase 4. Items whose keys are equal go to the same region, where they are
+ * applied in order, so the last one wins as with map_put_many.
+ *
+ * Default configuration:
+ *   - MAP_PARALLEL_MAX_THREADS:  Upper bound on the number of threads (default 64).
+ *   - MAP_PARALLEL_MIN_REGION:   Smallest region, in buckets, worth giving its own
+ *                                thread (default 16384); smaller maps use fewer threads.
+ *   - Everything else (key types, hash function, storage modes) is configured as for
+ *     simple_map.h.
+ *
+ * Usage notes:
+ *   - Requires POSIX threads (compile and link with -pthread).
+ *   - The map must not be used by any other thread during either call.
+ *   - Only the calling thread allocates and frees memory, so the map's allocator need
+ *     not be thread-safe.
+ *   - With MAP_OWN_KEYS, new keys are copied into the key pool by the calling thread
+ *     after phase 3.
+ *   - MAP_RESIZE (the automatic resize done by map_put) stays single-threaded: reserve
+ *     room up front with map_build_parallel or map_resize_parallel before a bulk load.
+ *
+ * Public API macros:
+ *   - map_build_parallel(tbl, items, n, nthreads):    Inserts or updates n elements with nthreads threads.
+ *   - map_resize_parallel(tbl, new_cap, nthreads):    Resizes the map to new_cap buckets with nthreads threads.
+ */
+
+#ifndef SIMPLE_PARALLEL_MAP_H
+#define SIMPLE_PARALLEL_MAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include "simple_map.h"
+
+#ifndef MAP_PARALLEL_MAX_THREADS
+#define MAP_PARALLEL_MAX_THREADS 64
+#endif
+
+#ifndef MAP_PARALLEL_MIN_REGION
+#define MAP_PARALLEL_MIN_REGION 16384
+#endif
+
+/* What phase 3 did with a source item (or old bucket) */
+enum {
+    MAP_PAR_SKIP = 0,     /* empty bucket, sentinel key, or replaced an element with the same key */
+    MAP_PAR_NEW = 1,      /* stored in a bucket that was empty */
+    MAP_PAR_DEFERRED = 2  /* left to the calling thread */
+};
+
+/* State shared by the threads of a parallel build or resize.
+ * Fields:
+ *   - tbl, cap:       Bucket array being filled and its capacity.
+ *   - src, n:         The n source items, or the n buckets of the old bucket array.
+ *   - from_buckets:   Non-zero if src is an old bucket array (whose keys are distinct).
+ *   - nslices:        Number of threads used for phases 1 and 2.
+ *   - nregions:       Number of regions (and threads used for phase 3).
+ *   - region_size:    Buckets per region (the last region may be shorter).
+ *   - hashes, lens:   Hash and key length of each source item.
+ *   - state:          One MAP_PAR_* value per source item.
+ *   - offsets:        nslices * nregions counts (phase 1), then write positions (phase 2).
+ *   - region_start:   nregions + 1 offsets into order.
+ *   - order:          Source indices grouped by region.
+ *   - added:          Per region, the number of new elements stored in phase 3.
+ *   - deferred:       Per region, the number of items set aside in phase 3.
+ */
+typedef struct {
+    char *tbl;
+    size_t cap;
+    const char *src;
+    size_t n;
+    int from_buckets;
+    size_t elem_size;
+    map_key_policy kp;
+    size_t nslices;
+    size_t nregions;
+    size_t region_size;
+    size_t *hashes;
+    size_t *lens;
+    uint8_t *state;
+    size_t *offsets;
+    size_t *region_start;
+    size_t *order;
+    size_t *added;
+    size_t *deferred;
+} map_par_ctx;
+
+typedef void (*map_par_fn)(map_par_ctx *ctx, size_t task);
+
+typedef struct {
+    map_par_ctx *ctx;
+    map_par_fn fn;
+    size_t task;
+} map_par_task;
+
+static inline void *_map_par_thread(void *arg) {
+    map_par_task *task = (map_par_task *)arg;
+    task->fn(task->ctx, task->task);
+    return NULL;
+}
+
+/* Runs fn for tasks 0 to ntasks - 1, one thread each; the calling thread runs task 0
+   (and any task whose thread could not be started) */
+static inline void _map_par_run(map_par_ctx *ctx, map_par_fn fn, size_t ntasks) {
+    pthread_t threads[MAP_PARALLEL_MAX_THREADS];
+    map_par_task tasks[MAP_PARALLEL_MAX_THREADS];
+    int started[MAP_PARALLEL_MAX_THREADS] = { 0 };
+    for (size_t t = 1; t < ntasks; t++) {
+        tasks[t] = (map_par_task){ ctx, fn, t };
+        started[t] = pthread_create(&threads[t], NULL, _map_par_thread, &tasks[t]) == 0;
+    }
+    fn(ctx, 0);
+    for (size_t t = 1; t < ntasks; t++) {
+        if (started[t])
+            pthread_join(threads[t], NULL);
+        else
+            fn(ctx, t);
+    }
+}
+
+/* Returns the number of threads to use when nthreads is requested (0 = one per online CPU) */
+static inline size_t _map_par_threads(size_t nthreads) {
+    if (!nthreads) {
+        long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = cpus > 0 ? (size_t)cpus : 1;
+    }
+    return nthreads < MAP_PARALLEL_MAX_THREADS ? nthreads : MAP_PARALLEL_MAX_THREADS;
+}
+
+/* Returns the region of a key with the given hash */
+static inline size_t _map_par_region(map_par_ctx *ctx, size_t hash) {
+    return _map_home(hash, ctx->cap) / ctx->region_size;
+}
+
+/* Phase 1: hashes the items of one slice and counts them per region */
+static inline void _map_par_hash(map_par_ctx *ctx, size_t slice) {
+    size_t lo = ctx->n * slice / ctx->nslices, hi = ctx->n * (slice + 1) / ctx->nslices;
+    size_t *counts = ctx->offsets + slice * ctx->nregions;
+    for (size_t i = lo; i < hi; i++) {
+        const char *elem = ctx->src + i * ctx->elem_size;
+        size_t hash, len;
+        if (ctx->from_buckets) {
+            if (!_map_bucket_full((void *)ctx->src, ctx->n, ctx->elem_size, i, ctx->kp)) {
+                ctx->state[i] = MAP_PAR_SKIP;
+                continue;
+            }
+            hash = _map_bucket_hash((void *)ctx->src, ctx->n, ctx->elem_size, i, ctx->kp);
+            len = _map_bucket_len((void *)ctx->src, ctx->n, ctx->elem_size, i, ctx->kp);
+        } else {
+            if (_map_field_is_zero(elem, ctx->kp.size)) {
+                ctx->state[i] = MAP_PAR_SKIP;
+                continue;
+            }
+            len = _map_field_key_len(elem, ctx->kp);
+            hash = _map_hash_key(_map_field_key(elem, ctx->kp), len, ctx->kp);
+        }
+        ctx->hashes[i] = hash;
+        if (ctx->lens)
+            ctx->lens[i] = len;
+        ctx->state[i] = MAP_PAR_NEW;
+        counts[_map_par_region(ctx, hash)]++;
+    }
+}
+
+/* Phase 2: appends the indices of one slice to the lists of their regions */
+static inline void _map_par_scatter(map_par_ctx *ctx, size_t slice) {
+    size_t lo = ctx->n * slice / ctx->nslices, hi = ctx->n * (slice + 1) / ctx->nslices;
+    size_t *pos = ctx->offsets + slice * ctx->nregions;
+    for (size_t i = lo; i < hi; i++) {
+        if (ctx->state[i] != MAP_PAR_SKIP)
+            ctx->order[pos[_map_par_region(ctx, ctx->hashes[i])]++] = i;
+    }
+}
+
+/* Returns the length of the key of source item i */
+static inline size_t _map_par_len(map_par_ctx *ctx, size_t i) {
+    return ctx->lens ? ctx->lens[i] : ctx->kp.size;
+}
+
+/* Phase 3: inserts the items of one region, probing only buckets inside it */
+static inline void _map_par_insert(map_par_ctx *ctx, size_t region) {
+    char *tbl = ctx->tbl;
+    size_t cap = ctx->cap, elem_size = ctx->elem_size;
+    size_t end = (region + 1) * ctx->region_size < cap ? (region + 1) * ctx->region_size : cap;
+    map_key_policy kp = ctx->kp;
+    for (size_t j = ctx->region_start[region]; j < ctx->region_start[region + 1]; j++) {
+        size_t i = ctx->order[j];
+        const char *elem = ctx->src + i * elem_size;
+        size_t hash = ctx->hashes[i], len = _map_par_len(ctx, i);
+        const void *key = _map_field_key(elem, kp);
+        size_t h = _map_home(hash, cap);
+        while (h < end && _map_bucket_full(tbl, cap, elem_size, h, kp)) {
+            if (!ctx->from_buckets && _map_key_equal(tbl, cap, elem_size, h, key, len, hash, kp))
+                break;
+            h++;
+        }
+        if (h == end) {
+            ctx->state[i] = MAP_PAR_DEFERRED;
+            ctx->deferred[region]++;
+            continue;
+        }
+        if (_map_bucket_full(tbl, cap, elem_size, h, kp)) {
+            /* Same key: the pooled key of the replaced element is kept, as in map_put */
+            const void *owned = _map_owned_key(tbl + h * elem_size, kp);
+            memcpy(tbl + h * elem_size, elem, elem_size);
+            _map_own_key(MAP_HEADER(tbl), tbl + h * elem_size, owned, len, hash, kp);
+            _map_set_meta(tbl, cap, elem_size, h, hash, len);
+            ctx->state[i] = MAP_PAR_SKIP;
+            continue;
+        }
+        /* With MAP_ROBIN_HOOD, the run shifted by _map_insert_slot ends at h */
+        h = _map_insert_slot(tbl, cap, elem_size, h, hash, kp);
+        memcpy(tbl + h * elem_size, elem, elem_size);
+        _map_set_meta(tbl, cap, elem_size, h, hash, len);
+        ctx->added[region]++;
+    }
+}
+
+/* Inserts or updates elem, whose key has the given hash and length, with the usual probing.
+   A new key is dropped if it would take the map's last empty bucket (see _map_is_full). */
+static inline void _map_par_put(char *tbl, const char *elem, size_t hash, size_t len, size_t elem_size,
+                                map_key_policy kp) {
+    map_header *hdr = MAP_HEADER(tbl);
+    size_t cap = hdr->capacity;
+    size_t h = _map_find_slot(tbl, _map_field_key(elem, kp), len, hash, elem_size, kp);
+    const void *owned = NULL;
+    if (h < cap && _map_bucket_full(tbl, cap, elem_size, h, kp)) {
+        owned = _map_owned_key(tbl + h * elem_size, kp);
+    } else {
+        if (_map_is_full(hdr))
+            return;
+        h = _map_insert_slot(tbl, cap, elem_size, h, hash, kp);
+        hdr->count++;
+    }
+    memcpy(tbl + h * elem_size, elem, elem_size);
+    _map_own_key(hdr, tbl + h * elem_size, owned, len, hash, kp);
+    _map_set_meta(tbl, cap, elem_size, h, hash, len);
+}
+
+/* Inserts the source items of _map_par_fill with the calling thread alone */
+static inline void _map_par_fill_serial(char *tbl, const void *src, size_t n, int from_buckets, size_t elem_size,
+                                        map_key_policy kp) {
+    map_header *hdr = MAP_HEADER(tbl);
+    for (size_t i = 0; i < n; i++) {
+        const char *elem = (const char *)src + i * elem_size;
+        if (from_buckets) {
+            if (_map_bucket_full((void *)src, n, elem_size, i, kp)) {
+                _map_reinsert(tbl, hdr->capacity, (void *)src, n, i, elem_size, kp);
+                hdr->count++;
+            }
+        } else if (!_map_field_is_zero(elem, kp.size)) {
+            size_t len = _map_field_key_len(elem, kp);
+            _map_par_put(tbl, elem, _map_hash_key(_map_field_key(elem, kp), len, kp), len, elem_size, kp);
+        }
+    }
+}
+
+/* Makes the key of the new element stored for source item i point into the key pool
+   (MAP_OWN_KEYS); the key pool is not thread-safe, so this runs after phase 3 */
+static inline void _map_par_own(map_par_ctx *ctx, size_t i) {
+    char *tbl = ctx->tbl;
+    const char *elem = ctx->src + i * ctx->elem_size;
+    size_t hash = ctx->hashes[i], len = _map_par_len(ctx, i);
+    size_t h = _map_find_slot(tbl, _map_field_key(elem, ctx->kp), len, hash, ctx->elem_size, ctx->kp);
+    if (h < ctx->cap && _map_owned_key(tbl + h * ctx->elem_size, ctx->kp) == _map_field_key(elem, ctx->kp))
+        _map_own_key(MAP_HEADER(tbl), tbl + h * ctx->elem_size, NULL, len, hash, ctx->kp);
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_par_fill
+   Inserts the n source items (or the full buckets of the old bucket array
+   src, if from_buckets is non-zero) into tbl, which must have room for all
+   of them, with up to nthreads threads. A map too small for more than one
+   region, or a failure to allocate the scratch arrays, falls back to
+   inserting them with the calling thread alone.
+------------------------------------------------------------------ */
+static inline void _map_par_fill(char *tbl, const void *src, size_t n, int from_buckets, size_t nthreads,
+                                size_t elem_size, map_key_policy kp) {
+    map_header *hdr = MAP_HEADER(tbl);
+    map_par_ctx ctx = { 0 };
+    ctx.tbl = tbl;
+    ctx.cap = hdr->capacity;
+    ctx.src = (const char *)src;
+    ctx.n = n;
+    ctx.from_buckets = from_buckets;
+    ctx.elem_size = elem_size;
+    ctx.kp = kp;
+    nthreads = _map_par_threads(nthreads);
+    size_t max_regions = ctx.cap / MAP_PARALLEL_MIN_REGION;
+    ctx.nregions = nthreads < max_regions ? nthreads : (max_regions ? max_regions : 1);
+    ctx.region_size = ((ctx.cap + ctx.nregions - 1) / ctx.nregions + 63) / 64 * 64;
+    ctx.nregions = (ctx.cap + ctx.region_size - 1) / ctx.region_size;
+    ctx.nslices = n / MAP_PARALLEL_MIN_REGION < nthreads ? n / MAP_PARALLEL_MIN_REGION + 1 : nthreads;
+    if (ctx.nregions == 1) {
+        /* Partitioning would only add passes over the items */
+        _map_par_fill_serial(tbl, src, n, from_buckets, elem_size, kp);
+        return;
+    }
+
+    size_t nr = ctx.nregions;
+    ctx.hashes = (size_t *)SIMPLE_DS_MALLOC(n * sizeof(size_t));
+    ctx.order = (size_t *)SIMPLE_DS_MALLOC(n * sizeof(size_t));
+    ctx.state = (uint8_t *)SIMPLE_DS_MALLOC(n);
+    ctx.offsets = (size_t *)SIMPLE_DS_CALLOC(ctx.nslices * nr + 3 * nr + 1, sizeof(size_t));
+    if (kp.kind == MAP_KEY_STRING)
+        ctx.lens = (size_t *)SIMPLE_DS_MALLOC(n * sizeof(size_t));
+    if (!ctx.hashes || !ctx.order || !ctx.state || !ctx.offsets || (!ctx.lens && kp.kind == MAP_KEY_STRING)) {
+        _map_par_fill_serial(tbl, src, n, from_buckets, elem_size, kp);
+    } else {
+        ctx.region_start = ctx.offsets + ctx.nslices * nr;
+        ctx.added = ctx.region_start + nr + 1;
+        ctx.deferred = ctx.added + nr;
+
+        _map_par_run(&ctx, _map_par_hash, ctx.nslices);
+        /* Turn the per-slice counts into write positions, region by region */
+        size_t pos = 0;
+        for (size_t r = 0; r < nr; r++) {
+            ctx.region_start[r] = pos;
+            for (size_t s = 0; s < ctx.nslices; s++) {
+                size_t count = ctx.offsets[s * nr + r];
+                ctx.offsets[s * nr + r] = pos;
+                pos += count;
+            }
+        }
+        ctx.region_start[nr] = pos;
+        _map_par_run(&ctx, _map_par_scatter, ctx.nslices);
+        _map_par_run(&ctx, _map_par_insert, nr);
+
+        size_t deferred = 0;
+        for (size_t r = 0; r < nr; r++) {
+            hdr->count += ctx.added[r];
+            deferred += ctx.deferred[r];
+        }
+#ifdef MAP_OWN_KEYS
+        int own = !from_buckets && kp.kind == MAP_KEY_STRING;
+#else
+        int own = 0;
+#endif
+        for (size_t i = 0; (deferred || own) && i < n; i++) {
+            if (ctx.state[i] == MAP_PAR_DEFERRED) {
+                if (from_buckets) {
+                    _map_reinsert(tbl, ctx.cap, (void *)src, n, i, elem_size, kp);
+                    hdr->count++;
+                } else {
+                    _map_par_put(tbl, ctx.src + i * elem_size, ctx.hashes[i], _map_par_len(&ctx, i), elem_size, kp);
+                }
+                deferred--;
+            } else if (own && ctx.state[i] == MAP_PAR_NEW) {
+                _map_par_own(&ctx, i);
+            }
+        }
+    }
+    SIMPLE_DS_FREE(ctx.hashes);
+    SIMPLE_DS_FREE(ctx.order);
+    SIMPLE_DS_FREE(ctx.state);
+    SIMPLE_DS_FREE(ctx.offsets);
+    SIMPLE_DS_FREE(ctx.lens);
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_resize_parallel_impl
+   Like _map_resize_impl, but re-inserts the items with up to nthreads
+   threads (a pending incremental migration is finished first, and the
+   items are always moved right away). new_cap is raised if needed so
+   that the new block has an empty bucket. Returns a pointer to the new
+   bucket array, or to the old one if the new block cannot be allocated.
+------------------------------------------------------------------ */
+static inline void *_map_resize_parallel_impl(void *tbl_void, size_t new_cap, size_t nthreads, size_t elem_size,
+                                              size_t header_size, map_key_policy kp) {
+    if (!tbl_void)
+        return _map_alloc_impl(new_cap, elem_size, header_size, NULL);
+    char *old_tbl = (char *)tbl_void;
+    map_header *old_hdr = (map_header *)(old_tbl - header_size);
+    _map_migrate(old_tbl, elem_size, kp, (size_t)-1);
+    if (new_cap <= old_hdr->count)
+        new_cap = old_hdr->count + 1;
+    char *new_tbl = (char *)_map_alloc_impl(new_cap, elem_size, header_size, old_hdr->allocator);
+    if (!new_tbl)
+        return old_tbl;
+    map_header *new_hdr = (map_header *)(new_tbl - header_size);
+    new_hdr->load_factor = old_hdr->load_factor;
+    new_hdr->growth_factor = old_hdr->growth_factor;
+    new_hdr->shrink_factor = old_hdr->shrink_factor;
+    _map_update_threshold(new_hdr);
+#ifdef MAP_OWN_KEYS
+    new_hdr->key_pool = old_hdr->key_pool;
+#endif
+    _map_stats_carry(new_hdr, old_hdr, elem_size);
+    size_t old_cap = old_hdr->capacity;
+    _map_par_fill(new_tbl, old_tbl, old_cap, 1, nthreads, elem_size, kp);
+    simple_ds_free(old_hdr->allocator, old_hdr, header_size + _map_data_size(old_cap, elem_size));
+    return new_tbl;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _map_build_parallel_impl
+   Inserts or updates the n elements at items in tbl_void (which may be
+   NULL) with up to nthreads threads. The map is first resized once (in
+   parallel) to fit all of them, which also drops any tombstones and
+   finishes a pending incremental migration. If that resize cannot
+   allocate, the items are put one at a time by the calling thread,
+   growing the map as map_put does (and dropping new keys once it is full).
+   Returns a pointer to the (possibly new) bucket array, or NULL if tbl_void
+   is NULL and no map could be allocated.
+------------------------------------------------------------------ */
+static inline void *_map_build_parallel_impl(void *tbl_void, const void *items, size_t n, size_t nthreads,
+                                             size_t elem_size, size_t header_size, map_key_policy kp) {
+    char *tbl = (char *)tbl_void;
+    if (!tbl && !(tbl = (char *)_map_alloc_impl(MAP_INIT_CAPACITY, elem_size, header_size, NULL)))
+        return NULL;
+    map_header *hdr = (map_header *)(tbl - header_size);
+    size_t new_cap = _map_grow_capacity_n(hdr, n);
+    int rebuild = _map_old_tbl(hdr) != NULL;
+#ifdef MAP_TOMBSTONES
+    rebuild |= hdr->deleted != 0;
+#endif
+    if (new_cap || rebuild)
+        tbl = (char *)_map_resize_parallel_impl(tbl, new_cap ? new_cap : hdr->capacity, nthreads, elem_size,
+                                                header_size, kp);
+    hdr = (map_header *)(tbl - header_size);
+    if (n && !_map_grow_capacity_n(hdr, n)) {
+        _map_par_fill(tbl, items, n, 0, nthreads, elem_size, kp);
+        return tbl;
+    }
+    for (size_t i = 0; i < n; i++) {
+        const char *elem = (const char *)items + i * elem_size;
+        if (_map_field_is_zero(elem, kp.size))
+            continue;
+        size_t grow_cap = _map_grow_capacity(hdr);
+        if (grow_cap) {
+            tbl = (char *)_map_resize_impl(tbl, grow_cap, elem_size, header_size, kp);
+            _map_migrate(tbl, elem_size, kp, (size_t)-1);
+            hdr = (map_header *)(tbl - header_size);
+        }
+        size_t len = _map_field_key_len(elem, kp);
+        _map_par_put(tbl, elem, _map_hash_key(_map_field_key(elem, kp), len, kp), len, elem_size, kp);
+    }
+    return tbl;
+}
+
+/* ------------------------------------------------------------------
+   map_build_parallel(tbl, items, n, nthreads)
+   Inserts (or updates) the n elements at items with nthreads threads (0
+   for one per online CPU), with the same result as map_put_many.
+   - If (tbl) is NULL, a new map is allocated.
+   - The map is resized (in parallel) at most once, to fit all n items. If
+     that resize cannot allocate, the items are put one at a time as by
+     map_put, which drops new keys once the map is full and cannot grow.
+   - items must point to elements of the same type as *tbl, and must not
+     point into the map.
+   - Small maps use fewer threads (see MAP_PARALLEL_MIN_REGION).
+   Example:
+       Foo *table = NULL;
+       map_build_parallel(table, items, 100000000, 16);
+------------------------------------------------------------------ */
+#define map_build_parallel(tbl, items, n, nthreads)                                                                \
+    do {                                                                                                           \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(*(items)), __typeof__(*((__typeof__(tbl))0))),      \
+                       "items must point to elements of the same type as *tbl");                                   \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                                   \
+        (tbl) = (__typeof__(tbl))_map_build_parallel_impl((tbl), (items), (n), (nthreads),                         \
+                                                          sizeof(*((__typeof__(tbl))0)), MAP_HEADER_SIZE(tbl),     \
+                                                          MAP_KEY_POLICY(tbl));                                    \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   map_resize_parallel(tbl, new_cap, nthreads)
+   Resizes the map to new_cap buckets (rounded as for map_set_min_capacity,
+   and raised if needed to exceed the element count), re-inserting the
+   elements with nthreads threads (0 for one per online CPU).
+   - If (tbl) is NULL, an empty map with new_cap buckets is allocated.
+   Example:
+       map_resize_parallel(table, (size_t)200000000, 16);
+------------------------------------------------------------------ */
+#define map_resize_parallel(tbl, new_cap, nthreads)                                                            \
+    do {                                                                                                       \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(new_cap), size_t), "new_cap must be size_t");   \
+        MAP_CHECK_KEY_TYPE(tbl);                                                                               \
+        (tbl) = (__typeof__(tbl))_map_resize_parallel_impl((tbl), (new_cap), (nthreads),                       \
+                                                           sizeof(*((__typeof__(tbl))0)), MAP_HEADER_SIZE(tbl), \
+                                                           MAP_KEY_POLICY(tbl));                               \
+    } while (0)
+
+#endif  /* SIMPLE_PARALLEL_MAP_H */
@@ -0,0 +1,435 @@
+/*
+ * A read-mostly hash map whose readers never lock: writers publish immutable snapshots.
+ *
+ * The current contents are an ordinary simple_map that is never modified once published.
+ * A writer copies it with map_dup, edits the copy with the usual map_* macros, and
+ * publishes the copy with a single atomic pointer store. Readers pick up whichever
+ * snapshot is current and look keys up in it with map_get, without taking a lock or
+ * performing an atomic read-modify-write on shared memory.
+ *
+ * Old snapshots are reclaimed with epochs. Each registered reader owns a slot, padded to
+ * a cache line, in which it records the global epoch while it is inside a read section.
+ * A replaced snapshot is tagged with the epoch in which it was retired and is freed by
+ * a later write (or by rcu_map_synchronize) once no reader slot holds that epoch or an
+ * earlier one.
+ *
+ * The handle is a pointer to the current snapshot (T **), preceded by a hidden header:
+ *   - epoch:        Global epoch, advanced by every commit (starts at 1; 0 marks an idle reader).
+ *   - readers:      max_readers cache-line sized reader slots.
+ *   - retired:      Replaced snapshots that readers may still be using.
+ *   - write_lock:   Mutex that serializes writers.
+ *
+ * Default configuration:
+ *   - RCU_MAP_MAX_READERS_DEFAULT:  Number of reader slots used when rcu_map_init is given 0.
+ *   - Everything else (key types, hash function, storage modes) is configured as for
+ *     simple_map.h.
+ *
+ * Usage notes:
+ *   - Requires POSIX threads (compile and link with -pthread).
+ *   - Every reading thread registers once with rcu_map_reader_register and passes the
+ *     returned slot to rcu_map_read_lock and rcu_map_read_unlock. Read sections do not nest.
+ *   - A snapshot, and every pointer into it, is only valid until rcu_map_read_unlock.
+ *     Readers must not modify it.
+ *   - Each write copies the whole map, so it costs O(capacity). This is meant for data
+ *     that is read many times more often than it is written; batch several edits into
+ *     one rcu_map_update_begin/commit pair when possible.
+ *   - Copies are shallow. Memory owned by an element that a write removes or replaces
+ *     may still be in use by readers, and may only be freed after rcu_map_synchronize.
+ *   - rcu_map_init and rcu_map_free must not race with other operations on the map.
+ *
+ * Public API macros:
+ *   - rcu_map_init(m, max_readers):           Allocates a map with max_readers reader slots.
+ *   - rcu_map_reader_register(m):             Claims a reader slot; returns its index, or -1 if none is free.
+ *   - rcu_map_reader_unregister(m, reader):   Releases a reader slot.
+ *   - rcu_map_read_lock(m, reader):           Enters a read section; returns the current snapshot (may be NULL).
+ *   - rcu_map_read_unlock(m, reader):         Leaves the read section.
+ *   - rcu_map_update_begin(m, copy):          Locks out other writers and sets copy to a copy of the snapshot.
+ *   - rcu_map_update_commit(m, copy):         Publishes copy and ends the update.
+ *   - rcu_map_update_abort(m, copy):          Discards copy and ends the update.
+ *   - rcu_map_put(m, item):                   Publishes a snapshot with item inserted or updated.
+ *   - rcu_map_delete(m, key):                 Publishes a snapshot without the element with the given key.
+ *   - rcu_map_synchronize(m):                 Waits for current readers and frees every retired snapshot.
+ *   - rcu_map_free(m):                        Frees the map.
+ *   - rcu_map_free_free(m, free_func):        Frees the map, calling free_func for each element of the snapshot.
+ */
+
+#ifndef SIMPLE_RCU_MAP_H
+#define SIMPLE_RCU_MAP_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include "simple_map.h"
+
+#ifndef RCU_MAP_MAX_READERS_DEFAULT
+#define RCU_MAP_MAX_READERS_DEFAULT 64
+#endif
+
+#define RCU_MAP_MAGIC_NUMBER 0x5c0feb0c
+
+/* A reader slot, padded to a cache line so that readers only ever write to their own line.
+ * Fields:
+ *   - epoch:   Global epoch seen when the reader entered its read section, or 0 outside of one.
+ *   - in_use:  Non-zero while the slot is registered.
+ */
+typedef struct {
+    uint64_t epoch;
+    uint32_t in_use;
+} __attribute__((aligned(64))) rcu_map_reader;
+
+/* A replaced snapshot waiting for the readers that may use it */
+typedef struct rcu_map_retired {
+    struct rcu_map_retired *next;
+    void *tbl;      /* the snapshot's bucket array */
+    uint64_t epoch; /* global epoch when it was replaced */
+} rcu_map_retired;
+
+/* Hidden header stored immediately before the current snapshot pointer.
+ * Fields:
+ *   - write_lock:      Held by the writer between update_begin and commit or abort.
+ *   - retired:         Replaced snapshots, newest first.
+ *   - readers:         max_readers reader slots.
+ *   - readers_raw:     The allocation that readers was aligned within.
+ *   - max_readers:     Number of reader slots.
+ *   - elem_size:       Size of an element, used to free retired snapshots.
+ *   - map_header_size: MAP_HEADER_SIZE of the snapshots.
+ *   - epoch:           Global epoch. Only written by the writer holding write_lock.
+ */
+typedef struct {
+    pthread_mutex_t write_lock;
+    rcu_map_retired *retired;
+    rcu_map_reader *readers;
+    void *readers_raw;
+    size_t max_readers;
+    size_t elem_size;
+    size_t map_header_size;
+    uint64_t epoch;
+#ifndef SIMPLE_DS_NO_MAGIC
+    uint32_t magic_number; // Used to assert that the header is valid
+#endif
+} rcu_map_header;
+
+/* Compute the header size, rounded up so that the snapshot pointer stays aligned */
+#define RCU_MAP_HEADER_SIZE \
+    (((sizeof(rcu_map_header) + __alignof__(void *) - 1) / __alignof__(void *)) * __alignof__(void *))
+
+/* Given a map handle, RCU_MAP_HEADER returns a pointer to its hidden header */
+#define RCU_MAP_HEADER(m) ({                                                       \
+    rcu_map_header *hdr = ((rcu_map_header *)((char *)(m) - RCU_MAP_HEADER_SIZE)); \
+    SIMPLE_DS_CHECK_MAGIC(hdr, RCU_MAP_MAGIC_NUMBER);                              \
+    hdr;                                                                           \
+})
+
+/* ------------------------------------------------------------------
+   Internal function: _rcu_map_alloc_impl
+   Allocates the header, an empty (NULL) snapshot pointer and max_readers
+   reader slots (0 selects RCU_MAP_MAX_READERS_DEFAULT) for a map whose
+   snapshots have the given element and map header sizes. Returns a
+   pointer to the snapshot pointer, or NULL.
+------------------------------------------------------------------ */
+static inline void **_rcu_map_alloc_impl(size_t max_readers, size_t elem_size, size_t map_header_size) {
+    if (!max_readers)
+        max_readers = RCU_MAP_MAX_READERS_DEFAULT;
+    rcu_map_header *hdr = (rcu_map_header *)SIMPLE_DS_CALLOC(1, RCU_MAP_HEADER_SIZE + sizeof(void *));
+    if (!hdr)
+        return NULL;
+    hdr->readers_raw = SIMPLE_DS_CALLOC(1, max_readers * sizeof(rcu_map_reader) + __alignof__(rcu_map_reader) - 1);
+    if (!hdr->readers_raw) {
+        SIMPLE_DS_FREE(hdr);
+        return NULL;
+    }
+    uintptr_t aligned = ((uintptr_t)hdr->readers_raw + __alignof__(rcu_map_reader) - 1) &
+                        ~(uintptr_t)(__alignof__(rcu_map_reader) - 1);
+    hdr->readers = (rcu_map_reader *)aligned;
+    pthread_mutex_init(&hdr->write_lock, NULL);
+    hdr->max_readers = max_readers;
+    hdr->elem_size = elem_size;
+    hdr->map_header_size = map_header_size;
+    hdr->epoch = 1;
+    SIMPLE_DS_SET_MAGIC(hdr, RCU_MAP_MAGIC_NUMBER);
+    return (void **)((char *)hdr + RCU_MAP_HEADER_SIZE);
+}
+
+/* ------------------------------------------------------------------
+   rcu_map_init(m, max_readers)
+   Allocates an empty map with max_readers reader slots (0 selects
+   RCU_MAP_MAX_READERS_DEFAULT) if (m) is NULL. m is declared as a pointer
+   to pointers to the element type.
+   Example:
+       Foo **table = NULL;
+       rcu_map_init(table, 0);
+------------------------------------------------------------------ */
+#define rcu_map_init(m, max_readers)                                                                \
+    do {                                                                                            \
+        if (!(m)) {                                                                                 \
+            (m) = (__typeof__(m))_rcu_map_alloc_impl((size_t)(max_readers), sizeof(**(m)),          \
+                                                     MAP_HEADER_SIZE(*(m)));                        \
+        }                                                                                           \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   rcu_map_reader_register(m)
+   rcu_map_reader_unregister(m, reader)
+   rcu_map_reader_register claims a free reader slot for the calling
+   thread and returns its index, or -1 if every slot is taken. A slot is
+   used by one thread at a time and must be outside of a read section when
+   it is released with rcu_map_reader_unregister.
+------------------------------------------------------------------ */
+static inline int _rcu_map_reader_register_impl(void **m) {
+    rcu_map_header *hdr = RCU_MAP_HEADER(m);
+    for (size_t i = 0; i < hdr->max_readers; i++) {
+        uint32_t expected = 0;
+        if (__atomic_compare_exchange_n(&hdr->readers[i].in_use, &expected, 1, 0, __ATOMIC_ACQUIRE,
+                                        __ATOMIC_RELAXED))
+            return (int)i;
+    }
+    return -1;
+}
+
+static inline void _rcu_map_reader_unregister_impl(void **m, int reader) {
+    rcu_map_header *hdr = RCU_MAP_HEADER(m);
+    assert(reader >= 0 && (size_t)reader < hdr->max_readers);
+    assert(__atomic_load_n(&hdr->readers[reader].epoch, __ATOMIC_RELAXED) == 0);
+    __atomic_store_n(&hdr->readers[reader].in_use, 0, __ATOMIC_RELEASE);
+}
+
+#define rcu_map_reader_register(m)           _rcu_map_reader_register_impl((void **)(m))
+#define rcu_map_reader_unregister(m, reader) _rcu_map_reader_unregister_impl((void **)(m), (reader))
+
+/* ------------------------------------------------------------------
+   Internal function: _rcu_map_read_lock_impl
+   Records the global epoch in the reader's slot and then loads the current
+   snapshot. The slot store is ordered before the snapshot load, so a writer
+   that replaces this snapshot afterwards is bound to see the slot and keep
+   the snapshot alive. The only store is to the reader's own cache line.
+------------------------------------------------------------------ */
+static inline void *_rcu_map_read_lock_impl(void **m, int reader) {
+    rcu_map_header *hdr = RCU_MAP_HEADER(m);
+    assert(reader >= 0 && (size_t)reader < hdr->max_readers);
+    rcu_map_reader *slot = &hdr->readers[reader];
+    assert(slot->epoch == 0 && "read sections do not nest");
+    __atomic_store_n(&slot->epoch, __atomic_load_n(&hdr->epoch, __ATOMIC_ACQUIRE), __ATOMIC_SEQ_CST);
+    return __atomic_load_n(m, __ATOMIC_SEQ_CST);
+}
+
+static inline void _rcu_map_read_unlock_impl(void **m, int reader) {
+    rcu_map_header *hdr = RCU_MAP_HEADER(m);
+    __atomic_store_n(&hdr->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* ------------------------------------------------------------------
+   rcu_map_read_lock(m, reader)
+   rcu_map_read_unlock(m, reader)
+   rcu_map_read_lock enters a read section for the registered reader slot
+   and returns the current snapshot (NULL while the map is empty), which
+   is searched with map_get or iterated with map_foreach. The snapshot,
+   and every element pointer obtained from it, may only be used until
+   rcu_map_read_unlock. Neither call blocks or is blocked by writers.
+   Example:
+       int reader = rcu_map_reader_register(table);
+       Foo *snap = rcu_map_read_lock(table, reader);
+       Foo *item = map_get(snap, key);
+       if (item)
+           use(item->value);
+       rcu_map_read_unlock(table, reader);
+------------------------------------------------------------------ */
+#define rcu_map_read_lock(m, reader)   ((__typeof__(*(m)))_rcu_map_read_lock_impl((void **)(m), (reader)))
+#define rcu_map_read_unlock(m, reader) _rcu_map_read_unlock_impl((void **)(m), (reader))
+
+/* Frees the block of a snapshot (without calling any free_func) */
+static inline void _rcu_map_free_snapshot(rcu_map_header *hdr, void *tbl) {
+    _map_free_block(tbl, hdr->elem_size, hdr->map_header_size);
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _rcu_map_reclaim
+   Frees every retired snapshot that no reader can still be using, that is,
+   every snapshot retired in an epoch older than the oldest epoch recorded
+   in a reader slot. Must be called with write_lock held. Returns non-zero
+   if retired snapshots remain.
+------------------------------------------------------------------ */
+static inline int _rcu_map_reclaim(rcu_map_header *hdr) {
+    uint64_t oldest = UINT64_MAX;
+    for (size_t i = 0; i < hdr->max_readers; i++) {
+        uint64_t epoch = __atomic_load_n(&hdr->readers[i].epoch, __ATOMIC_SEQ_CST);
+        if (epoch && epoch < oldest)
+            oldest = epoch;
+    }
+    rcu_map_retired **link = &hdr->retired;
+    while (*link) {
+        rcu_map_retired *node = *link;
+        if (node->epoch < oldest) {
+            *link = node->next;
+            _rcu_map_free_snapshot(hdr, node->tbl);
+            SIMPLE_DS_FREE(node);
+        } else {
+            link = &node->next;
+        }
+    }
+    return hdr->retired != NULL;
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _rcu_map_commit_impl
+   Publishes copy (which may be NULL) as the current snapshot, advances the
+   epoch, retires the previous snapshot, frees whatever retired snapshots
+   the readers have moved past, and releases write_lock. A pending
+   incremental migration of copy is finished first, so that readers never
+   find work to do in it. If the retired list cannot grow, the writer waits
+   for the readers and frees the previous snapshot directly.
+------------------------------------------------------------------ */
+static inline void _rcu_map_commit_impl(void **m, void *copy, map_key_policy kp) {
+    rcu_map_header *hdr = RCU_MAP_HEADER(m);
+    _map_migrate(copy, hdr->elem_size, kp, (size_t)-1);
+    void *prev = *m;
+    uint64_t epoch = hdr->epoch;
+    __atomic_store_n(m, copy, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&hdr->epoch, epoch + 1, __ATOMIC_SEQ_CST);
+    if (prev) {
+        rcu_map_retired *node = (rcu_map_retired *)SIMPLE_DS_MALLOC(sizeof(rcu_map_retired));
+        if (node) {
+            node->next = hdr->retired;
+            node->tbl = prev;
+            node->epoch = epoch;
+            hdr->retired = node;
+        } else {
+            for (size_t i = 0; i < hdr->max_readers; i++) {
+                uint64_t seen;
+                while ((seen = __atomic_load_n(&hdr->readers[i].epoch, __ATOMIC_SEQ_CST)) && seen <= epoch)
+                    sched_yield();
+            }
+            _rcu_map_free_snapshot(hdr, prev);
+        }
+    }
+    _rcu_map_reclaim(hdr);
+    pthread_mutex_unlock(&hdr->write_lock);
+}
+
+/* ------------------------------------------------------------------
+   rcu_map_update_begin(m, copy)
+   rcu_map_update_commit(m, copy)
+   rcu_map_update_abort(m, copy)
+   rcu_map_update_begin waits for any other writer, then sets copy (a
+   pointer to the element type) to a private copy of the current snapshot
+   (NULL if the map is empty) and returns non-zero. It returns 0, without
+   starting an update, if the copy cannot be allocated. The copy is edited
+   with the ordinary map_* macros and then either published with
+   rcu_map_update_commit, or discarded with rcu_map_update_abort. Both end
+   the update and set copy to NULL. Readers keep seeing the previous
+   snapshot until the commit.
+   Example:
+       Foo *copy;
+       if (rcu_map_update_begin(table, copy)) {
+           map_put(copy, item1);
+           map_delete(copy, "old");
+           rcu_map_update_commit(table, copy);
+       }
+------------------------------------------------------------------ */
+#define rcu_map_update_begin(m, copy)                                                               \
+    ({                                                                                              \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(copy), __typeof__(*(m))),            \
+                       "copy must be a pointer to the element type");                               \
+        rcu_map_header *_rub_hdr = RCU_MAP_HEADER(m);                                               \
+        pthread_mutex_lock(&_rub_hdr->write_lock);                                                  \
+        __typeof__(*(m)) _rub_cur = *(m);                                                           \
+        (copy) = map_dup(_rub_cur);                                                                 \
+        int _rub_ok = !_rub_cur || (copy);                                                          \
+        if (!_rub_ok)                                                                               \
+            pthread_mutex_unlock(&_rub_hdr->write_lock);                                            \
+        _rub_ok;                                                                                    \
+    })
+
+#define rcu_map_update_commit(m, copy)                                                              \
+    do {                                                                                            \
+        _rcu_map_commit_impl((void **)(m), (copy), MAP_KEY_POLICY(*(m)));                           \
+        (copy) = NULL;                                                                              \
+    } while (0)
+
+#define rcu_map_update_abort(m, copy)                                                               \
+    do {                                                                                            \
+        map_free(copy);                                                                             \
+        pthread_mutex_unlock(&RCU_MAP_HEADER(m)->write_lock);                                       \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   rcu_map_put(m, item)
+   rcu_map_delete(m, key)
+   Publish a new snapshot with item inserted (or updated), or with the
+   element with the given key removed. Each call copies the whole map;
+   use rcu_map_update_begin to batch several edits into one copy.
+   Return non-zero on success, or 0 if the copy could not be allocated.
+------------------------------------------------------------------ */
+#define rcu_map_put(m, item)                                                                        \
+    ({                                                                                              \
+        __typeof__(*(m)) _rp_copy;                                                                  \
+        int _rp_ok = rcu_map_update_begin(m, _rp_copy);                                             \
+        if (_rp_ok) {                                                                               \
+            map_put(_rp_copy, item);                                                                \
+            rcu_map_update_commit(m, _rp_copy);                                                     \
+        }                                                                                           \
+        _rp_ok;                                                                                     \
+    })
+
+#define rcu_map_delete(m, key)                                                                      \
+    ({                                                                                              \
+        __typeof__(*(m)) _rd_copy;                                                                  \
+        int _rd_ok = rcu_map_update_begin(m, _rd_copy);                                             \
+        if (_rd_ok) {                                                                               \
+            map_delete(_rd_copy, key);                                                              \
+            rcu_map_update_commit(m, _rd_copy);                                                     \
+        }                                                                                           \
+        _rd_ok;                                                                                     \
+    })
+
+/* ------------------------------------------------------------------
+   rcu_map_synchronize(m)
+   Waits until every reader that was inside a read section has left it,
+   then frees every retired snapshot. Afterwards no reader can reach an
+   element that was removed or replaced before the call, so memory they
+   owned may be freed. Must not be called from inside a read section.
+------------------------------------------------------------------ */
+static inline void _rcu_map_synchronize_impl(void **m) {
+    rcu_map_header *hdr = RCU_MAP_HEADER(m);
+    pthread_mutex_lock(&hdr->write_lock);
+    /* Readers that enter from now on see the new epoch, so only the current ones are waited for */
+    __atomic_store_n(&hdr->epoch, hdr->epoch + 1, __ATOMIC_SEQ_CST);
+    while (_rcu_map_reclaim(hdr))
+        sched_yield();
+    pthread_mutex_unlock(&hdr->write_lock);
+}
+
+#define rcu_map_synchronize(m) _rcu_map_synchronize_impl((void **)(m))
+
+/* ------------------------------------------------------------------
+   rcu_map_free_free(m, free_func)
+   rcu_map_free(m)
+   Frees the current snapshot (calling free_func on each of its elements,
+   see map_free_free), every retired snapshot (without calling free_func,
+   since their elements are shallow copies), the reader slots and the
+   header, and sets m to NULL. The map must not be in use by other threads.
+------------------------------------------------------------------ */
+#define rcu_map_free_free(m, free_func)                                               \
+    do {                                                                              \
+        __typeof__(m) _rf_m = (m);                                                    \
+        if (_rf_m) {                                                                  \
+            rcu_map_header *_rf_hdr = RCU_MAP_HEADER(_rf_m);                          \
+            map_free_free(*_rf_m, free_func);                                         \
+            while (_rf_hdr->retired) {                                                \
+                rcu_map_retired *_rf_node = _rf_hdr->retired;                         \
+                _rf_hdr->retired = _rf_node->next;                                    \
+                _rcu_map_free_snapshot(_rf_hdr, _rf_node->tbl);                       \
+                SIMPLE_DS_FREE(_rf_node);                                             \
+            }                                                                         \
+            pthread_mutex_destroy(&_rf_hdr->write_lock);                              \
+            SIMPLE_DS_FREE(_rf_hdr->readers_raw);                                     \
+            SIMPLE_DS_FREE(_rf_hdr);                                                  \
+            (m) = NULL;                                                               \
+        }                                                                             \
+    } while (0)
+#define rcu_map_free(m) rcu_map_free_free(m, NULL)
+
+#endif  /* SIMPLE_RCU_MAP_H */
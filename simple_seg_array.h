@@ -0,0 +1,264 @@
+/*
+ * A segmented dynamic array whose elements never move.
+ *
+ * Elements are stored in fixed-size blocks of SEG_ARRAY_BLOCK_SIZE elements (a power of
+ * two), reached through a small directory of block pointers. Growing the array allocates
+ * one more block and, occasionally, doubles the directory; existing elements are never
+ * copied, so a push is O(1) without amortization and pointers to elements stay valid
+ * until the element is popped or the array is freed. Element i is at
+ * arr[i >> SEG_ARRAY_BLOCK_SHIFT][i & SEG_ARRAY_BLOCK_MASK].
+ *
+ * The handle is a pointer to the directory (T **), preceded by a hidden header:
+ *   - count:          Number of elements in the array.
+ *   - nblocks:        Number of allocated blocks (capacity is nblocks * SEG_ARRAY_BLOCK_SIZE).
+ *   - dir_capacity:   Number of entries the directory has room for.
+ *   - allocator:      Allocator used for the blocks and directory (NULL for SIMPLE_DS_MALLOC and friends).
+ *
+ * Default configuration:
+ *   - SEG_ARRAY_BLOCK_SHIFT:     log2 of the number of elements per block.
+ *   - SEG_ARRAY_DIR_INIT:        Initial number of directory entries.
+ *
+ * Usage notes:
+ *   - The element type can be any type.
+ *   - The handle itself moves when the directory grows (like a simple_array pointer),
+ *     but pointers to elements do not.
+ *   - Popping never shrinks the array below one spare block, so alternating pushes and
+ *     pops at a block boundary do not allocate.
+ *
+ * Public API macros (the seg_array_* counterparts of the simple_array.h macros):
+ *   - seg_array_count(arr):                      Returns the number of elements in the array.
+ *   - seg_array_capacity(arr):                   Returns the number of elements the allocated blocks hold.
+ *   - seg_array_at(arr, index):                  Returns a pointer to the element at index.
+ *   - seg_array_push(arr, item):                 Appends an item to the array.
+ *   - seg_array_pop(arr):                        Removes the last item from the array and returns it.
+ *   - seg_array_set_min_capacity(arr, min_cap):  Ensures the array has at least min_cap capacity.
+ *   - seg_array_set_allocator(arr, allocator):   Binds an empty array to a simple_allocator (see simple_alloc.h).
+ *   - seg_array_clear(arr):                      Resets the array's count to zero, keeping its blocks.
+ *   - seg_array_free(arr):                       Frees the array.
+ *   - seg_array_free_free(arr, free_func):       Frees the array, calling free_func for each item.
+ */
+
+#ifndef SIMPLE_SEG_ARRAY_H
+#define SIMPLE_SEG_ARRAY_H
+
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <assert.h>
+
+#include "simple_alloc.h"
+
+#ifndef SEG_ARRAY_BLOCK_SHIFT
+#define SEG_ARRAY_BLOCK_SHIFT 8
+#endif
+
+#ifndef SEG_ARRAY_DIR_INIT
+#define SEG_ARRAY_DIR_INIT 8
+#endif
+
+#define SEG_ARRAY_BLOCK_SIZE ((size_t)1 << SEG_ARRAY_BLOCK_SHIFT)
+#define SEG_ARRAY_BLOCK_MASK (SEG_ARRAY_BLOCK_SIZE - 1)
+
+#define SEG_ARRAY_MAGIC_NUMBER 0x5e9a77a1
+
+typedef struct {
+    size_t count;
+    size_t nblocks;
+    size_t dir_capacity;
+    const simple_allocator *allocator;
+#ifndef SIMPLE_DS_NO_MAGIC
+    uint32_t magic_number; // Used to assert that the header is valid
+#endif
+} seg_array_header;
+
+/* Compute the header size, rounded up so that the directory stays aligned */
+#define SEG_ARRAY_HEADER_SIZE \
+    (((sizeof(seg_array_header) + __alignof__(void *) - 1) / __alignof__(void *)) * __alignof__(void *))
+
+/* Given an array handle, get a pointer to the hidden header */
+#define SEG_ARRAY_HEADER(arr) ({                                                           \
+    seg_array_header *hdr = ((seg_array_header *)((char *)(arr) - SEG_ARRAY_HEADER_SIZE)); \
+    SIMPLE_DS_CHECK_MAGIC(hdr, SEG_ARRAY_MAGIC_NUMBER);                                    \
+    hdr;                                                                                   \
+})
+
+/* Query macros */
+#define seg_array_count(arr)    ((arr) ? SEG_ARRAY_HEADER(arr)->count : 0)
+#define seg_array_capacity(arr) ((arr) ? SEG_ARRAY_HEADER(arr)->nblocks * SEG_ARRAY_BLOCK_SIZE : 0)
+
+/* Pointer to the element at index (which must be below the capacity): a shift and a mask */
+#define seg_array_at(arr, index) \
+    ((arr)[(size_t)(index) >> SEG_ARRAY_BLOCK_SHIFT] + ((size_t)(index) & SEG_ARRAY_BLOCK_MASK))
+
+/* ------------------------------------------------------------------
+   Internal function: _seg_array_alloc_impl
+   Allocates an empty array (header and a directory of SEG_ARRAY_DIR_INIT
+   entries, no blocks) from allocator. Returns the directory, or NULL.
+------------------------------------------------------------------ */
+static inline void **_seg_array_alloc_impl(const simple_allocator *allocator) {
+    size_t size = SEG_ARRAY_HEADER_SIZE + SEG_ARRAY_DIR_INIT * sizeof(void *);
+    seg_array_header *hdr = (seg_array_header *)simple_ds_malloc(allocator, size);
+    if (!hdr)
+        return NULL;
+    hdr->count = 0;
+    hdr->nblocks = 0;
+    hdr->dir_capacity = SEG_ARRAY_DIR_INIT;
+    hdr->allocator = allocator;
+    SIMPLE_DS_SET_MAGIC(hdr, SEG_ARRAY_MAGIC_NUMBER);
+    return (void **)((char *)hdr + SEG_ARRAY_HEADER_SIZE);
+}
+
+/* ------------------------------------------------------------------
+   Internal function: _seg_array_reserve_impl
+   Allocates blocks until dir (which may be NULL) can hold min_cap elements,
+   doubling the directory when it is full. Blocks that already exist are
+   never moved. Returns the (possibly moved) directory, or NULL if the
+   array could not be allocated; if a later block cannot be allocated,
+   the array is returned with the blocks allocated so far.
+------------------------------------------------------------------ */
+static inline void **_seg_array_reserve_impl(void **dir, size_t min_cap, size_t elem_size) {
+    if (!dir && !(dir = _seg_array_alloc_impl(NULL)))
+        return NULL;
+    seg_array_header *hdr = SEG_ARRAY_HEADER(dir);
+    size_t needed = (min_cap + SEG_ARRAY_BLOCK_MASK) >> SEG_ARRAY_BLOCK_SHIFT;
+    while (hdr->nblocks < needed) {
+        if (hdr->nblocks == hdr->dir_capacity) {
+            size_t new_dir_cap = hdr->dir_capacity * 2;
+            seg_array_header *new_hdr = (seg_array_header *)simple_ds_realloc(
+                hdr->allocator, hdr, SEG_ARRAY_HEADER_SIZE + hdr->dir_capacity * sizeof(void *),
+                SEG_ARRAY_HEADER_SIZE + new_dir_cap * sizeof(void *));
+            if (!new_hdr)
+                break;
+            hdr = new_hdr;
+            hdr->dir_capacity = new_dir_cap;
+            dir = (void **)((char *)hdr + SEG_ARRAY_HEADER_SIZE);
+        }
+        void *block = simple_ds_malloc(hdr->allocator, SEG_ARRAY_BLOCK_SIZE * elem_size);
+        if (!block)
+            break;
+        dir[hdr->nblocks++] = block;
+    }
+    return dir;
+}
+
+/* Append an item to the end of the array.
+ * The type of 'item' must match the element type (i.e. **arr).
+ * If a block (or the directory) cannot be allocated, the item is not stored and the
+ * elements and count of the array are left unchanged.
+ */
+#define seg_array_push(arr, item)                                                                   \
+    do {                                                                                            \
+        __typeof__(item) _sp_item = (item);                                                         \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(_sp_item), __typeof__(**(arr))),     \
+                       "item must be of the same type as **arr");                                   \
+        __typeof__(arr) _sp_a = (arr);                                                              \
+        size_t _sp_count = seg_array_count(_sp_a);                                                  \
+        if (!_sp_a || _sp_count == seg_array_capacity(_sp_a)) {                                     \
+            _sp_a = (__typeof__(arr))_seg_array_reserve_impl((void **)_sp_a, _sp_count + 1,         \
+                                                             sizeof(**(arr)));                      \
+        }                                                                                           \
+        if (_sp_count < seg_array_capacity(_sp_a)) {                                                \
+            *seg_array_at(_sp_a, _sp_count) = _sp_item;                                             \
+            SEG_ARRAY_HEADER(_sp_a)->count = _sp_count + 1;                                         \
+        }                                                                                           \
+        (arr) = _sp_a;                                                                              \
+    } while (0)
+
+/* Frees the last block if the array has more than one block's worth of spare capacity */
+static inline void _seg_array_trim(void **dir, size_t elem_size) {
+    seg_array_header *hdr = SEG_ARRAY_HEADER(dir);
+    if (hdr->nblocks * SEG_ARRAY_BLOCK_SIZE - hdr->count > SEG_ARRAY_BLOCK_SIZE) {
+        hdr->nblocks--;
+        simple_ds_free(hdr->allocator, dir[hdr->nblocks], SEG_ARRAY_BLOCK_SIZE * elem_size);
+    }
+}
+
+/* Remove the last item from the array and return it (a zeroed element if the array is empty). */
+#define seg_array_pop(arr)                                                             \
+    ({                                                                                 \
+        __typeof__(**(arr)) _spop_val;                                                 \
+        memset(&_spop_val, 0, sizeof(_spop_val));                                      \
+        __typeof__(arr) _spop_a = (arr);                                               \
+        if (_spop_a) {                                                                 \
+            seg_array_header *_spop_hdr = SEG_ARRAY_HEADER(_spop_a);                   \
+            if (_spop_hdr->count > 0) {                                                \
+                size_t _spop_last = --_spop_hdr->count;                                \
+                _spop_val = *seg_array_at(_spop_a, _spop_last);                        \
+                _seg_array_trim((void **)_spop_a, sizeof(**(arr)));                    \
+            }                                                                          \
+        }                                                                              \
+        _spop_val;                                                                     \
+    })
+
+/* Ensure the array has at least min_cap capacity.
+ * min_cap must be a size_t.
+ */
+#define seg_array_set_min_capacity(arr, min_cap)                                                    \
+    do {                                                                                            \
+        _Static_assert(__builtin_types_compatible_p(__typeof__(min_cap), size_t),                   \
+                       "min_cap must be size_t");                                                   \
+        (arr) = (__typeof__(arr))_seg_array_reserve_impl((void **)(arr), (min_cap),                 \
+                                                         sizeof(**(arr)));                          \
+    } while (0)
+
+/* Bind the array to allocator (a const simple_allocator *, or NULL for SIMPLE_DS_MALLOC
+ * and friends), which is then used for every block and for the directory.
+ * The array must be NULL or empty, since its blocks cannot be moved; any blocks
+ * it already has are freed.
+ * Example:
+ *     seg_array_set_allocator(arr, simple_arena_allocator(&arena));
+ */
+#define seg_array_set_allocator(arr, alloc)                                                         \
+    do {                                                                                            \
+        const simple_allocator *_ssa_allocator = (alloc);                                           \
+        assert(seg_array_count(arr) == 0 && "seg_array_set_allocator needs an empty array");        \
+        seg_array_free(arr);                                                                        \
+        (arr) = (__typeof__(arr))_seg_array_alloc_impl(_ssa_allocator);                             \
+    } while (0)
+
+/* Clear the array (set count to zero), keeping one block for reuse. */
+#define seg_array_clear(arr)                                                            \
+    do {                                                                                \
+        if (arr) {                                                                      \
+            SEG_ARRAY_HEADER(arr)->count = 0;                                           \
+            while (SEG_ARRAY_HEADER(arr)->nblocks > 1) {                                \
+                _seg_array_trim((void **)(arr), sizeof(**(arr)));                       \
+            }                                                                           \
+        }                                                                               \
+    } while (0)
+
+/* ------------------------------------------------------------------
+   seg_array_free_free(arr, free_func)
+   Frees every block, the directory and the hidden header and, if
+   provided, calls free_func on every element (from index 0 to count–1)
+   first. See array_free_free for the forms free_func may take.
+   - If (arr) is NULL, no action is taken.
+------------------------------------------------------------------ */
+#define seg_array_free_free(arr, free_func)                                                         \
+    do {                                                                                            \
+        if (arr) {                                                                                  \
+            __typeof__(arr) _sff_arr = (arr);                                                       \
+            void (^_sff_free_func)(__typeof__(**_sff_arr)) =                                        \
+                _Generic((free_func),                                                               \
+                    void (*)(__typeof__(**_sff_arr)): (free_func),                                  \
+                    void (^)(__typeof__(**_sff_arr)): (free_func),                                  \
+                    default: ((void (^)(__typeof__(**_sff_arr)))0)                                  \
+                );                                                                                  \
+            seg_array_header *_sff_hdr = SEG_ARRAY_HEADER(_sff_arr);                                \
+            for (size_t _sff_i = 0; _sff_free_func && _sff_i < _sff_hdr->count; _sff_i++) {         \
+                _sff_free_func(*seg_array_at(_sff_arr, _sff_i));                                    \
+            }                                                                                       \
+            for (size_t _sff_b = 0; _sff_b < _sff_hdr->nblocks; _sff_b++) {                         \
+                simple_ds_free(_sff_hdr->allocator, _sff_arr[_sff_b],                               \
+                               SEG_ARRAY_BLOCK_SIZE * sizeof(**_sff_arr));                          \
+            }                                                                                       \
+            simple_ds_free(_sff_hdr->allocator, _sff_hdr,                                           \
+                           SEG_ARRAY_HEADER_SIZE + _sff_hdr->dir_capacity * sizeof(void *));        \
+            (arr) = NULL;                                                                           \
+        }                                                                                           \
+    } while (0)
+
+/* Free the array, its blocks and its hidden header. */
+#define seg_array_free(arr) seg_array_free_free(arr, NULL)
+
+#endif  /* SIMPLE_SEG_ARRAY_H */